@@ -0,0 +1,830 @@
+// load generator for the server: many connections over protocol v2, each
+// keeping a pipeline of downloads and uploads picked from a weighted mix.
+// reports throughput and latency percentiles, optionally as json so that
+// builds can be compared
+#include "common.h"
+#include "histogram.h"
+#include "tls.h"
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#define eprintf(...) fprintf(stderr, __VA_ARGS__)
+
+// v2 request flag: the resp carries the crc32c of the file content
+const char FLAG_CHECKSUM = 0x02;
+// upload bodies are cut from this much random content
+const size_t PAYLOAD_LEN = 1024 * 1024;
+const size_t READ_BUFFER_LEN = 256 * 1024;
+const int MAX_IOVECS = 64;
+const int MAX_EVENTS = 256;
+// a run with nothing completing for this long has a stuck server
+const uint64_t STALL_NS = 10ull * 1000000000;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// one kind of request in the mix, picked with probability weight / total
+struct Op {
+  bool upload;
+  uint64_t size;
+  int weight;
+  // as given on the command line, e.g. download:4k
+  std::string label;
+};
+
+struct Config {
+  std::vector<Op> mix;
+  int total_weight;
+  int connections;
+  int threads;
+  int pipeline;
+  // requests to complete, or seconds to run for when duration > 0
+  uint64_t requests;
+  double duration;
+  bool checksum;
+  const char *mix_arg;
+  // connections speak tls when set
+  SSL_CTX *tls;
+};
+
+// request bytes waiting to be written: a header, then body_len bytes of the
+// payload
+struct Chunk {
+  std::string header;
+  uint64_t body_len;
+};
+
+// a request whose resp hasn't been received yet
+struct Pending {
+  // index in the mix
+  int op;
+  uint64_t start;
+};
+
+struct Conn {
+  int fd;
+  // NULL for plain tcp
+  SSL *ssl;
+  std::string upload_name;
+  std::deque<Chunk> out;
+  // bytes of out.front() written already
+  uint64_t out_off;
+  std::deque<Pending> pending;
+  // where the parser is in the resp to pending.front()
+  enum Stage { Resp, Length, Body, Crc } stage;
+  uint64_t length;
+  int shift;
+  uint64_t remaining;
+  // the length didn't match the file
+  bool bad;
+  bool closed;
+};
+
+// connections driven by one thread, and what was measured on them
+struct Worker {
+  const Config *config;
+  std::vector<Conn> conns;
+  int epoll_fd;
+  // requests left to issue when running for a number of requests
+  uint64_t budget;
+  uint64_t deadline;
+  uint64_t rng;
+  uint64_t inflight;
+  // connections not closed
+  size_t open;
+  uint64_t last_progress;
+  // one per op of the mix
+  std::vector<Histogram> latency;
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t sent_bytes;
+  uint64_t received_bytes;
+  uint64_t end;
+  // requests copied together for openssl, which takes no iovecs
+  std::vector<uint8_t> gather;
+};
+
+static uint8_t payload[PAYLOAD_LEN];
+
+// name of the file downloads of size bytes fetch, uploaded before the run
+std::string download_name(uint64_t size) {
+  return "bench-" + std::to_string((unsigned long long)size);
+}
+
+// parse a mix like download:4k:80,upload:64k:20, the weight defaults to 1
+bool parse_mix(const char *arg, std::vector<Op> *mix) {
+  std::string s = arg;
+  size_t begin = 0;
+  while (begin <= s.size()) {
+    size_t end = s.find(',', begin);
+    if (end == std::string::npos) {
+      end = s.size();
+    }
+    std::string item = s.substr(begin, end - begin);
+    begin = end + 1;
+
+    size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      return false;
+    }
+    Op op;
+    std::string kind = item.substr(0, colon);
+    if (kind == "download") {
+      op.upload = false;
+    } else if (kind == "upload") {
+      op.upload = true;
+    } else {
+      return false;
+    }
+    std::string size = item.substr(colon + 1);
+    op.weight = 1;
+    size_t colon2 = size.find(':');
+    if (colon2 != std::string::npos) {
+      op.weight = atoi(size.c_str() + colon2 + 1);
+      size.resize(colon2);
+    }
+    if (!parse_size(size.c_str(), &op.size) || op.weight <= 0) {
+      return false;
+    }
+    op.label = kind + ":" + size;
+    mix->push_back(op);
+  }
+  return !mix->empty();
+}
+
+// read and write a connection, through openssl for the directions of tls
+// that the kernel didn't take
+ssize_t conn_read(int fd, SSL *ssl, void *data, size_t len) {
+  if (ssl != NULL && !tls_kernel_recv(ssl)) {
+    return tls_read(ssl, data, len);
+  }
+  return read(fd, data, len);
+}
+
+ssize_t conn_write(int fd, SSL *ssl, const void *data, size_t len) {
+  if (ssl != NULL && !tls_kernel_send(ssl)) {
+    return tls_write(ssl, data, len);
+  }
+  return write(fd, data, len);
+}
+
+// blocking helpers for the setup before the run
+bool send_all(int fd, SSL *ssl, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    ssize_t res = conn_write(fd, ssl, p, len);
+    if (res < 0) {
+      return false;
+    }
+    p += res;
+    len -= res;
+  }
+  return true;
+}
+
+bool recv_all(int fd, SSL *ssl, void *data, size_t len) {
+  char *p = (char *)data;
+  while (len > 0) {
+    ssize_t res = conn_read(fd, ssl, p, len);
+    if (res <= 0) {
+      return false;
+    }
+    p += res;
+    len -= res;
+  }
+  return true;
+}
+
+// connect, shake hands when tls is set, and switch to v2. returns -1 on
+// error
+int open_conn(const struct addrinfo *addr, SSL_CTX *tls, SSL **ssl) {
+  *ssl = NULL;
+  int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
+                  addr->ai_protocol);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+  tcp_nodelay(fd);
+  if (tls != NULL) {
+    *ssl = tls_new(tls, fd, false);
+    if (*ssl == NULL || tls_handshake(*ssl) < 0) {
+      eprintf("tls handshake failed: %s\n", tls_error());
+      SSL_free(*ssl);
+      close(fd);
+      return -1;
+    }
+  }
+  char hello[2] = {(char)0xF0, 2};
+  if (!send_all(fd, *ssl, hello, sizeof(hello)) ||
+      !recv_all(fd, *ssl, hello, sizeof(hello)) || hello[0] != (char)0xF0 ||
+      hello[1] != 2) {
+    eprintf("server doesn't speak protocol v2\n");
+    SSL_free(*ssl);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// header of a v2 request for op, naming name
+std::string request_header(const Op &op, const std::string &name,
+                           char flags) {
+  uint8_t buffer[2 + 2 * MAX_VARINT_LEN + 256];
+  int len = 0;
+  buffer[len++] = op.upload ? 0x01 : 0x00;
+  buffer[len++] = flags;
+  len += put_varint(&buffer[len], name.size());
+  memcpy(&buffer[len], name.data(), name.size());
+  len += name.size();
+  if (op.upload) {
+    len += put_varint(&buffer[len], op.size);
+  }
+  return std::string((char *)buffer, len);
+}
+
+// upload the files that the downloads of the mix fetch
+bool prepare_files(const struct addrinfo *addr, const Config &config) {
+  SSL *ssl;
+  int fd = open_conn(addr, config.tls, &ssl);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  for (const Op &op : config.mix) {
+    if (op.upload) {
+      continue;
+    }
+    Op upload = op;
+    upload.upload = true;
+    std::string header = request_header(upload, download_name(op.size), 0);
+    ok = send_all(fd, ssl, header.data(), header.size());
+    for (uint64_t sent = 0; ok && sent < op.size; sent += PAYLOAD_LEN) {
+      ok = send_all(fd, ssl, payload, std::min(op.size - sent, PAYLOAD_LEN));
+    }
+    char resp = 0;
+    if (!ok || !recv_all(fd, ssl, &resp, 1) || resp != 0x01) {
+      eprintf("unable to upload %s\n", download_name(op.size).c_str());
+      ok = false;
+      break;
+    }
+  }
+  SSL_free(ssl);
+  close(fd);
+  return ok;
+}
+
+bool can_issue(Worker &w) {
+  if (w.config->duration > 0) {
+    return now_ns() < w.deadline;
+  }
+  return w.budget > 0;
+}
+
+// xorshift64*
+int pick_op(Worker &w) {
+  w.rng ^= w.rng >> 12;
+  w.rng ^= w.rng << 25;
+  w.rng ^= w.rng >> 27;
+  int r = (w.rng * 0x2545F4914F6CDD1DULL >> 32) % w.config->total_weight;
+  int i = 0;
+  while (r >= w.config->mix[i].weight) {
+    r -= w.config->mix[i].weight;
+    i++;
+  }
+  return i;
+}
+
+// the connection can't be used any more, its pending requests failed
+void close_conn(Worker &w, Conn &c) {
+  if (c.closed) {
+    return;
+  }
+  c.closed = true;
+  SSL_free(c.ssl);
+  c.ssl = NULL;
+  close(c.fd);
+  w.open--;
+  w.errors += c.pending.size();
+  w.inflight -= c.pending.size();
+  c.pending.clear();
+  c.out.clear();
+}
+
+// write as much of c.out as the socket takes
+void flush(Worker &w, Conn &c) {
+  while (!c.closed && !c.out.empty()) {
+    struct iovec iov[MAX_IOVECS];
+    int n = 0;
+    uint64_t off = c.out_off;
+    for (auto it = c.out.begin(); it != c.out.end() && n < MAX_IOVECS;
+         ++it, off = 0) {
+      if (off < it->header.size()) {
+        iov[n].iov_base = &it->header[off];
+        iov[n].iov_len = it->header.size() - off;
+        n++;
+        off = 0;
+      } else {
+        off -= it->header.size();
+      }
+      while (off < it->body_len && n < MAX_IOVECS) {
+        size_t at = off % PAYLOAD_LEN;
+        size_t len = std::min(it->body_len - off, (uint64_t)PAYLOAD_LEN - at);
+        iov[n].iov_base = &payload[at];
+        iov[n].iov_len = len;
+        n++;
+        off += len;
+      }
+    }
+    ssize_t res;
+    if (c.ssl != NULL && !tls_kernel_send(c.ssl)) {
+      // the same bytes again after EAGAIN, as openssl wants them
+      size_t len = 0;
+      for (int i = 0; i < n && len < w.gather.size(); i++) {
+        size_t copy = std::min(iov[i].iov_len, w.gather.size() - len);
+        memcpy(&w.gather[len], iov[i].iov_base, copy);
+        len += copy;
+      }
+      // a record per call
+      size_t written = 0;
+      while (written < len) {
+        res = tls_write(c.ssl, &w.gather[written], len - written);
+        if (res < 0) {
+          break;
+        }
+        written += res;
+      }
+      res = written > 0 ? (ssize_t)written : res;
+    } else {
+      res = writev(c.fd, iov, n);
+    }
+    if (res < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("writev");
+        close_conn(w, c);
+      }
+      return;
+    }
+    w.sent_bytes += res;
+    uint64_t written = res;
+    while (written > 0) {
+      uint64_t left =
+          c.out.front().header.size() + c.out.front().body_len - c.out_off;
+      if (written < left) {
+        c.out_off += written;
+        break;
+      }
+      written -= left;
+      c.out.pop_front();
+      c.out_off = 0;
+    }
+  }
+}
+
+// keep the pipeline of c full
+void fill(Worker &w, Conn &c) {
+  char flags = w.config->checksum ? FLAG_CHECKSUM : 0;
+  while (!c.closed && c.pending.size() < (size_t)w.config->pipeline &&
+         can_issue(w)) {
+    int op_index = pick_op(w);
+    const Op &op = w.config->mix[op_index];
+    Chunk chunk;
+    chunk.header = request_header(
+        op, op.upload ? c.upload_name : download_name(op.size), flags);
+    chunk.body_len = op.upload ? op.size : 0;
+    c.out.push_back(chunk);
+    Pending p;
+    p.op = op_index;
+    p.start = now_ns();
+    c.pending.push_back(p);
+    w.inflight++;
+    if (w.budget > 0) {
+      w.budget--;
+    }
+  }
+  flush(w, c);
+}
+
+void complete(Worker &w, Conn &c, bool ok) {
+  Pending p = c.pending.front();
+  c.pending.pop_front();
+  w.inflight--;
+  uint64_t now = now_ns();
+  w.last_progress = now;
+  if (ok && !c.bad) {
+    w.latency[p.op].record(now - p.start);
+    w.completed++;
+  } else {
+    w.errors++;
+  }
+  c.stage = Conn::Resp;
+  c.bad = false;
+}
+
+// parse resps out of len received bytes, returns false on a protocol error
+bool parse(Worker &w, Conn &c, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    if (c.pending.empty()) {
+      eprintf("resp without a request\n");
+      return false;
+    }
+    const Op &op = w.config->mix[c.pending.front().op];
+    uint8_t byte;
+    switch (c.stage) {
+    case Conn::Resp:
+      byte = *data++;
+      len--;
+      if (byte == 0x00) {
+        complete(w, c, false);
+      } else if (op.upload && byte == 0x01) {
+        if (w.config->checksum) {
+          c.stage = Conn::Crc;
+          c.remaining = 4;
+        } else {
+          complete(w, c, true);
+        }
+      } else if (!op.upload && byte == 0x02) {
+        c.stage = Conn::Length;
+        c.length = 0;
+        c.shift = 0;
+      } else {
+        eprintf("invalid resp 0x%02x\n", byte);
+        return false;
+      }
+      break;
+    case Conn::Length:
+      byte = *data++;
+      len--;
+      if (c.shift > 63) {
+        return false;
+      }
+      c.length |= (uint64_t)(byte & 0x7F) << c.shift;
+      c.shift += 7;
+      if (!(byte & 0x80)) {
+        c.bad = c.length != op.size;
+        c.stage = Conn::Body;
+        c.remaining = c.length;
+      }
+      break;
+    case Conn::Body:
+    case Conn::Crc: {
+      size_t skip = std::min((uint64_t)len, c.remaining);
+      data += skip;
+      len -= skip;
+      c.remaining -= skip;
+      break;
+    }
+    }
+    // the body and crc may be empty, or just done
+    if (c.stage == Conn::Body && c.remaining == 0) {
+      if (w.config->checksum) {
+        c.stage = Conn::Crc;
+        c.remaining = 4;
+      } else {
+        complete(w, c, true);
+      }
+    } else if (c.stage == Conn::Crc && c.remaining == 0) {
+      complete(w, c, true);
+    }
+  }
+  return true;
+}
+
+void receive(Worker &w, Conn &c, uint8_t *buffer) {
+  while (!c.closed) {
+    ssize_t res = conn_read(c.fd, c.ssl, buffer, READ_BUFFER_LEN);
+    if (res < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("read");
+        close_conn(w, c);
+      }
+      return;
+    } else if (res == 0) {
+      eprintf("server closed a connection\n");
+      close_conn(w, c);
+      return;
+    }
+    w.received_bytes += res;
+    if (!parse(w, c, buffer, res)) {
+      close_conn(w, c);
+      return;
+    }
+  }
+}
+
+void run_worker(Worker &w) {
+  std::vector<uint8_t> buffer(READ_BUFFER_LEN);
+  w.last_progress = now_ns();
+  w.open = w.conns.size();
+  for (Conn &c : w.conns) {
+    fill(w, c);
+  }
+  struct epoll_event events[MAX_EVENTS];
+  while (w.open > 0 && (w.inflight > 0 || can_issue(w))) {
+    int n = epoll_wait(w.epoll_fd, events, MAX_EVENTS, 100);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      Conn &c = w.conns[events[i].data.u32];
+      receive(w, c, buffer.data());
+      fill(w, c);
+    }
+    if (now_ns() - w.last_progress > STALL_NS) {
+      eprintf("no resp for %llu seconds, giving up\n",
+              (unsigned long long)(STALL_NS / 1000000000));
+      break;
+    }
+  }
+  w.end = now_ns();
+  for (Conn &c : w.conns) {
+    close_conn(w, c);
+  }
+}
+
+// fds for thousands of connections
+void raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+void print_latency(const char *label, const Histogram &h) {
+  printf("%-16s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+         (unsigned long long)h.count(), h.min() / 1e3, h.mean() / 1e3,
+         h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3,
+         h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max() / 1e3);
+}
+
+void json_latency(FILE *f, const Histogram &h) {
+  fprintf(f,
+          "{\"count\": %llu, \"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+          "\"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+          (unsigned long long)h.count(), h.min() / 1e3, h.mean() / 1e3,
+          h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3,
+          h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max() / 1e3);
+}
+
+void usage(const char *name) {
+  eprintf("Usage: %s [options] [addr] [port]"
+          "\n\t--mix LIST: requests to send, like download:4k:80,upload:64k:20"
+          " with sizes in bytes (k, m and g suffixes) and relative weights, "
+          "defaults to download:4k"
+          "\n\t--connections N: connections to open, defaults to 100"
+          "\n\t--threads N: threads driving them, defaults to 1"
+          "\n\t--pipeline N: requests sent ahead on each connection, defaults "
+          "to 1"
+          "\n\t--requests N: requests to complete, defaults to 100000"
+          "\n\t--duration S: run for S seconds instead"
+          "\n\t--checksum: ask for crc32c in the resps"
+          "\n\t--tls: speak tls, without checking the certificate"
+          "\n\t--json FILE: write the results as json to FILE, - for stdout\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  Config config;
+  config.connections = 100;
+  config.threads = 1;
+  config.pipeline = 1;
+  config.requests = 100000;
+  config.duration = 0;
+  config.checksum = false;
+  config.mix_arg = "download:4k";
+  config.tls = NULL;
+  bool tls = false;
+  const char *json = NULL;
+  static struct option long_options[] = {
+      {"mix", required_argument, NULL, 'm'},
+      {"connections", required_argument, NULL, 'c'},
+      {"threads", required_argument, NULL, 't'},
+      {"pipeline", required_argument, NULL, 'p'},
+      {"requests", required_argument, NULL, 'n'},
+      {"duration", required_argument, NULL, 'd'},
+      {"checksum", no_argument, NULL, 'C'},
+      {"tls", no_argument, NULL, 'T'},
+      {"json", required_argument, NULL, 'j'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "m:c:t:p:n:d:CTj:", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'm':
+      config.mix_arg = optarg;
+      break;
+    case 'c':
+      config.connections = atoi(optarg);
+      break;
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    case 'p':
+      config.pipeline = atoi(optarg);
+      break;
+    case 'n':
+      config.requests = strtoull(optarg, NULL, 10);
+      break;
+    case 'd':
+      config.duration = atof(optarg);
+      break;
+    case 'C':
+      config.checksum = true;
+      break;
+    case 'T':
+      tls = true;
+      break;
+    case 'j':
+      json = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!parse_mix(config.mix_arg, &config.mix)) {
+    eprintf("invalid mix: %s\n", config.mix_arg);
+    return 1;
+  }
+  if (config.connections <= 0 || config.threads <= 0 ||
+      config.pipeline <= 0 || argc - optind > 2 ||
+      (config.duration <= 0 && config.requests == 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+  config.threads = std::min(config.threads, config.connections);
+  config.total_weight = 0;
+  for (const Op &op : config.mix) {
+    config.total_weight += op.weight;
+  }
+  const char *addr = argc - optind > 0 ? argv[optind] : "127.0.0.1";
+  const char *port = argc - optind > 1 ? argv[optind + 1] : "8080";
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int error = getaddrinfo(addr, port, &hints, &res);
+  if (error != 0) {
+    eprintf("getaddrinfo: %s\n", gai_strerror(error));
+    return 1;
+  }
+  if (tls) {
+    config.tls = tls_client_context(NULL);
+    if (config.tls == NULL) {
+      freeaddrinfo(res);
+      return 1;
+    }
+  }
+  raise_fd_limit();
+  for (size_t i = 0; i < PAYLOAD_LEN; i++) {
+    payload[i] = rand();
+  }
+  if (!prepare_files(res, config)) {
+    freeaddrinfo(res);
+    return 1;
+  }
+
+  // all connections are made before the clock starts
+  std::vector<Worker> workers(config.threads);
+  for (int i = 0; i < config.threads; i++) {
+    Worker &w = workers[i];
+    w.config = &config;
+    w.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    w.budget = config.requests / config.threads +
+               ((uint64_t)i < config.requests % config.threads ? 1 : 0);
+    w.rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    w.inflight = 0;
+    w.latency.resize(config.mix.size());
+    w.completed = 0;
+    w.errors = 0;
+    w.sent_bytes = 0;
+    w.received_bytes = 0;
+    if (config.tls != NULL) {
+      w.gather.resize(READ_BUFFER_LEN);
+    }
+  }
+  for (int i = 0; i < config.connections; i++) {
+    SSL *ssl;
+    int fd = open_conn(res, config.tls, &ssl);
+    if (fd < 0) {
+      eprintf("opened %d connections\n", i);
+      freeaddrinfo(res);
+      return 1;
+    }
+    nonblocking(fd);
+    Worker &w = workers[i % config.threads];
+    Conn c = Conn();
+    c.fd = fd;
+    c.ssl = ssl;
+    c.upload_name = "bench-up-" + std::to_string(i);
+    c.stage = Conn::Resp;
+    w.conns.push_back(c);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.u32 = w.conns.size() - 1;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+  freeaddrinfo(res);
+
+  uint64_t begin = now_ns();
+  std::vector<std::thread> threads;
+  for (Worker &w : workers) {
+    w.deadline = begin + (uint64_t)(config.duration * 1e9);
+    threads.emplace_back(run_worker, std::ref(w));
+  }
+  uint64_t end = begin;
+  std::vector<Histogram> latency(config.mix.size());
+  Histogram all;
+  uint64_t completed = 0, errors = 0, sent_bytes = 0, received_bytes = 0;
+  for (size_t i = 0; i < workers.size(); i++) {
+    threads[i].join();
+    Worker &w = workers[i];
+    close(w.epoll_fd);
+    end = std::max(end, w.end);
+    for (size_t j = 0; j < config.mix.size(); j++) {
+      latency[j].merge(w.latency[j]);
+      all.merge(w.latency[j]);
+    }
+    completed += w.completed;
+    errors += w.errors;
+    sent_bytes += w.sent_bytes;
+    received_bytes += w.received_bytes;
+  }
+
+  double seconds = (end - begin) / 1e9;
+  const double MB = 1e6;
+  printf("%llu requests in %.2f s, %.0f requests/s, %llu errors\n",
+         (unsigned long long)completed, seconds, completed / seconds,
+         (unsigned long long)errors);
+  printf("sent %.1f MB/s, received %.1f MB/s\n", sent_bytes / seconds / MB,
+         received_bytes / seconds / MB);
+  printf("%-16s %10s %9s %9s %9s %9s %9s %9s %9s\n", "latency (us)", "count",
+         "min", "mean", "p50", "p90", "p99", "p99.9", "max");
+  print_latency("all", all);
+  if (config.mix.size() > 1) {
+    for (size_t i = 0; i < config.mix.size(); i++) {
+      print_latency(config.mix[i].label.c_str(), latency[i]);
+    }
+  }
+
+  if (json != NULL) {
+    FILE *f = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+    if (f == NULL) {
+      perror("open json");
+      return 1;
+    }
+    fprintf(f,
+            "{\"config\": {\"mix\": \"%s\", \"connections\": %d, "
+            "\"threads\": %d, \"pipeline\": %d, \"requests\": %llu, "
+            "\"duration\": %g, \"checksum\": %s, \"tls\": %s},\n",
+            config.mix_arg, config.connections, config.threads,
+            config.pipeline, (unsigned long long)config.requests,
+            config.duration, config.checksum ? "true" : "false",
+            tls ? "true" : "false");
+    fprintf(f,
+            " \"seconds\": %.3f, \"completed\": %llu, \"errors\": %llu, "
+            "\"requests_per_sec\": %.1f, \"sent_bytes_per_sec\": %.0f, "
+            "\"received_bytes_per_sec\": %.0f,\n",
+            seconds, (unsigned long long)completed, (unsigned long long)errors,
+            completed / seconds, sent_bytes / seconds,
+            received_bytes / seconds);
+    fprintf(f, " \"latency_us\": {\"all\": ");
+    json_latency(f, all);
+    for (size_t i = 0; i < config.mix.size(); i++) {
+      fprintf(f, ",\n  \"%s\": ", config.mix[i].label.c_str());
+      json_latency(f, latency[i]);
+    }
+    fprintf(f, "}}\n");
+    if (f != stdout) {
+      fclose(f);
+    }
+  }
+  return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#include "blob_store.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+  // disk threads may run several operations at once
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+BlobStore::BlobStore() {
+  counters.uploads = 0;
+  counters.duplicates = 0;
+  counters.have_hits = 0;
+  counters.have_misses = 0;
+  counters.bytes = 0;
+  counters.bytes_saved = 0;
+}
+
+bool BlobStore::init(const char *dir) {
+  std::string objects = std::string(dir) + "/objects";
+  if ((mkdir(dir, 0755) < 0 && errno != EEXIST) ||
+      (mkdir(objects.c_str(), 0755) < 0 && errno != EEXIST)) {
+    log_perror("mkdir");
+    return false;
+  }
+  this->dir = dir;
+  // bodies are received into unnamed files, which needs O_TMPFILE
+  int fd = open_temp();
+  if (fd < 0) {
+    this->dir.clear();
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+int BlobStore::open_temp() {
+  int fd = open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    log_perror("open O_TMPFILE");
+  }
+  return fd;
+}
+
+// objects/ab/abcdef..., so that no directory gets too large
+std::string BlobStore::blob_path(const uint8_t digest[SHA256_LEN]) {
+  char hex[2 * SHA256_LEN + 1];
+  sha256_hex(digest, hex);
+  std::string path = dir + "/objects/";
+  path.append(hex, 2);
+  path += '/';
+  path += hex;
+  return path;
+}
+
+bool BlobStore::commit(int fd, const uint8_t digest[SHA256_LEN],
+                       const char *name) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    log_perror("fstat");
+    return false;
+  }
+  add(counters.uploads, 1);
+  add(counters.bytes, st.st_size);
+
+  std::string blob = blob_path(digest);
+  std::string fanout = blob.substr(0, blob.rfind('/'));
+  if (mkdir(fanout.c_str(), 0755) < 0 && errno != EEXIST) {
+    log_perror("mkdir");
+    return false;
+  }
+  // give the unnamed file the blob's name, unless the content is stored
+  // already, maybe by another event loop right now
+  char fd_path[64];
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  if (linkat(AT_FDCWD, fd_path, AT_FDCWD, blob.c_str(), AT_SYMLINK_FOLLOW) <
+      0) {
+    if (errno != EEXIST) {
+      log_perror("linkat");
+      return false;
+    }
+    // the body just received is thrown away
+    add(counters.duplicates, 1);
+    add(counters.bytes_saved, st.st_size);
+  }
+  return place(blob, name);
+}
+
+bool BlobStore::link(const uint8_t digest[SHA256_LEN], const char *name) {
+  std::string blob = blob_path(digest);
+  struct stat st;
+  if (stat(blob.c_str(), &st) < 0 || !place(blob, name)) {
+    add(counters.have_misses, 1);
+    return false;
+  }
+  add(counters.have_hits, 1);
+  add(counters.bytes, st.st_size);
+  add(counters.bytes_saved, st.st_size);
+  return true;
+}
+
+// make name a reflink of blob, or a hard link to it, or a copy of it. the new
+// file gets a temporary name next to name and is renamed over it, so that
+// name never refers to partial content
+bool BlobStore::place(const std::string &blob, const char *name) {
+  int blob_fd = open(blob.c_str(), O_RDONLY | O_CLOEXEC);
+  if (blob_fd < 0) {
+    log_perror("open blob");
+    return false;
+  }
+  std::string tmp = std::string(name) + ".XXXXXX";
+  int fd = mkostemp(&tmp[0], O_CLOEXEC);
+  if (fd < 0) {
+    log_perror("mkostemp");
+    close(blob_fd);
+    return false;
+  }
+  fchmod(fd, 0644);
+
+  bool ok = ioctl(fd, FICLONE, blob_fd) == 0;
+  if (!ok) {
+    // no reflinks on this file system, share the blob's inode instead
+    close(fd);
+    fd = -1;
+    unlink(tmp.c_str());
+    ok = ::link(blob.c_str(), tmp.c_str()) == 0;
+  }
+  if (!ok) {
+    // e.g. on another file system than the store
+    struct stat st;
+    fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    ok = fd >= 0 && fstat(blob_fd, &st) == 0;
+    off_t remaining = ok ? st.st_size : 0;
+    while (ok && remaining > 0) {
+      ssize_t res = copy_file_range(blob_fd, NULL, fd, NULL, remaining, 0);
+      ok = res > 0;
+      remaining -= res;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  close(blob_fd);
+  if (!ok || rename(tmp.c_str(), name) < 0) {
+    log_perror("place blob");
+    unlink(tmp.c_str());
+    return false;
+  }
+  // rename does nothing when name is a hard link to the blob already
+  unlink(tmp.c_str());
+  return true;
+}
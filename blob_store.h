@@ -0,0 +1,64 @@
+#ifndef __BLOB_STORE_H__
+#define __BLOB_STORE_H__
+
+#include "sha256.h"
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// content addressed store for upload bodies, one per event loop, all sharing
+// one directory. a body is kept once as a blob named by its sha256 under
+// DIR/objects, and uploaded names are reflinks or hard links to their blob,
+// or copies when neither works
+//
+// hard links share the blob's inode, so files of the served tree must be
+// replaced by uploads (which rename over them) and never modified in place.
+class BlobStore {
+public:
+  // counters are written by the disk threads and read by any thread
+  struct Stats {
+    // upload bodies received, and the ones that were in the store already
+    std::atomic<uint64_t> uploads;
+    std::atomic<uint64_t> duplicates;
+    // uploads skipped because the client asked for a blob by its hash
+    std::atomic<uint64_t> have_hits;
+    std::atomic<uint64_t> have_misses;
+    // content bytes of all uploads including skipped ones, and of those the
+    // bytes not written to disk, or not even sent by the client
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> bytes_saved;
+  };
+
+  BlobStore();
+
+  // use dir as the store, creating it if needed. returns false if it can't
+  // be used
+  bool init(const char *dir);
+  bool enabled() const { return !dir.empty(); }
+
+  // open an unlinked file in the store to receive a body, -1 on error
+  int open_temp();
+  // where open_temp() opens files, for opening them elsewhere
+  const char *temp_dir() const { return dir.c_str(); }
+
+  // commit() and link() may block on the disk and are safe to call from any
+  // thread
+
+  // make the body written to fd, whose sha256 is digest, the content of name.
+  // returns false on error
+  bool commit(int fd, const uint8_t digest[SHA256_LEN], const char *name);
+  // make the blob with the sha256 digest the content of name, false if there
+  // is no such blob or on error
+  bool link(const uint8_t digest[SHA256_LEN], const char *name);
+
+  const Stats &stats() const { return counters; }
+
+private:
+  std::string blob_path(const uint8_t digest[SHA256_LEN]);
+  bool place(const std::string &blob, const char *name);
+
+  std::string dir;
+  Stats counters;
+};
+
+#endif
@@ -0,0 +1,22 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+BufferPool::BufferPool(size_t buffer_size) : size(buffer_size) {}
+
+BufferPool::~BufferPool() {
+  for (uint8_t *buffer : free_list) {
+    free(buffer);
+  }
+}
+
+uint8_t *BufferPool::get() {
+  if (free_list.empty()) {
+    // pool grows on demand and keeps its buffers until destroyed
+    return (uint8_t *)malloc(size);
+  }
+  uint8_t *buffer = free_list.back();
+  free_list.pop_back();
+  return buffer;
+}
+
+void BufferPool::put(uint8_t *buffer) { free_list.push_back(buffer); }
@@ -0,0 +1,27 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// fixed-capacity buffers recycled through a free list, one pool per event
+// loop so that no locking is needed
+class BufferPool {
+public:
+  explicit BufferPool(size_t buffer_size);
+  ~BufferPool();
+
+  // take a buffer of buffer_size() bytes from the pool
+  uint8_t *get();
+  // give a buffer back to the pool
+  void put(uint8_t *buffer);
+
+  size_t buffer_size() const { return size; }
+
+private:
+  size_t size;
+  std::vector<uint8_t *> free_list;
+};
+
+#endif
@@ -1,25 +1,152 @@
 #include "common.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include "tls.h"
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <endian.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <map>
+#include <mutex>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
+// resps taking longer than this are given up on
+const int RECV_TIMEOUT_MS = 3000;
+
+// tls to the server, NULL for plain tcp, and the directions that openssl
+// handles in user space rather than the kernel. the thread sending requests
+// and the one receiving resps share it, so its calls are made one at a time
+// on a nonblocking socket, and the threads wait for the socket unlocked
+static SSL *tls = NULL;
+static bool tls_send = false;
+static bool tls_recv = false;
+static std::mutex tls_lock;
+
+// connected over the unix socket of the server, which passes files along with
+// some resps. they are queued in the order they arrive, only the thread
+// receiving resps reads from the socket
+static bool local = false;
+static std::deque<int> passed_fds;
+
+// wait for events of the socket, returns false with errno set on error or
+// when timeout_ms passed
+bool wait_socket(int fd, short events, int timeout_ms) {
+  struct pollfd pfd = {fd, events, 0};
+  int res = poll(&pfd, 1, timeout_ms);
+  if (res == 0) {
+    // the same as a read running into the receive timeout
+    errno = EAGAIN;
+    return false;
+  }
+  return res > 0 || errno == EINTR;
+}
+
+// read from the unix socket like read(), queueing the files passed along
+ssize_t recv_passed(int fd, void *buffer, size_t len) {
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = len;
+  // a read stops after the data a file came with, so there is one at most
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (res < 0) {
+    return res;
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++) {
+      int passed;
+      memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      passed_fds.push_back(passed);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    // files were lost, the resps they came with can't be taken
+    errno = EPROTO;
+    return -1;
+  }
+  return res;
+}
+
+// read from the socket of the server, like read()
+ssize_t socket_read(int fd, void *buffer, size_t len) {
+  if (local) {
+    return recv_passed(fd, buffer, len);
+  }
+  for (;;) {
+    ssize_t res;
+    if (tls_recv) {
+      std::lock_guard<std::mutex> guard(tls_lock);
+      res = tls_read(tls, buffer, len);
+    } else {
+      res = read(fd, buffer, len);
+    }
+    if (tls == NULL || res >= 0 || errno != EAGAIN) {
+      return res;
+    }
+    if (!wait_socket(fd, POLLIN, RECV_TIMEOUT_MS)) {
+      return -1;
+    }
+  }
+}
+
+// write to the socket of the server, like write()
+ssize_t socket_write(int fd, const void *buffer, size_t len) {
+  for (;;) {
+    ssize_t res;
+    if (tls_send) {
+      // retried with the same data, as openssl wants it
+      std::lock_guard<std::mutex> guard(tls_lock);
+      res = tls_write(tls, buffer, len);
+    } else {
+      res = write(fd, buffer, len);
+    }
+    if (tls == NULL || res >= 0 || errno != EAGAIN) {
+      return res;
+    }
+    if (!wait_socket(fd, POLLOUT, -1)) {
+      return -1;
+    }
+  }
+}
+
 int read_exact(int fd, char *buffer, size_t len) {
   size_t read_len = 0;
   while (read_len < len) {
-    int res = read(fd, &buffer[read_len], len - read_len);
-    if (res < 0) {
+    int res = socket_read(fd, &buffer[read_len], len - read_len);
+    if (res == 0) {
+      // the server closed the connection
+      errno = ECONNRESET;
+      return -1;
+    } else if (res < 0) {
       return -1;
     }
     read_len += res;
@@ -30,7 +157,7 @@ int read_exact(int fd, char *buffer, size_t len) {
 int write_exact(int fd, char *buffer, size_t len) {
   size_t write_len = 0;
   while (write_len < len) {
-    int res = write(fd, &buffer[write_len], len - write_len);
+    int res = socket_write(fd, &buffer[write_len], len - write_len);
     if (res < 0) {
       return -1;
     }
@@ -39,24 +166,969 @@ int write_exact(int fd, char *buffer, size_t len) {
   return write_len;
 }
 
+// v2 request flag: the upload body is compressed, or the download resp may be
+const char FLAG_COMPRESSED = 0x01;
+// v2 request flag: the resp carries the crc32c of the file content
+const char FLAG_CHECKSUM = 0x02;
+// v2 request flag: over a unix socket, the download may be answered with the
+// file itself
+const char FLAG_PASS_FILE = 0x04;
+// requests sent ahead of their resps by default. the server parses up to 32
+// ahead, more wait in its socket buffer and still save round trips
+const int DEFAULT_WINDOW = 64;
+// file content moves through buffers of this size when it has to be seen,
+// for a crc or to compress it
+const size_t IO_BUFFER_LEN = 256 * 1024;
+// downloads without a crc from this size on are spliced into the file, and
+// the pipe in between is asked to hold this much
+const uint64_t SPLICE_MIN_LEN = 64 * 1024;
+const size_t SPLICE_PIPE_LEN = 1024 * 1024;
+
+// send the command byte of a request, followed by its flags in v2
+int write_command(int fd, int version, char command, char flags) {
+  char header[2] = {command, flags};
+  int len = version == 1 ? 1 : 2;
+  return write_exact(fd, header, len) == len ? 0 : -1;
+}
+
+// send a file name, zero padded to 256 bytes in v1, or prefixed with its
+// varint length in v2
+int write_name(int fd, int version, const char *remote_path) {
+  size_t name_len = strlen(remote_path);
+  if (name_len > 256) {
+    eprintf("file name too long!\n");
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  // copy to zero-init array to avoid leaking
+  char name[2 + 256] = {0};
+  int len = 0;
+  if (version == 1) {
+    memcpy(name, remote_path, name_len);
+    len = 256;
+  } else {
+    len = put_varint((uint8_t *)name, name_len);
+    memcpy(&name[len], remote_path, name_len);
+    len += name_len;
+  }
+  return write_exact(fd, name, len) == len ? 0 : -1;
+}
+
+// send a length, big endian in v1_len bytes in v1, or a varint in v2
+int write_length(int fd, int version, uint64_t value, int v1_len) {
+  uint8_t buffer[MAX_VARINT_LEN];
+  int len;
+  if (version == 1) {
+    for (int i = 0; i < v1_len; i++) {
+      buffer[i] = value >> (8 * (v1_len - 1 - i));
+    }
+    len = v1_len;
+  } else {
+    len = put_varint(buffer, value);
+  }
+  return write_exact(fd, (char *)buffer, len) == len ? 0 : -1;
+}
+
+// receive the length of a download resp, 4 bytes big endian in v1, or a
+// varint in v2
+int read_length(int fd, int version, uint64_t *value) {
+  if (version == 1) {
+    uint32_t length;
+    if (read_exact(fd, (char *)&length, sizeof(length)) < 0) {
+      return -1;
+    }
+    *value = ntohl(length);
+    return 0;
+  }
+  *value = 0;
+  for (int i = 0; i < MAX_VARINT_LEN; i++) {
+    uint8_t byte;
+    if (read_exact(fd, (char *)&byte, 1) != 1) {
+      return -1;
+    }
+    *value |= (uint64_t)(byte & 0x7F) << (7 * i);
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+  errno = EPROTO;
+  return -1;
+}
+
+// receive length bytes of file content into file_fd, moving them through a
+// pipe with splice() so that they are never copied to user space. returns -1
+// on read error, and 1 if nothing was moved because splice can't be used
+int splice_file(int fd, int file_fd, uint64_t length) {
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+    return 1;
+  }
+  // fewer round trips through the pipe, fine if the limit doesn't allow it
+  fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)SPLICE_PIPE_LEN);
+  uint64_t read_len = 0;
+  bool write_ok = true;
+  int ret = 0;
+  while (read_len < length) {
+    size_t len = std::min((uint64_t)SPLICE_PIPE_LEN, length - read_len);
+    ssize_t res = splice(fd, NULL, pipe_fds[1], NULL, len,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (res <= 0) {
+      if (res < 0 && read_len == 0 && errno == EINVAL) {
+        // e.g. a file system without splice support
+        ret = 1;
+      } else {
+        perror("splice");
+        ret = -1;
+      }
+      break;
+    }
+    read_len += res;
+    size_t in_pipe = res;
+    while (write_ok && in_pipe > 0) {
+      ssize_t res2 = splice(pipe_fds[0], NULL, file_fd, NULL, in_pipe,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (res2 <= 0) {
+        perror("write");
+        write_ok = false;
+        break;
+      }
+      in_pipe -= res2;
+    }
+    // after a write error the content is still read to stay in sync with
+    // the server
+    char drain[4096];
+    while (in_pipe > 0) {
+      ssize_t res2 = read(pipe_fds[0], drain, std::min(in_pipe, sizeof(drain)));
+      if (res2 <= 0) {
+        break;
+      }
+      in_pipe -= res2;
+    }
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  return ret;
+}
+
+// receive length bytes of file content, written to file_fd or thrown away
+// if it is negative, and added to *crc unless crc is NULL. returns -1 on read
+// error
+int receive_file(int fd, int file_fd, uint64_t length, uint32_t *crc) {
+  if (file_fd >= 0 && crc == NULL && length >= SPLICE_MIN_LEN && !tls_recv) {
+    int res = splice_file(fd, file_fd, length);
+    if (res <= 0) {
+      return res;
+    }
+  }
+  uint64_t read_len = 0;
+  std::vector<char> buffer(std::min(length, (uint64_t)IO_BUFFER_LEN));
+  while (read_len < length) {
+    int res = socket_read(fd, buffer.data(),
+                          std::min((uint64_t)buffer.size(), length - read_len));
+    if (res <= 0) {
+      perror("read");
+      return -1;
+    }
+    read_len += res;
+    if (crc != NULL) {
+      *crc = crc32c(*crc, buffer.data(), res);
+    }
+    // after a write error the content is still read to stay in sync with
+    // the server. regular files take whole writes
+    if (file_fd >= 0 && write(file_fd, buffer.data(), res) != res) {
+      perror("write");
+      file_fd = -1;
+    }
+  }
+  return 0;
+}
+
+// receive a compressed body of length bytes, decompressed into file_fd or
+// thrown away if it is negative, and added to *crc. returns -1 on read error
+int receive_compressed(int fd, int file_fd, uint64_t length, uint32_t *crc) {
+  Inflater inflater;
+  bool ok = inflater.init();
+  uint64_t read_len = 0;
+  std::vector<uint8_t> buffer(64 * 1024);
+  while (read_len < length) {
+    int res = socket_read(fd, buffer.data(),
+                          std::min((uint64_t)buffer.size(), length - read_len));
+    if (res <= 0) {
+      perror("read");
+      return -1;
+    }
+    read_len += res;
+    // the rest is still read to stay in sync with the server
+    ok = ok && inflater.write(buffer.data(), res,
+                              [&](const uint8_t *out, size_t out_len) {
+                                *crc = crc32c(*crc, out, out_len);
+                                // regular files take whole writes
+                                return file_fd < 0 ||
+                                       write(file_fd, out, out_len) ==
+                                           (ssize_t)out_len;
+                              });
+  }
+  if (!ok || !inflater.done()) {
+    eprintf("unable to decompress download\n");
+  }
+  return 0;
+}
+
+// receive a crc sent by the server and compare it with crc, returns -1 on
+// read error
+int verify_crc(int fd, uint32_t crc, bool *ok) {
+  uint32_t expected;
+  if (read_exact(fd, (char *)&expected, sizeof(expected)) < 0) {
+    perror("read");
+    return -1;
+  }
+  expected = ntohl(expected);
+  *ok = expected == crc;
+  if (*ok) {
+    printf("checksum %08x verified\n", crc);
+  } else {
+    eprintf("checksum mismatch: got %08x, server sent %08x\n", crc, expected);
+  }
+  return 0;
+}
+
+// copy length bytes of src_fd starting at off into file_fd at its position,
+// within the kernel: copy_file_range() shares the blocks on file systems that
+// can, sendfile() copies the pages where it can't be used. returns -1 on error
+int copy_passed(int src_fd, uint64_t off, int file_fd, uint64_t length) {
+  off_t src_off = off;
+  bool use_range = true;
+  uint64_t copied = 0;
+  while (copied < length) {
+    ssize_t res;
+    if (use_range) {
+      res = copy_file_range(src_fd, &src_off, file_fd, NULL, length - copied,
+                            0);
+      if (res < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                      errno == EOPNOTSUPP)) {
+        // e.g. across file systems before linux 5.3
+        use_range = false;
+        continue;
+      }
+    } else {
+      res = sendfile(file_fd, src_fd, &src_off, length - copied);
+    }
+    if (res < 0) {
+      perror("copy");
+      return -1;
+    } else if (res == 0) {
+      eprintf("passed file is shorter than its resp\n");
+      return -1;
+    }
+    copied += res;
+  }
+  return 0;
+}
+
+// take the file passed along with a 0x05 resp, copy length bytes of it from
+// off into file_fd unless it is negative, and close it. returns -1 if no file
+// came with the resp
+int receive_passed(int file_fd, uint64_t off, uint64_t length) {
+  if (passed_fds.empty()) {
+    eprintf("no file passed with the resp\n");
+    return -1;
+  }
+  int src_fd = passed_fds.front();
+  passed_fds.pop_front();
+  printf("copying passed file of length %llu\n", (unsigned long long)length);
+  // nothing else to read from the server, so it stays in sync on errors
+  if (file_fd >= 0) {
+    copy_passed(src_fd, off, file_fd, length);
+  }
+  close(src_fd);
+  return 0;
+}
+
+// receive the body of a download resp, decompressing it if resp is 0x04 or
+// copying the file passed with it from off if resp is 0x05, and verify the
+// crc after it if flags asked for one. returns -1 on read error
+int receive_body(int fd, int file_fd, char resp, uint64_t off,
+                 uint64_t length, char flags, bool *ok) {
+  uint32_t crc = 0;
+  int res;
+  if (resp == 0x5) {
+    // passed files are asked for without a crc
+    *ok = true;
+    return receive_passed(file_fd, off, length);
+  } else if (resp == 0x4) {
+    printf("receiving compressed file of length %llu\n",
+           (unsigned long long)length);
+    res = receive_compressed(fd, file_fd, length, &crc);
+  } else {
+    printf("receiving file of length %llu\n", (unsigned long long)length);
+    // without a crc to compute the content needn't be seen
+    res = receive_file(fd, file_fd, length,
+                       flags & FLAG_CHECKSUM ? &crc : NULL);
+  }
+  *ok = true;
+  if (res < 0 || !(flags & FLAG_CHECKSUM)) {
+    return res;
+  }
+  return verify_crc(fd, crc, ok);
+}
+
+// send one batch request for the downloads of count consecutive download
+// actions, returns -1 on write error
+int send_batch(int fd, char **actions, int count, char flags) {
+  // | 0x03 | FLAGS | COUNT | (NAME_LEN | NAME)* |, sent in one go
+  std::vector<uint8_t> req(2 + MAX_VARINT_LEN);
+  req[0] = 0x03;
+  req[1] = flags;
+  req.resize(2 + put_varint(&req[2], count));
+  for (int i = 0; i < count; i++) {
+    const char *remote_path = actions[3 * i + 2];
+    size_t name_len = strlen(remote_path);
+    if (name_len > 256) {
+      eprintf("file name too long!\n");
+      return -1;
+    }
+    uint8_t len[MAX_VARINT_LEN];
+    req.insert(req.end(), len, len + put_varint(len, name_len));
+    req.insert(req.end(), remote_path, remote_path + name_len);
+  }
+  printf("sending batch of %d downloads to server\n", count);
+  if (write_exact(fd, (char *)req.data(), req.size()) != (int)req.size()) {
+    perror("write");
+    return -1;
+  }
+  return 0;
+}
+
+// receive the resps of a batch request, returns -1 when the connection can't
+// be used any more and 1 when a checksum didn't match
+int receive_batch(int fd, char **actions, int count, char flags) {
+  // | 0x03 | COUNT |, then a download resp for every file
+  char resp = 0x0;
+  uint64_t resp_count;
+  printf("reading resp from server\n");
+  if (read_exact(fd, &resp, 1) != 1 || read_length(fd, 2, &resp_count) < 0) {
+    perror("read");
+    return -1;
+  }
+  if (resp != 0x03 || resp_count != (uint64_t)count) {
+    eprintf("invalid batch resp from server\n");
+    return -1;
+  }
+  int ret = 0;
+  for (int i = 0; i < count; i++) {
+    const char *local_path = actions[3 * i + 1];
+    if (read_exact(fd, &resp, 1) != 1) {
+      perror("read");
+      return -1;
+    }
+    if (resp == 0x0) {
+      eprintf("server resp: download of %s failed\n", actions[3 * i + 2]);
+      continue;
+    } else if (resp != 0x2 && resp != 0x4 && resp != 0x5) {
+      eprintf("invalid batch resp from server\n");
+      return -1;
+    }
+    uint64_t length;
+    if (read_length(fd, 2, &length) < 0) {
+      perror("read");
+      return -1;
+    }
+    int file_fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0) {
+      // the content still has to be read
+      eprintf("unable to open %s\n", local_path);
+      perror("open");
+    }
+    bool ok;
+    if (receive_body(fd, file_fd, resp, 0, length, flags, &ok) < 0) {
+      return -1;
+    }
+    if (!ok) {
+      ret = 1;
+    }
+    if (file_fd >= 0) {
+      printf("written to %s\n", local_path);
+      close(file_fd);
+    }
+  }
+  return ret;
+}
+
+// how requests are made, from the command line and the negotiation
+struct Options {
+  int version;
+  // flags of download requests, and checksums of uploads
+  char flags;
+  bool resume;
+  bool dedup;
+  // over a unix socket: downloads ask for the files themselves
+  bool local;
+};
+
+// flags of download requests. a passed file needs no crc, its content isn't
+// sent at all
+char download_flags(const Options &o) {
+  return o.local ? (o.flags & ~FLAG_CHECKSUM) | FLAG_PASS_FILE : o.flags;
+}
+
+// an action of the command line, from when its request is sent until its
+// resp is received
+struct Action {
+  enum Kind { Download, Upload, Have, Batch };
+  // Have is an upload asking for its content by hash first
+  Kind kind;
+  const char *local_path;
+  const char *remote_path;
+  // Batch only: batch_count (action, local_path, remote_path) in argv
+  char **batch;
+  int batch_count;
+  // Download only: where the content goes, and where it starts in the
+  // remote file
+  int file_fd;
+  uint64_t range_off;
+  // Upload only: flags of the request, and the crc of the content sent
+  char flags;
+  uint32_t crc;
+  // Have only: the server has the content
+  bool have;
+  // the resp has been received
+  bool done;
+};
+
+// requests sent and waiting for their resps, shared by the thread sending
+// requests and the one receiving resps
+struct Pipeline {
+  std::mutex lock;
+  std::condition_variable cond;
+  // in the order they were sent
+  std::deque<Action *> sent;
+  // most requests waiting for their resps
+  int window;
+  // all requests have been sent
+  bool writer_done;
+  // the connection can't be used any more
+  bool broken;
+  // an action failed before its request was sent
+  bool error;
+};
+
+// wait until another request may be sent, returns false if the connection
+// broke
+bool wait_for_window(Pipeline &p) {
+  std::unique_lock<std::mutex> lock(p.lock);
+  p.cond.wait(lock, [&p]() {
+    return (int)p.sent.size() < p.window || p.broken;
+  });
+  return !p.broken;
+}
+
+// hand a sent request over to the receiving thread
+void push_sent(Pipeline &p, Action &a) {
+  std::lock_guard<std::mutex> lock(p.lock);
+  a.done = false;
+  p.sent.push_back(&a);
+  p.cond.notify_all();
+}
+
+// wait for the resp of a, returns false if the connection broke
+bool wait_for_resp(Pipeline &p, Action &a) {
+  std::unique_lock<std::mutex> lock(p.lock);
+  p.cond.wait(lock, [&]() { return a.done || p.broken; });
+  return !p.broken;
+}
+
+// stop both threads, the receiving one may be blocked in read
+void break_pipeline(Pipeline &p, int fd) {
+  std::lock_guard<std::mutex> lock(p.lock);
+  p.broken = true;
+  shutdown(fd, SHUT_RDWR);
+  p.cond.notify_all();
+}
+
+// open the local file of a download and send its request, returns -1 on
+// write error and 1 if the local file can't be opened
+int send_download(int fd, const Options &o, Action &a) {
+  // when resuming, only ask for what the local file is missing
+  uint64_t range_off = 0;
+  struct stat local_st;
+  if (o.resume && stat(a.local_path, &local_st) == 0 &&
+      S_ISREG(local_st.st_mode)) {
+    range_off = local_st.st_size;
+  }
+  // not O_APPEND, which splice() refuses
+  a.file_fd = range_off > 0
+                  ? open(a.local_path, O_WRONLY)
+                  : open(a.local_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (a.file_fd >= 0 && lseek(a.file_fd, range_off, SEEK_SET) < 0) {
+    close(a.file_fd);
+    a.file_fd = -1;
+  }
+  if (a.file_fd < 0) {
+    eprintf("unable to open %s\n", a.local_path);
+    perror("open");
+    return 1;
+  }
+
+  // req, ranged download when resuming
+  a.range_off = range_off;
+  char action = range_off > 0 ? 0x02 : 0x0;
+  printf("sending download of %s to server\n", a.remote_path);
+  if (write_command(fd, o.version, action, download_flags(o)) < 0 ||
+      write_name(fd, o.version, a.remote_path) < 0) {
+    perror("write");
+    return -1;
+  }
+  if (action == 0x02) {
+    // offset, and length 0 for up to the end
+    printf("resuming from offset %llu\n", (unsigned long long)range_off);
+    if (write_length(fd, o.version, range_off, 8) < 0 ||
+        write_length(fd, o.version, 0, 8) < 0) {
+      perror("write");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// send the sha256 of the content of file_fd in a have request, returns -1
+// on write error
+int send_have(int fd, int file_fd, Action &a) {
+  Sha256 hasher;
+  posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::vector<uint8_t> buffer(IO_BUFFER_LEN);
+  off_t off = 0;
+  for (;;) {
+    ssize_t res = pread(file_fd, buffer.data(), buffer.size(), off);
+    if (res < 0) {
+      // a hash nobody has, the body is sent instead
+      perror("read");
+      break;
+    } else if (res == 0) {
+      break;
+    }
+    hasher.update(buffer.data(), res);
+    off += res;
+  }
+  uint8_t digest[SHA256_LEN];
+  hasher.final(digest);
+  char hex[2 * SHA256_LEN + 1];
+  sha256_hex(digest, hex);
+
+  // | 0x04 | FLAGS | NAME_LEN | NAME | SHA256 |
+  printf("asking server for content %s\n", hex);
+  if (write_command(fd, 2, 0x04, 0) < 0 ||
+      write_name(fd, 2, a.remote_path) < 0 ||
+      write_exact(fd, (char *)digest, sizeof(digest)) != sizeof(digest)) {
+    perror("write");
+    return -1;
+  }
+  return 0;
+}
+
+// send length bytes of file_fd from offset 0 with sendfile(), from the page
+// cache straight to the socket. when crc isn't NULL, every chunk is read once
+// more to add it to *crc, and is still hot in the page cache when it is sent.
+// tls in user space writes what is read instead. returns -1 on error
+int send_file(int fd, int file_fd, uint64_t length, uint32_t *crc) {
+  posix_fadvise(file_fd, 0, length, POSIX_FADV_SEQUENTIAL);
+  size_t buffer_len = std::min(length, (uint64_t)IO_BUFFER_LEN);
+  std::vector<char> buffer(crc != NULL || tls_send ? buffer_len : 0);
+  off_t off = 0;
+  while ((uint64_t)off < length) {
+    size_t len = std::min((uint64_t)IO_BUFFER_LEN, length - off);
+    if (crc != NULL || tls_send) {
+      ssize_t res = pread(file_fd, buffer.data(), len, off);
+      if (res <= 0) {
+        // the promised length can't be sent any more
+        perror("read");
+        return -1;
+      }
+      len = res;
+      if (crc != NULL) {
+        *crc = crc32c(*crc, buffer.data(), len);
+      }
+    }
+    if (tls_send) {
+      if (write_exact(fd, buffer.data(), len) < 0) {
+        perror("write");
+        return -1;
+      }
+      off += len;
+      continue;
+    }
+    off_t end = off + len;
+    while (off < end) {
+      ssize_t res = sendfile(fd, file_fd, &off, end - off);
+      if (res <= 0) {
+        if (res == 0) {
+          // the file shrank
+          errno = EIO;
+        }
+        perror("sendfile");
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// send an upload request with the content of file_fd, which is closed.
+// returns -1 on error
+int send_upload(int fd, const Options &o, Action &a, int file_fd,
+                uint64_t length) {
+  // send a compressed copy instead when it is smaller
+  a.flags = o.flags & FLAG_CHECKSUM;
+  // crc of the file content, computed while sending unless known
+  a.crc = 0;
+  bool crc_known = false;
+  if (o.flags & FLAG_COMPRESSED && length >= COMPRESS_MIN_LEN) {
+    uint64_t zsize;
+    int zfd = deflate_file(file_fd, length, &zsize, &a.crc);
+    if (zfd >= 0) {
+      close(file_fd);
+      file_fd = zfd;
+      lseek(file_fd, 0, SEEK_SET);
+      printf("compressed %llu bytes to %llu\n", (unsigned long long)length,
+             (unsigned long long)zsize);
+      length = zsize;
+      a.flags |= FLAG_COMPRESSED;
+      crc_known = true;
+    }
+  }
+
+  // req
+  printf("sending upload of %s to server, %llu bytes\n", a.remote_path,
+         (unsigned long long)length);
+  if (write_command(fd, o.version, 0x01, a.flags) < 0 ||
+      write_name(fd, o.version, a.remote_path) < 0 ||
+      write_length(fd, o.version, length, 4) < 0) {
+    perror("write");
+    close(file_fd);
+    return -1;
+  }
+
+  // sending file content
+  bool crc_needed = a.flags & FLAG_CHECKSUM && !crc_known;
+  int res = send_file(fd, file_fd, length, crc_needed ? &a.crc : NULL);
+  close(file_fd);
+  return res;
+}
+
+// send the requests of all actions, with at most p.window of them waiting
+// for their resps. runs on its own thread while receive_actions() takes the
+// resps
+void send_actions(int fd, const Options &o, std::vector<Action> &actions,
+                  Pipeline &p) {
+  for (Action &a : actions) {
+    if (!wait_for_window(p)) {
+      break;
+    }
+    if (a.kind == Action::Batch) {
+      if (send_batch(fd, a.batch, a.batch_count, download_flags(o)) < 0) {
+        break_pipeline(p, fd);
+        break;
+      }
+      push_sent(p, a);
+      continue;
+    } else if (a.kind == Action::Download) {
+      int res = send_download(fd, o, a);
+      if (res < 0) {
+        break_pipeline(p, fd);
+        break;
+      } else if (res == 0) {
+        push_sent(p, a);
+      }
+      continue;
+    }
+
+    // upload
+    int file_fd = open(a.local_path, O_RDONLY);
+    if (file_fd < 0) {
+      eprintf("unable to open %s\n", a.local_path);
+      perror("open");
+      continue;
+    }
+    struct stat st;
+    fstat(file_fd, &st);
+    if (o.version == 1 && st.st_size > 0xFFFFFFFF) {
+      // too large to fit in 4 bytes length
+      eprintf("file is too large to upload: %s\n", a.local_path);
+      close(file_fd);
+      std::lock_guard<std::mutex> lock(p.lock);
+      p.error = true;
+      continue;
+    }
+    if (o.dedup) {
+      // nothing to send when the server has the content already. the upload
+      // waits for the answer, so that later actions still see it done
+      a.kind = Action::Have;
+      if (send_have(fd, file_fd, a) < 0) {
+        close(file_fd);
+        break_pipeline(p, fd);
+        break;
+      }
+      push_sent(p, a);
+      if (!wait_for_resp(p, a)) {
+        close(file_fd);
+        break;
+      }
+      if (a.have) {
+        printf("server has the content, upload skipped\n");
+        close(file_fd);
+        continue;
+      }
+      a.kind = Action::Upload;
+      if (!wait_for_window(p)) {
+        close(file_fd);
+        break;
+      }
+    }
+    if (send_upload(fd, o, a, file_fd, st.st_size) < 0) {
+      break_pipeline(p, fd);
+      break;
+    }
+    push_sent(p, a);
+  }
+
+  std::lock_guard<std::mutex> lock(p.lock);
+  p.writer_done = true;
+  p.cond.notify_all();
+}
+
+// receive the resp of a sent action, returns -1 when the connection can't be
+// used any more and 1 when a checksum didn't match
+int receive_resp(int fd, const Options &o, Action &a) {
+  if (a.kind == Action::Batch) {
+    return receive_batch(fd, a.batch, a.batch_count, download_flags(o));
+  }
+  char resp = 0x0;
+  if (read_exact(fd, &resp, 1) != 1) {
+    perror("read");
+    return -1;
+  }
+
+  if (a.kind == Action::Have) {
+    a.have = resp == 0x01;
+    return 0;
+  } else if (a.kind == Action::Upload) {
+    if (resp == 0x0) {
+      eprintf("server resp: upload of %s failed\n", a.remote_path);
+      return 0;
+    }
+    bool ok = true;
+    if (a.flags & FLAG_CHECKSUM && verify_crc(fd, a.crc, &ok) < 0) {
+      return -1;
+    }
+    printf("uploaded %s\n", a.remote_path);
+    return ok ? 0 : 1;
+  }
+
+  // download
+  if (resp == 0x0) {
+    eprintf("server resp: download of %s failed\n", a.remote_path);
+    close(a.file_fd);
+    return 0;
+  } else if (resp != 0x2 && resp != 0x4 && resp != 0x5) {
+    eprintf("invalid resp from server\n");
+    close(a.file_fd);
+    return -1;
+  }
+  uint64_t length;
+  if (read_length(fd, o.version, &length) < 0) {
+    perror("read");
+    close(a.file_fd);
+    return -1;
+  }
+  bool ok;
+  int res = receive_body(fd, a.file_fd, resp, a.range_off, length,
+                         download_flags(o), &ok);
+  close(a.file_fd);
+  if (res < 0) {
+    return -1;
+  }
+  printf("written to %s\n", a.local_path);
+  return ok ? 0 : 1;
+}
+
+// receive the resps of the actions sent by send_actions(), in order. returns
+// -1 when the connection broke and 1 when a checksum didn't match
+int receive_actions(int fd, const Options &o, Pipeline &p) {
+  int ret = 0;
+  for (;;) {
+    Action *a;
+    {
+      std::unique_lock<std::mutex> lock(p.lock);
+      p.cond.wait(lock, [&p]() {
+        return !p.sent.empty() || p.writer_done || p.broken;
+      });
+      if (p.sent.empty() || p.broken) {
+        break;
+      }
+      a = p.sent.front();
+    }
+    int res = receive_resp(fd, o, *a);
+    if (res < 0) {
+      break_pipeline(p, fd);
+      return -1;
+    } else if (res > 0) {
+      ret = 1;
+    }
+    std::lock_guard<std::mutex> lock(p.lock);
+    // only now, so that the window counts it until here
+    p.sent.pop_front();
+    a->done = true;
+    p.cond.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(p.lock);
+  return p.broken ? -1 : ret;
+}
+
+void usage(const char *name) {
+  eprintf("Usage: %s [--resume] [--v1] [--batch] [--compress] "
+          "[--no-checksum] [--dedup] [--window N] [--tls] [--tls-ca FILE] "
+          "[--unix PATH] addr port [actions]"
+          "\n\tactions: You should specify one or more pairs "
+          "of (action, local_path, remote_path) where action is one of: "
+          "download and upload"
+          "\n\t--resume: continue downloads into existing local files from "
+          "where they end"
+          "\n\t--v1: speak protocol v1 instead of negotiating v2"
+          "\n\t--batch: fetch consecutive downloads with one batch request, "
+          "needs v2 and can't be used with --resume"
+          "\n\t--compress: compress uploads and ask for compressed "
+          "downloads when the server agrees, needs v2"
+          "\n\t--no-checksum: don't ask the server for crc32c of files to "
+          "verify them, which is done by default in v2"
+          "\n\t--dedup: before uploading a file, ask the server for its "
+          "content by hash and skip the body if it has it, needs v2"
+          "\n\t--window N: send up to N requests before their resps arrive, "
+          "defaults to %d, 1 waits for every resp"
+          "\n\t--tls: speak tls to the server, without checking its "
+          "certificate"
+          "\n\t--tls-ca FILE: speak tls, and check that the certificate of "
+          "the server is signed by the pem FILE"
+          "\n\t--unix PATH: connect to the unix socket of the server at PATH, "
+          "given instead of addr and port, and have downloads passed as "
+          "files to copy within the kernel, needs v2\n",
+          name, DEFAULT_WINDOW);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 6 || (argc % 3) != 0) {
-    eprintf("Usage: %s addr port [actions]"
-            "\n\tactions: You should specify one or more pairs "
-            "of (action, local_path, remote_path) where action is one of: "
-            "download and upload\n",
-            argv[0]);
+  bool resume = false;
+  int version = 2;
+  bool batch = false;
+  bool compress = false;
+  bool checksum = true;
+  bool dedup = false;
+  int window = DEFAULT_WINDOW;
+  bool use_tls = false;
+  const char *tls_ca = NULL;
+  const char *unix_path = NULL;
+  // codecs agreed on with the server
+  uint8_t codecs = 0;
+  char flags = 0;
+  static struct option long_options[] = {
+      {"resume", no_argument, NULL, 'r'},
+      {"v1", no_argument, NULL, '1'},
+      {"batch", no_argument, NULL, 'B'},
+      {"compress", no_argument, NULL, 'z'},
+      {"no-checksum", no_argument, NULL, 'C'},
+      {"dedup", no_argument, NULL, 'D'},
+      {"window", required_argument, NULL, 'w'},
+      {"tls", no_argument, NULL, 'T'},
+      {"tls-ca", required_argument, NULL, 'A'},
+      {"unix", required_argument, NULL, 'u'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r1BzCDw:TA:u:", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'r':
+      resume = true;
+      break;
+    case '1':
+      version = 1;
+      break;
+    case 'B':
+      batch = true;
+      break;
+    case 'z':
+      compress = true;
+      break;
+    case 'C':
+      checksum = false;
+      break;
+    case 'D':
+      dedup = true;
+      break;
+    case 'w':
+      window = atoi(optarg);
+      if (window <= 0) {
+        eprintf("invalid window: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'T':
+      use_tls = true;
+      break;
+    case 'A':
+      use_tls = true;
+      tls_ca = optarg;
+      break;
+    case 'u':
+      unix_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  // addr and port unless connecting to a unix socket, then actions
+  int actions_at = optind + (unix_path != NULL ? 0 : 2);
+  if (argc - actions_at < 3 || (argc - actions_at) % 3 != 0 ||
+      (batch && (resume || version == 1)) || (compress && version == 1) ||
+      (dedup && version == 1) ||
+      (unix_path != NULL && (use_tls || version == 1))) {
+    usage(argv[0]);
     return 1;
   }
+  SSL_CTX *tls_ctx = NULL;
+  if (use_tls) {
+    tls_ctx = tls_client_context(tls_ca);
+    if (tls_ctx == NULL) {
+      return 1;
+    }
+  }
 
   struct addrinfo hints, *res;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  int error = getaddrinfo(argv[1], argv[2], &hints, &res);
-  if (error != 0) {
-    eprintf("getaddrinfo: %s\n", gai_strerror(error));
-    return 1;
+  struct sockaddr_un unix_addr;
+  struct addrinfo unix_info;
+  int error;
+  if (unix_path != NULL) {
+    // the only address to try
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    if (strlen(unix_path) >= sizeof(unix_addr.sun_path)) {
+      eprintf("unix socket path too long: %s\n", unix_path);
+      return 1;
+    }
+    strcpy(unix_addr.sun_path, unix_path);
+    memset(&unix_info, 0, sizeof(unix_info));
+    unix_info.ai_family = AF_UNIX;
+    unix_info.ai_socktype = SOCK_STREAM;
+    unix_info.ai_addr = (struct sockaddr *)&unix_addr;
+    unix_info.ai_addrlen = sizeof(unix_addr);
+    res = &unix_info;
+  } else {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(argv[optind], argv[optind + 1], &hints, &res);
+    if (error != 0) {
+      eprintf("getaddrinfo: %s\n", gai_strerror(error));
+      return 1;
+    }
   }
 
   int ret = 0;
@@ -64,15 +1136,19 @@ int main(int argc, char *argv[]) {
   bool found = false;
   for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
     // print info
-    char hbuf[NI_MAXHOST];
-    char sbuf[NI_MAXSERV];
-    error = getnameinfo(p->ai_addr, p->ai_addrlen, hbuf, sizeof(hbuf), sbuf,
-                        sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
-    if (error) {
-      eprintf("getaddrinfo: %s\n", gai_strerror(error));
-      continue;
+    if (p->ai_family == AF_UNIX) {
+      printf("connecting to %s\n", unix_path);
+    } else {
+      char hbuf[NI_MAXHOST];
+      char sbuf[NI_MAXSERV];
+      error = getnameinfo(p->ai_addr, p->ai_addrlen, hbuf, sizeof(hbuf),
+                          sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
+      if (error) {
+        eprintf("getaddrinfo: %s\n", gai_strerror(error));
+        continue;
+      }
+      printf("connecting to %s:%s\n", hbuf, sbuf);
     }
-    printf("connecting to %s:%s\n", hbuf, sbuf);
 
     // connect
     int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
@@ -84,200 +1160,133 @@ int main(int argc, char *argv[]) {
       continue;
     }
     // no delay
-    tcp_nodelay(fd);
+    local = p->ai_family == AF_UNIX;
+    if (!local) {
+      tcp_nodelay(fd);
+    }
     // 3s recv timeout
     so_recv_timeout(fd, 3000000);
 
     printf("connected!\n");
     found = true;
 
-    // begin from argv[3]
-    for (int offset = 3; offset < argc; offset += 3) {
-      if (strcmp(argv[offset], "download") == 0) {
-        // download
-        int file_fd =
-            open(argv[offset + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (file_fd < 0) {
-          eprintf("unable to open %s\n", argv[offset]);
-          perror("open");
-          continue;
-        }
+    if (tls_ctx != NULL) {
+      tls = tls_new(tls_ctx, fd, false);
+      if (tls == NULL || tls_handshake(tls) < 0) {
+        eprintf("tls handshake failed: %s\n", tls_error());
+        ret = 1;
+        goto quit;
+      }
+      tls_send = !tls_kernel_send(tls);
+      tls_recv = !tls_kernel_recv(tls);
+      printf("speaking %s, records sent by %s and received by %s\n",
+             SSL_get_version(tls), tls_send ? "openssl" : "the kernel",
+             tls_recv ? "openssl" : "the kernel");
+      if ((tls_send || tls_recv) && !nonblocking(fd)) {
+        ret = 1;
+        goto quit;
+      }
+    }
 
-        // req
-        char action = 0x0;
-        printf("sending download action to server\n");
-        if (write_exact(fd, &action, 1) != 1) {
-          perror("write");
-          ret = 1;
-          goto quit;
-        }
+    if (version > 1) {
+      // hello, the server answers with the version to use from now on
+      char hello[2] = {(char)0xF0, (char)version};
+      printf("negotiating protocol v%d\n", version);
+      if (write_exact(fd, hello, sizeof(hello)) != sizeof(hello) ||
+          read_exact(fd, hello, sizeof(hello)) != sizeof(hello)) {
+        perror("hello");
+        ret = 1;
+        goto quit;
+      }
+      if (hello[0] != (char)0xF0 || hello[1] < 1 || hello[1] > version) {
+        eprintf("invalid hello resp from server\n");
+        ret = 1;
+        goto quit;
+      }
+      version = hello[1];
+      printf("using protocol v%d\n", version);
+    }
 
-        // copy to zero-init array to avoid leaking
-        char name[256] = {0};
-        char *remote_path = argv[offset + 2];
-        if (strlen(remote_path) > 256) {
-          eprintf("file name too long!\n");
-          ret = 1;
-          goto quit;
-        }
-        memcpy(name, remote_path, strlen(remote_path));
-        printf("sending remote path to server\n");
-        if (write_exact(fd, name, 256) != 256) {
-          perror("write");
-          ret = 1;
-          goto quit;
-        }
+    if (checksum && version > 1) {
+      flags |= FLAG_CHECKSUM;
+    }
+    if (compress && version > 1) {
+      // the server answers with the codecs it agrees on
+      char req[2] = {(char)0xF1, (char)CODEC_ZLIB};
+      char resp[2];
+      if (write_exact(fd, req, sizeof(req)) != sizeof(req) ||
+          read_exact(fd, resp, sizeof(resp)) != sizeof(resp)) {
+        perror("codecs");
+        ret = 1;
+        goto quit;
+      }
+      if (resp[0] != (char)0xF1 || (resp[1] & ~CODEC_ZLIB)) {
+        eprintf("invalid codecs resp from server\n");
+        ret = 1;
+        goto quit;
+      }
+      codecs = resp[1];
+      if (codecs & CODEC_ZLIB) {
+        flags |= FLAG_COMPRESSED;
+      }
+      printf("server agrees on codecs 0x%02x\n", codecs);
+    }
 
-        // resp
-        char resp = 0x0;
-        printf("reading resp from server\n");
-        if (read_exact(fd, &resp, 1) != 1) {
-          perror("read");
-          ret = 1;
-          goto quit;
-        }
-        if (resp == 0x0) {
-          eprintf("server resp: download failed\n");
-          close(file_fd);
-          continue;
-        } else if (resp == 0x2) {
-          uint32_t length;
-          if (read_exact(fd, (char *)&length, sizeof(length)) < 0) {
-            perror("read");
-            ret = 1;
-            goto quit;
-          }
-          length = ntohl(length);
-          printf("receiving file of length %d\n", length);
-          uint32_t read_len = 0;
-          char buffer[128];
-          while (read_len < length) {
-            int res =
-                read(fd, buffer,
-                     std::min((uint32_t)sizeof(buffer), length - read_len));
-            if (res < 0) {
-              perror("read");
-              break;
-            }
-            read_len += res;
-            uint32_t write_len = 0;
-            while (write_len < res) {
-              int res2 = write(file_fd, buffer, res - write_len);
-              if (res2 < 0) {
-                perror("write");
-                break;
-              }
-              write_len += res2;
-            }
-          }
-          printf("written to %s\n", argv[offset + 1]);
-          close(file_fd);
-        }
+    // begin after addr and port
+    std::vector<Action> actions;
+    for (int offset = actions_at; offset < argc; offset += 3) {
+      Action a = Action();
+      a.local_path = argv[offset + 1];
+      a.remote_path = argv[offset + 2];
+      a.file_fd = -1;
+      // a run of downloads goes in one batch
+      int run = 0;
+      while (batch && version > 1 && offset + 3 * run < argc &&
+             strcmp(argv[offset + 3 * run], "download") == 0) {
+        run++;
+      }
+      if (run > 1) {
+        a.kind = Action::Batch;
+        a.batch = &argv[offset];
+        a.batch_count = run;
+        offset += 3 * (run - 1);
+      } else if (strcmp(argv[offset], "download") == 0) {
+        a.kind = Action::Download;
       } else if (strcmp(argv[offset], "upload") == 0) {
-        // upload
-        int file_fd = open(argv[offset + 1], O_RDONLY);
-        if (file_fd < 0) {
-          eprintf("unable to open %s\n", argv[offset]);
-          perror("open");
-          continue;
-        }
-
-        // req
-        char action = 0x01;
-        printf("sending upload action to server\n");
-        if (write_exact(fd, &action, 1) != 1) {
-          perror("write");
-          ret = 1;
-          goto quit;
-        }
-
-        // copy to zero-init array to avoid leaking
-        char name[256] = {0};
-        char *remote_path = argv[offset + 2];
-        if (strlen(remote_path) > 256) {
-          eprintf("file name too long!\n");
-          ret = 1;
-          goto quit;
-        }
-        memcpy(name, remote_path, strlen(remote_path));
-        printf("sending remote path to server\n");
-        if (write_exact(fd, name, 256) != 256) {
-          perror("write");
-          ret = 1;
-          goto quit;
-        }
-
-        // send file size
-        struct stat st;
-        fstat(file_fd, &st);
-        if (st.st_size > 0xFFFFFFFF) {
-          // too large to fit in 4 bytes length
-          eprintf("file is too large to upload");
-          ret = 1;
-          goto quit;
-        }
-        char file_len[4];
-        // big endian
-        file_len[0] = st.st_size >> 24;
-        file_len[1] = st.st_size >> 16;
-        file_len[2] = st.st_size >> 8;
-        file_len[3] = st.st_size;
-        printf("sending file size %d to server\n", st.st_size);
-        if (write_exact(fd, file_len, 4) != 4) {
-          perror("write");
-          ret = 1;
-          goto quit;
-        }
-
-        // sending file content
-        uint32_t length = st.st_size;
-        uint32_t read_len = 0;
-        char buffer[128];
-        while (read_len < length) {
-          int res = read(file_fd, buffer,
-                         std::min((uint32_t)sizeof(buffer), length - read_len));
-          if (res < 0) {
-            perror("read");
-            ret = 1;
-            goto quit;
-          }
-          read_len += res;
-          uint32_t write_len = 0;
-          while (write_len < res) {
-            int res2 = write(fd, buffer, res - write_len);
-            if (res2 < 0) {
-              perror("write");
-              ret = 1;
-              goto quit;
-            }
-            write_len += res2;
-          }
-        }
-        close(file_fd);
-
-        // resp
-        char resp = 0x0;
-        printf("reading resp from server\n");
-        if (read_exact(fd, &resp, 1) != 1) {
-          perror("read");
-          ret = 1;
-          goto quit;
-        }
-
-        if (resp == 0x0) {
-          eprintf("server resp: upload failed\n");
-          continue;
-        }
+        a.kind = Action::Upload;
       } else {
         printf("unsupported action: %s\n", argv[offset]);
+        continue;
       }
+      actions.push_back(a);
+    }
+
+    // requests are sent ahead on another thread, resps are taken here
+    Options options;
+    options.version = version;
+    options.flags = flags;
+    options.resume = resume;
+    options.dedup = dedup && version > 1;
+    options.local = local && version > 1;
+    Pipeline pipeline;
+    pipeline.window = window;
+    pipeline.writer_done = false;
+    pipeline.broken = false;
+    pipeline.error = false;
+    std::thread writer(send_actions, fd, std::cref(options),
+                       std::ref(actions), std::ref(pipeline));
+    if (receive_actions(fd, options, pipeline) != 0 || pipeline.error) {
+      ret = 1;
     }
+    writer.join();
 
     close(fd);
     break;
   }
 quit:
-  freeaddrinfo(res);
+  if (res != &unix_info) {
+    freeaddrinfo(res);
+  }
   if (!found) {
     eprintf("can not connect to server\n");
   }
@@ -1,7 +1,9 @@
+#include "common.h"
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -23,6 +25,15 @@ bool so_reuseaddr(int fd) {
   return true;
 }
 
+bool so_reuseport(int fd) {
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+    perror("setsockopt for so_reuseport");
+    return false;
+  }
+  return true;
+}
+
 bool nonblocking(int fd) {
   // set non blocking
   int flags = fcntl(fd, F_GETFL, 0);
@@ -45,4 +56,56 @@ bool so_recv_timeout(int fd, int usec) {
     return false;
   }
   return true;
-}
\ No newline at end of file
+}
+
+bool tcp_cork(int fd, bool on) {
+  int value = on;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) < 0) {
+    perror("setsockopt for tcp_cork");
+    return false;
+  }
+  return true;
+}
+
+int put_varint(uint8_t *buffer, uint64_t value) {
+  int len = 0;
+  do {
+    buffer[len++] = (value & 0x7F) | (value >= 0x80 ? 0x80 : 0);
+    value >>= 7;
+  } while (value > 0);
+  return len;
+}
+
+void put_u32_be(uint8_t *buffer, uint32_t value) {
+  buffer[0] = value >> 24;
+  buffer[1] = value >> 16;
+  buffer[2] = value >> 8;
+  buffer[3] = value;
+}
+
+bool parse_size(const char *s, uint64_t *size) {
+  char *end;
+  unsigned long long value = strtoull(s, &end, 10);
+  if (end == s) {
+    return false;
+  }
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    value <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    value <<= 30;
+    end++;
+    break;
+  }
+  *size = value;
+  return *end == 0;
+}
@@ -1,9 +1,23 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include <stdint.h>
+
+// longest encoding of a 64-bit varint
+const int MAX_VARINT_LEN = 10;
+
 bool tcp_nodelay(int fd);
 bool so_reuseaddr(int fd);
+bool so_reuseport(int fd);
 bool nonblocking(int fd);
 bool so_recv_timeout(int fd, int usec);
+bool tcp_cork(int fd, bool on);
+// encode value as a varint: 7 bits per byte, least significant first, high
+// bit set on all but the last byte. returns the number of bytes written
+int put_varint(uint8_t *buffer, uint64_t value);
+// store value in 4 bytes, big endian
+void put_u32_be(uint8_t *buffer, uint32_t value);
+// parse a size like 4096, 4k, 1m or 1g
+bool parse_size(const char *s, uint64_t *size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,152 @@
+#include "compress.h"
+#include "crc32c.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+// give up early when the first megabyte doesn't compress
+const uint64_t PROBE_LEN = 1024 * 1024;
+
+static bool write_all(int fd, const uint8_t *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t res = write(fd, buffer, len);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      return false;
+    }
+    buffer += res;
+    len -= res;
+  }
+  return true;
+}
+
+// open an unlinked file in the temporary directory
+static int open_temp() {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL) {
+    dir = "/tmp";
+  }
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+    return fd;
+  }
+  // file system without O_TMPFILE
+  std::vector<char> path(strlen(dir) + 16);
+  snprintf(path.data(), path.size(), "%s/zXXXXXX", dir);
+  fd = mkstemp(path.data());
+  if (fd >= 0) {
+    unlink(path.data());
+  }
+  return fd;
+}
+
+int deflate_file(int fd, uint64_t size, uint64_t *zsize, uint32_t *crc) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    return -1;
+  }
+  int out_fd = open_temp();
+  if (out_fd < 0) {
+    perror("open temporary file");
+    deflateEnd(&stream);
+    return -1;
+  }
+
+  std::vector<uint8_t> in(64 * 1024);
+  std::vector<uint8_t> out(64 * 1024);
+  uint64_t read_len = 0;
+  uint64_t written_len = 0;
+  uint32_t in_crc = 0;
+  int res = Z_OK;
+  while (res != Z_STREAM_END) {
+    if (stream.avail_in == 0 && read_len < size) {
+      size_t len = in.size() < size - read_len ? in.size() : size - read_len;
+      ssize_t got = pread(fd, in.data(), len, read_len);
+      if (got <= 0) {
+        // read error, or the file shrank
+        break;
+      }
+      in_crc = crc32c(in_crc, in.data(), got);
+      stream.next_in = in.data();
+      stream.avail_in = got;
+      read_len += got;
+    }
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+    res = deflate(&stream, read_len == size ? Z_FINISH : Z_NO_FLUSH);
+    if (res == Z_STREAM_ERROR) {
+      break;
+    }
+    size_t len = out.size() - stream.avail_out;
+    if (!write_all(out_fd, out.data(), len)) {
+      break;
+    }
+    written_len += len;
+
+    if ((read_len >= PROBE_LEN || res == Z_STREAM_END) &&
+        written_len * 10 > read_len * 9) {
+      // not worth it
+      break;
+    }
+  }
+  deflateEnd(&stream);
+  if (res != Z_STREAM_END || written_len * 10 > size * 9) {
+    close(out_fd);
+    return -1;
+  }
+  *zsize = written_len;
+  *crc = in_crc;
+  return out_fd;
+}
+
+Inflater::Inflater() : initialized(false), finished(false) {
+  memset(&stream, 0, sizeof(stream));
+}
+
+Inflater::~Inflater() {
+  if (initialized) {
+    inflateEnd(&stream);
+  }
+}
+
+bool Inflater::init() {
+  initialized = inflateInit(&stream) == Z_OK;
+  return initialized;
+}
+
+bool Inflater::write(const uint8_t *data, size_t len, const Output &output) {
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = len;
+  for (;;) {
+    if (finished) {
+      // nothing may follow the end of the stream
+      return stream.avail_in == 0;
+    }
+    stream.next_out = out;
+    stream.avail_out = sizeof(out);
+    int res = inflate(&stream, Z_NO_FLUSH);
+    if (res == Z_BUF_ERROR) {
+      // needs more input
+      return true;
+    } else if (res != Z_OK && res != Z_STREAM_END) {
+      return false;
+    }
+    size_t out_len = sizeof(out) - stream.avail_out;
+    if (!output(out, out_len)) {
+      return false;
+    }
+    finished = res == Z_STREAM_END;
+    if (!finished && stream.avail_in == 0 && stream.avail_out > 0) {
+      // everything consumed and flushed
+      return true;
+    }
+  }
+}
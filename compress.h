@@ -0,0 +1,45 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+// codecs that can be negotiated, as bits of a mask
+const uint8_t CODEC_ZLIB = 0x01;
+// bodies smaller than this are never compressed
+const uint64_t COMPRESS_MIN_LEN = 1024;
+
+// compress size bytes of fd from offset 0 into an unlinked temporary file
+//
+// returns the fd of the temporary file with the compressed length in *zsize
+// and the crc32c of the uncompressed data in *crc, or -1 on error or when the
+// data doesn't shrink by at least 10%
+int deflate_file(int fd, uint64_t size, uint64_t *zsize, uint32_t *crc);
+
+// decompresses a zlib stream that arrives in pieces
+class Inflater {
+public:
+  Inflater();
+  ~Inflater();
+
+  bool init();
+  // receives decompressed output, returns false on error
+  typedef std::function<bool(const uint8_t *data, size_t len)> Output;
+
+  // decompress len bytes of the stream and pass the output to output in
+  // pieces. returns false on corrupt data, data after the end of the stream
+  // or when output fails
+  bool write(const uint8_t *data, size_t len, const Output &output);
+  // the end of the stream has been reached
+  bool done() const { return finished; }
+
+private:
+  z_stream stream;
+  bool initialized;
+  bool finished;
+  uint8_t out[64 * 1024];
+};
+
+#endif
@@ -0,0 +1,361 @@
+#include "crc32c.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// reversed Castagnoli polynomial
+const uint32_t POLY = 0x82F63B78;
+// the crc32 instruction has a latency of 3 cycles but a throughput of 1, so
+// three streams are computed side by side and combined: in blocks of LONG
+// bytes while there is enough data, then of SHORT bytes
+const size_t LONG = 8192;
+const size_t SHORT = 256;
+// with carry-less multiplication, 256 bytes are folded into four 512-bit
+// registers at a time, which goes a lot faster than the crc32 instruction.
+// 64 bytes into four 128-bit registers still beat it up to a few KB, and do
+// what is left over
+const size_t FOLD = 256;
+const size_t FOLD_128 = 64;
+
+// multiply vec by a 32x32 matrix over GF(2)
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+}
+
+struct Tables {
+  // slicing by 8 for the portable version
+  uint32_t slice[8][256];
+  // appending LONG and SHORT zero bytes to a crc, a byte at a time
+  uint32_t zeros_long[4][256];
+  uint32_t zeros_short[4][256];
+  // carry-less multiplication constants for the low and high 64 bits of a
+  // 128-bit lane, to move it forward by FOLD, 64, 48, 32 and 16 bytes
+  uint64_t fold_256[2];
+  uint64_t fold_64[2];
+  uint64_t fold_48[2];
+  uint64_t fold_32[2];
+  uint64_t fold_16[2];
+
+  Tables() {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; k++) {
+        crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+      }
+      slice[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+      for (int k = 1; k < 8; k++) {
+        uint32_t prev = slice[k - 1][n];
+        slice[k][n] = (prev >> 8) ^ slice[0][prev & 0xFF];
+      }
+    }
+    zeros(zeros_long, LONG);
+    zeros(zeros_short, SHORT);
+    fold(fold_256, FOLD * 8);
+    fold(fold_64, 64 * 8);
+    fold(fold_48, 48 * 8);
+    fold(fold_32, 32 * 8);
+    fold(fold_16, 16 * 8);
+  }
+
+  // x^(n-1) mod the polynomial, bit-reflected into the high 32 bits of 64.
+  // the product of two reflected 64-bit values comes out multiplied by x,
+  // which makes up for the missing power
+  static uint64_t xpow_mod(int n) {
+    uint64_t rem = 1;
+    for (int i = 0; i < n - 1; i++) {
+      rem <<= 1;
+      if (rem & (1ull << 32)) {
+        rem ^= 0x11EDC6F41;
+      }
+    }
+    uint64_t reflected = 0;
+    for (int d = 0; d < 32; d++) {
+      if (rem & (1ull << d)) {
+        reflected |= 1ull << (63 - d);
+      }
+    }
+    return reflected;
+  }
+
+  // constants that move a 128-bit lane forward by bits: its low 64 bits
+  // come first in the stream, so they need 64 more
+  static void fold(uint64_t k[2], int bits) {
+    k[0] = xpow_mod(bits + 64);
+    k[1] = xpow_mod(bits);
+  }
+
+  // build the tables for appending len zero bytes
+  static void zeros(uint32_t table[4][256], size_t len) {
+    // operator for one zero bit, then square it up to len bytes
+    uint32_t odd[32], even[32];
+    odd[0] = POLY;
+    for (int n = 1; n < 32; n++) {
+      odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    // odd is now the operator for 4 zero bits, a byte needs one more square
+    uint32_t *op = odd;
+    for (;;) {
+      gf2_matrix_square(even, odd);
+      len >>= 1;
+      if (len == 0) {
+        op = even;
+        break;
+      }
+      gf2_matrix_square(odd, even);
+      len >>= 1;
+      if (len == 0) {
+        op = odd;
+        break;
+      }
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+      table[0][n] = gf2_matrix_times(op, n);
+      table[1][n] = gf2_matrix_times(op, n << 8);
+      table[2][n] = gf2_matrix_times(op, n << 16);
+      table[3][n] = gf2_matrix_times(op, n << 24);
+    }
+  }
+};
+
+static const Tables &tables() {
+  static const Tables t;
+  return t;
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len) {
+  const Tables &t = tables();
+  const uint8_t *next = (const uint8_t *)data;
+  crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, next, sizeof(word));
+    word ^= crc;
+    crc = t.slice[7][word & 0xFF] ^ t.slice[6][(word >> 8) & 0xFF] ^
+          t.slice[5][(word >> 16) & 0xFF] ^ t.slice[4][(word >> 24) & 0xFF] ^
+          t.slice[3][(word >> 32) & 0xFF] ^ t.slice[2][(word >> 40) & 0xFF] ^
+          t.slice[1][(word >> 48) & 0xFF] ^ t.slice[0][word >> 56];
+    next += 8;
+    len -= 8;
+  }
+#endif
+  while (len > 0) {
+    crc = (crc >> 8) ^ t.slice[0][(crc ^ *next) & 0xFF];
+    next++;
+    len--;
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+static uint32_t shift(const uint32_t table[4][256], uint32_t crc) {
+  return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^
+         table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+}
+
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const void *data, size_t len) {
+  const Tables &t = tables();
+  const uint8_t *next = (const uint8_t *)data;
+  uint64_t crc0 = ~crc;
+  while (len > 0 && ((uintptr_t)next & 7) != 0) {
+    crc0 = _mm_crc32_u8(crc0, *next);
+    next++;
+    len--;
+  }
+  while (len >= 3 * LONG) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *end = next + LONG;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load64(next));
+      crc1 = _mm_crc32_u64(crc1, load64(next + LONG));
+      crc2 = _mm_crc32_u64(crc2, load64(next + 2 * LONG));
+      next += 8;
+    } while (next < end);
+    crc0 = shift(t.zeros_long, crc0) ^ crc1;
+    crc0 = shift(t.zeros_long, crc0) ^ crc2;
+    next += 2 * LONG;
+    len -= 3 * LONG;
+  }
+  while (len >= 3 * SHORT) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t *end = next + SHORT;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load64(next));
+      crc1 = _mm_crc32_u64(crc1, load64(next + SHORT));
+      crc2 = _mm_crc32_u64(crc2, load64(next + 2 * SHORT));
+      next += 8;
+    } while (next < end);
+    crc0 = shift(t.zeros_short, crc0) ^ crc1;
+    crc0 = shift(t.zeros_short, crc0) ^ crc2;
+    next += 2 * SHORT;
+    len -= 3 * SHORT;
+  }
+  while (len >= 8) {
+    crc0 = _mm_crc32_u64(crc0, load64(next));
+    next += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc0 = _mm_crc32_u8(crc0, *next);
+    next++;
+    len--;
+  }
+  return ~(uint32_t)crc0;
+}
+
+// move the 128-bit lanes of x forward by the distance of k, onto y
+__attribute__((target("avx512f,vpclmulqdq"))) static inline __m512i
+fold512(__m512i x, __m512i k, __m512i y) {
+  // three-way xor
+  return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+                                   _mm512_clmulepi64_epi128(x, k, 0x11), y,
+                                   0x96);
+}
+
+__attribute__((target("pclmul"))) static inline __m128i
+fold128(__m128i x, const uint64_t k[2]) {
+  __m128i kk = _mm_set_epi64x(k[1], k[0]);
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, kk, 0x00),
+                       _mm_clmulepi64_si128(x, kk, 0x11));
+}
+
+// fold len bytes, a non-zero multiple of FOLD, into 16 bytes with the same
+// crc, then finish the crc of those with the crc32 instruction
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2"))) static uint32_t
+crc32c_vpclmul(uint32_t crc, const uint8_t *next, size_t len) {
+  const Tables &t = tables();
+  __m512i x0 = _mm512_loadu_si512(next);
+  __m512i x1 = _mm512_loadu_si512(next + 64);
+  __m512i x2 = _mm512_loadu_si512(next + 128);
+  __m512i x3 = _mm512_loadu_si512(next + 192);
+  // the initial crc is the same as xor with the first 4 bytes
+  x0 = _mm512_xor_si512(x0, _mm512_castsi128_si512(_mm_cvtsi32_si128(~crc)));
+  next += FOLD;
+  len -= FOLD;
+
+  __m512i k = _mm512_broadcast_i32x4(_mm_set_epi64x(t.fold_256[1],
+                                                    t.fold_256[0]));
+  while (len >= FOLD) {
+    x0 = fold512(x0, k, _mm512_loadu_si512(next));
+    x1 = fold512(x1, k, _mm512_loadu_si512(next + 64));
+    x2 = fold512(x2, k, _mm512_loadu_si512(next + 128));
+    x3 = fold512(x3, k, _mm512_loadu_si512(next + 192));
+    next += FOLD;
+    len -= FOLD;
+  }
+
+  // four registers into one, then four lanes into one
+  k = _mm512_broadcast_i32x4(_mm_set_epi64x(t.fold_64[1], t.fold_64[0]));
+  x1 = fold512(x0, k, x1);
+  x2 = fold512(x1, k, x2);
+  x3 = fold512(x2, k, x3);
+  __m128i x = _mm512_extracti32x4_epi32(x3, 3);
+  x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(x3, 0), t.fold_48));
+  x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(x3, 1), t.fold_32));
+  x = _mm_xor_si128(x, fold128(_mm512_extracti32x4_epi32(x3, 2), t.fold_16));
+
+  // 16 bytes with the same crc as all of the above
+  uint64_t crc0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(x));
+  crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(x, 1));
+  return ~(uint32_t)crc0;
+}
+
+// the same with four 128-bit registers, len is a non-zero multiple of
+// FOLD_128
+__attribute__((target("pclmul,sse4.2"))) static uint32_t
+crc32c_pclmul(uint32_t crc, const uint8_t *next, size_t len) {
+  const Tables &t = tables();
+  __m128i x0 = _mm_loadu_si128((const __m128i *)next);
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(next + 16));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(next + 32));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(next + 48));
+  x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(~crc));
+  next += FOLD_128;
+  len -= FOLD_128;
+
+  while (len >= FOLD_128) {
+    x0 = _mm_xor_si128(fold128(x0, t.fold_64),
+                       _mm_loadu_si128((const __m128i *)next));
+    x1 = _mm_xor_si128(fold128(x1, t.fold_64),
+                       _mm_loadu_si128((const __m128i *)(next + 16)));
+    x2 = _mm_xor_si128(fold128(x2, t.fold_64),
+                       _mm_loadu_si128((const __m128i *)(next + 32)));
+    x3 = _mm_xor_si128(fold128(x3, t.fold_64),
+                       _mm_loadu_si128((const __m128i *)(next + 48)));
+    next += FOLD_128;
+    len -= FOLD_128;
+  }
+
+  __m128i x = _mm_xor_si128(x3, fold128(x0, t.fold_48));
+  x = _mm_xor_si128(x, fold128(x1, t.fold_32));
+  x = _mm_xor_si128(x, fold128(x2, t.fold_16));
+
+  uint64_t crc0 = _mm_crc32_u64(0, _mm_cvtsi128_si64(x));
+  crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(x, 1));
+  return ~(uint32_t)crc0;
+}
+#endif
+
+bool crc32c_accelerated() {
+#if defined(__x86_64__)
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+#if defined(__x86_64__)
+  static const bool vpclmul = __builtin_cpu_supports("avx512f") &&
+                              __builtin_cpu_supports("vpclmulqdq");
+  static const bool pclmul = __builtin_cpu_supports("pclmul") &&
+                             __builtin_cpu_supports("sse4.2");
+  if (vpclmul && len >= FOLD) {
+    const uint8_t *next = (const uint8_t *)data;
+    size_t folded = len / FOLD * FOLD;
+    crc = crc32c_vpclmul(crc, next, folded);
+    data = next + folded;
+    len -= folded;
+  }
+  if (pclmul && len >= FOLD_128) {
+    const uint8_t *next = (const uint8_t *)data;
+    size_t folded = len / FOLD_128 * FOLD_128;
+    crc = crc32c_pclmul(crc, next, folded);
+    data = next + folded;
+    len -= folded;
+  }
+  if (crc32c_accelerated()) {
+    return crc32c_sse42(crc, data, len);
+  }
+#endif
+  return crc32c_portable(crc, data, len);
+}
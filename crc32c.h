@@ -0,0 +1,17 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of len bytes, continuing from the crc of the bytes
+// before them, 0 to start. uses carry-less multiplication (AVX-512 for long
+// data, 128-bit PCLMULQDQ otherwise) and the SSE4.2 crc32 instruction when
+// the cpu has them, a table driven version otherwise
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+// the table driven version, always available
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t len);
+// crc32c() uses the crc32 instruction
+bool crc32c_accelerated();
+
+#endif
@@ -0,0 +1,223 @@
+#include "disk_pool.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "log.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+
+DiskQueue::DiskQueue() : event_fd(-1) {}
+
+DiskQueue::~DiskQueue() {
+  if (event_fd >= 0) {
+    close(event_fd);
+  }
+}
+
+int DiskQueue::init() {
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    log_perror("eventfd");
+  }
+  return event_fd;
+}
+
+void DiskQueue::take(std::vector<DiskJob> &jobs) {
+  // read before taking: a job pushed after the read signals again
+  uint64_t count;
+  if (read(event_fd, &count, sizeof(count)) < 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  jobs.swap(finished);
+}
+
+void DiskQueue::push(DiskJob &&job) {
+  bool wake;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    // otherwise the event loop is woken already and takes this one too
+    wake = finished.empty();
+    finished.push_back(std::move(job));
+  }
+  uint64_t one = 1;
+  if (wake && write(event_fd, &one, sizeof(one)) < 0) {
+    log_perror("write eventfd");
+  }
+}
+
+bool DiskPool::start(int threads) {
+  try {
+    for (; thread_count < threads; thread_count++) {
+      std::thread(&DiskPool::run, this).detach();
+    }
+  } catch (const std::system_error &e) {
+    log_error("unable to start disk threads: %s\n", e.what());
+    return false;
+  }
+  return true;
+}
+
+void DiskPool::submit(DiskJob &&job) {
+  if (thread_count == 0) {
+    run_disk_job(job);
+    job.done->push(std::move(job));
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    jobs.push_back(std::move(job));
+  }
+  ready.notify_one();
+}
+
+void DiskPool::run() {
+  while (true) {
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this] { return !jobs.empty(); });
+    DiskJob job = std::move(jobs.front());
+    jobs.pop_front();
+    guard.unlock();
+
+    run_disk_job(job);
+    job.done->push(std::move(job));
+  }
+}
+
+// make the entries of a directory durable, returns 0 or -errno
+static int sync_dir(const char *dir) {
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int result = fd >= 0 && fsync(fd) == 0 ? 0 : -errno;
+  if (result < 0) {
+    log_perror("fsync directory");
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return result;
+}
+
+// linkat can't replace a file, so the file is linked under a unique name and
+// renamed over the old one
+static int publish(int fd, const char *temp, const char *name) {
+  char fd_path[64];
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  if (linkat(AT_FDCWD, fd_path, AT_FDCWD, temp, AT_SYMLINK_FOLLOW) == 0 &&
+      rename(temp, name) == 0) {
+    return 0;
+  }
+  int error = errno;
+  log_perror("link upload");
+  unlink(temp);
+  return -error;
+}
+
+// add len bytes of fd at off to crc, 0 or -errno
+static int checksum(int fd, off_t off, size_t len, uint32_t &crc) {
+  // reused by the jobs of this thread
+  static thread_local std::vector<uint8_t> buffer(64 * 1024);
+  while (len > 0) {
+    ssize_t res = pread(fd, buffer.data(), std::min(len, buffer.size()), off);
+    if (res <= 0) {
+      // a read stops early when the file shrank
+      return res < 0 ? -errno : -ENODATA;
+    }
+    crc = crc32c(crc, buffer.data(), res);
+    off += res;
+    len -= res;
+  }
+  return 0;
+}
+
+// stat the file of an Open or Stat job, closing it on error
+static void stat_opened(DiskJob &job) {
+  if (fstat(job.result, &job.st) < 0) {
+    int error = errno;
+    close(job.result);
+    job.result = -error;
+  }
+}
+
+void run_disk_job(DiskJob &job) {
+  job.result = 0;
+  if (job.op == DiskJob::Open) {
+    if ((job.flags & O_ACCMODE) == O_RDONLY) {
+      // watched first, so that every change after the open is seen
+      job.wd = job.files->watch(job.path.c_str());
+    }
+    job.result = open(job.path.c_str(), job.flags, job.mode);
+    if (job.result < 0) {
+      job.result = -errno;
+    } else if ((job.flags & O_ACCMODE) == O_RDONLY) {
+      stat_opened(job);
+    }
+  } else if (job.op == DiskJob::Stat) {
+    job.wd = job.files->watch(job.path.c_str());
+    job.result = job.fd;
+    stat_opened(job);
+    struct stat now;
+    if (job.result >= 0 && job.wd >= 0 &&
+        (stat(job.path.c_str(), &now) < 0 || now.st_dev != job.st.st_dev ||
+         now.st_ino != job.st.st_ino)) {
+      // the name changed after the open but before the watch could see it,
+      // so open what it is now
+      close(job.result);
+      job.result = open(job.path.c_str(), O_RDONLY);
+      if (job.result < 0) {
+        job.result = -errno;
+      } else {
+        stat_opened(job);
+      }
+    }
+  } else if (job.op == DiskJob::Write || job.op == DiskJob::Read) {
+    // all of it, or the error that stopped it
+    size_t done = 0;
+    while (done < job.len) {
+      ssize_t res =
+          job.op == DiskJob::Write
+              ? pwrite(job.fd, job.buffer + done, job.len - done,
+                       job.off + done)
+              : pread(job.fd, job.buffer + done, job.len - done,
+                      job.off + done);
+      if (res <= 0) {
+        // a read stops early when the file shrank
+        job.result = res < 0 ? -errno : -ENODATA;
+        break;
+      }
+      done += res;
+    }
+  } else if (job.op == DiskJob::Sync) {
+    if (fdatasync(job.fd) < 0) {
+      job.result = -errno;
+      log_perror("fdatasync");
+    }
+  } else if (job.op == DiskJob::Publish) {
+    if (job.durable && fdatasync(job.fd) < 0) {
+      job.result = -errno;
+      log_perror("fdatasync");
+    } else if (job.store != NULL) {
+      job.result = job.store->commit(job.fd, job.digest, job.path.c_str())
+                       ? 0
+                       : -EIO;
+    } else {
+      job.result = publish(job.fd, job.temp.c_str(), job.path.c_str());
+    }
+    // and the new name
+    if (job.durable && job.result == 0) {
+      job.result = sync_dir(job.dir.c_str());
+    }
+  } else if (job.op == DiskJob::SyncDir) {
+    job.result = sync_dir(job.path.c_str());
+  } else if (job.op == DiskJob::Link) {
+    job.result = job.store->link(job.digest, job.path.c_str()) ? 0 : -ENOENT;
+  } else if (job.op == DiskJob::Compress) {
+    job.result = deflate_file(job.fd, job.len, &job.zsize, &job.crc);
+  } else if (job.op == DiskJob::Checksum) {
+    job.result = checksum(job.fd, job.off, job.len, job.crc);
+  }
+}
@@ -0,0 +1,129 @@
+#ifndef __DISK_POOL_H__
+#define __DISK_POOL_H__
+
+#include "blob_store.h"
+#include "file_cache.h"
+#include "sha256.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+class DiskQueue;
+
+// a blocking file operation for the disk pool
+struct DiskJob {
+  enum Op {
+    Open,
+    Stat,
+    Write,
+    Read,
+    Sync,
+    Publish,
+    SyncDir,
+    Link,
+    Compress,
+    Checksum
+  };
+  Op op;
+  // connection waiting for it
+  uint64_t key;
+  // where it goes when done
+  DiskQueue *done;
+  // Open: path opened with flags and mode. a file opened for reading is
+  // also stat'ed into st, and wd is the watch() of files for it, which
+  // started when files had unwatched() epoch. Stat: the same for fd, opened
+  // already from path, which is opened again if it changed in the meantime.
+  // Publish, Link: the name given to the content. SyncDir: the directory
+  // whose entries are made durable
+  std::string path;
+  int flags;
+  mode_t mode;
+  struct stat st;
+  const FileCache *files;
+  int wd;
+  uint64_t epoch;
+  // Write: len bytes of buffer at off of fd, Read: the same the other way.
+  // Checksum: len bytes of fd at off are added to crc. Sync: the file whose
+  // content is made durable
+  int fd;
+  uint8_t *buffer;
+  size_t len;
+  off_t off;
+  // Publish: the complete file fd gets its name through store when set,
+  // otherwise it is linked as temp, which is renamed over path. when
+  // durable, fd is synced before and dir, the directory of path, after.
+  // Link: the blob of store with the sha256 digest gets the name
+  std::string temp;
+  bool durable;
+  std::string dir;
+  BlobStore *store;
+  uint8_t digest[SHA256_LEN];
+  // Read, Compress, Checksum: the cache entry whose content it is
+  FileCache::Entry *entry;
+  // Read: for the download of the connection, otherwise the content of
+  // entry to keep in memory
+  bool download;
+  // Compress: a copy of the len bytes of fd, compressed into zsize bytes,
+  // and the crc32c of the content
+  uint64_t zsize;
+  uint32_t crc;
+  // Open, Stat: the fd, Read: 0 with all of it read, Compress: the fd of the copy
+  // or -1 if the content doesn't compress, others: 0, or -errno
+  int result;
+};
+
+// run job on the calling thread
+void run_disk_job(DiskJob &job);
+
+// jobs finished for one event loop, which watches the eventfd returned by
+// init() for readability
+class DiskQueue {
+public:
+  DiskQueue();
+  ~DiskQueue();
+
+  // returns the eventfd, -1 on error
+  int init();
+  // move the finished jobs to jobs
+  void take(std::vector<DiskJob> &jobs);
+  // add a finished job, waking the event loop if it has none yet
+  void push(DiskJob &&job);
+
+private:
+  int event_fd;
+  std::mutex lock;
+  std::vector<DiskJob> finished;
+};
+
+// threads running blocking file operations for the event loops, so that a
+// slow open or write stalls only the connections waiting for it instead of
+// every connection of an event loop. the threads run until the process
+// exits
+class DiskPool {
+public:
+  DiskPool() : thread_count(0) {}
+
+  // start threads, returns false on error
+  bool start(int threads);
+  bool enabled() const { return thread_count > 0; }
+
+  // without threads the job runs right away, it finishes through its queue
+  // either way
+  void submit(DiskJob &&job);
+
+private:
+  void run();
+
+  int thread_count;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<DiskJob> jobs;
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "file_cache.h"
+#include "compress.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <vector>
+
+// anything that may change what a name refers to or what is in the file
+const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE |
+                            IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+static void bump(std::atomic<uint64_t> &counter) {
+  // single writer, so a plain load and store is enough
+  counter.store(counter.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+}
+
+FileCache::FileCache()
+    : capacity(0), data_budget(0), data_max(0), data_bytes(0), inotify_fd(-1),
+      unwatch_count(0) {
+  counters.hits = 0;
+  counters.memory_hits = 0;
+  counters.misses = 0;
+  counters.invalidations = 0;
+  counters.evictions = 0;
+  counters.compressions = 0;
+}
+
+FileCache::~FileCache() {
+  while (!lru.empty()) {
+    remove(lru.back());
+  }
+  if (inotify_fd >= 0) {
+    close(inotify_fd);
+  }
+}
+
+int FileCache::init(size_t capacity, size_t data_budget, size_t data_max) {
+  this->capacity = capacity;
+  this->data_budget = data_budget;
+  this->data_max = data_max;
+  if (capacity == 0) {
+    return -1;
+  }
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    log_perror("inotify_init1");
+  }
+  return inotify_fd;
+}
+
+FileCache::Entry *FileCache::lookup(const char *name) {
+  key.assign(name);
+  auto it = table.find(key);
+  if (it == table.end()) {
+    bump(counters.misses);
+    return NULL;
+  }
+  bump(counters.hits);
+  Entry *entry = it->second;
+  lru.splice(lru.begin(), lru, entry->lru);
+  if (entry->data != NULL) {
+    bump(counters.memory_hits);
+    data_lru.splice(data_lru.begin(), data_lru, entry->data_lru);
+  }
+  entry->refs++;
+  return entry;
+}
+
+int FileCache::watch(const char *name) const {
+  if (inotify_fd < 0) {
+    return -1;
+  }
+  // the parent directory, so that renames over the name are seen too
+  const char *slash = strrchr(name, '/');
+  std::string dir = slash == NULL   ? "."
+                    : slash == name ? "/"
+                                    : std::string(name, slash - name);
+  return inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK);
+}
+
+void FileCache::unwatch(int wd) {
+  // entries of the directory still need it
+  if (wd >= 0 && dirs.find(wd) == dirs.end()) {
+    inotify_rm_watch(inotify_fd, wd);
+    unwatch_count++;
+  }
+}
+
+FileCache::Entry *FileCache::insert(const char *name, int fd,
+                                    const struct stat &st, int wd,
+                                    uint64_t epoch) {
+  if (!S_ISREG(st.st_mode)) {
+    // only regular files can be sent
+    close(fd);
+    unwatch(wd);
+    return NULL;
+  }
+
+  key.assign(name);
+  auto it = table.find(key);
+  if (it != table.end()) {
+    // another download opened it in the meantime
+    close(fd);
+    unwatch(wd);
+    it->second->refs++;
+    return it->second;
+  }
+
+  Entry *entry = new Entry;
+  entry->name = key;
+  entry->fd = fd;
+  entry->st = st;
+  entry->data = NULL;
+  entry->loading = false;
+  entry->zfd = -1;
+  entry->zsize = 0;
+  entry->incompressible = false;
+  entry->compressing = false;
+  entry->crc = 0;
+  entry->has_crc = false;
+  entry->refs = 1;
+  entry->cached = false;
+  entry->wd = -1;
+  if (wd < 0) {
+    // can't know when it changes, so don't cache it
+    return entry;
+  }
+
+  while (table.size() >= capacity) {
+    bump(counters.evictions);
+    remove(lru.back());
+  }
+  if (dirs.find(wd) == dirs.end() && epoch != unwatch_count) {
+    // the watch may have been removed since, with the last entry of its
+    // directory
+    unwatch(wd);
+    return entry;
+  }
+  size_t slash = key.rfind('/');
+  std::string base = slash == std::string::npos ? key : key.substr(slash + 1);
+  Dir &d = dirs[wd];
+  d.refs++;
+  d.entries.insert(std::make_pair(base, entry));
+  entry->wd = wd;
+  entry->cached = true;
+  table[key] = entry;
+  lru.push_front(entry);
+  entry->lru = lru.begin();
+  return entry;
+}
+
+uint8_t *FileCache::start_load(Entry *entry) {
+  size_t size = entry->st.st_size;
+  if (!entry->cached || entry->data != NULL || entry->loading || size == 0 ||
+      size > data_max || size > data_budget) {
+    return NULL;
+  }
+  entry->loading = true;
+  entry->refs++;
+  return (uint8_t *)malloc(size);
+}
+
+void FileCache::loaded(Entry *entry, uint8_t *data, bool ok) {
+  size_t size = entry->st.st_size;
+  entry->loading = false;
+  if (!ok || !entry->cached) {
+    // changed since fstat, leave it to the next miss
+    free(data);
+    release(entry);
+    return;
+  }
+  while (data_bytes + size > data_budget) {
+    bump(counters.evictions);
+    remove(data_lru.back());
+  }
+  entry->data = data;
+  data_bytes += size;
+  data_lru.push_front(entry);
+  entry->data_lru = data_lru.begin();
+  release(entry);
+}
+
+bool FileCache::start_compress(Entry *entry) {
+  if (entry->zfd >= 0 || entry->incompressible || entry->compressing ||
+      (uint64_t)entry->st.st_size < COMPRESS_MIN_LEN) {
+    return false;
+  }
+  // kept with the entry, so it is made at most once per version of the file
+  entry->compressing = true;
+  entry->refs++;
+  return true;
+}
+
+void FileCache::compressed(Entry *entry, int zfd, uint64_t zsize,
+                           uint32_t crc) {
+  entry->compressing = false;
+  if (zfd < 0) {
+    entry->incompressible = true;
+  } else {
+    entry->zfd = zfd;
+    entry->zsize = zsize;
+    // the checksum of a compressed download is of the uncompressed data
+    entry->crc = crc;
+    entry->has_crc = true;
+    bump(counters.compressions);
+  }
+  release(entry);
+}
+
+void FileCache::hold(Entry *entry) { entry->refs++; }
+
+void FileCache::release(Entry *entry) {
+  entry->refs--;
+  if (entry->refs == 0 && !entry->cached) {
+    destroy(entry);
+  }
+}
+
+void FileCache::remove(Entry *entry) {
+  table.erase(entry->name);
+  lru.erase(entry->lru);
+  if (entry->data != NULL) {
+    data_lru.erase(entry->data_lru);
+    data_bytes -= entry->st.st_size;
+  }
+  auto dir = dirs.find(entry->wd);
+  if (dir != dirs.end()) {
+    auto range = dir->second.entries.equal_range(
+        entry->name.substr(entry->name.rfind('/') + 1));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == entry) {
+        dir->second.entries.erase(it);
+        break;
+      }
+    }
+    if (--dir->second.refs == 0) {
+      dirs.erase(dir);
+      unwatch(entry->wd);
+    }
+  }
+  entry->cached = false;
+  if (entry->refs == 0) {
+    destroy(entry);
+  }
+}
+
+void FileCache::destroy(Entry *entry) {
+  close(entry->fd);
+  if (entry->zfd >= 0) {
+    close(entry->zfd);
+  }
+  free(entry->data);
+  delete entry;
+}
+
+void FileCache::invalidate(const char *name) {
+  key.assign(name);
+  auto it = table.find(key);
+  if (it != table.end()) {
+    bump(counters.invalidations);
+    remove(it->second);
+  }
+}
+
+void FileCache::invalidate_dir(int wd) {
+  auto dir = dirs.find(wd);
+  if (dir == dirs.end()) {
+    return;
+  }
+  std::vector<Entry *> victims;
+  for (auto &it : dir->second.entries) {
+    victims.push_back(it.second);
+  }
+  for (Entry *entry : victims) {
+    bump(counters.invalidations);
+    remove(entry);
+  }
+}
+
+void FileCache::handle_events() {
+  alignas(struct inotify_event) char buffer[4096];
+  for (;;) {
+    ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+    if (len <= 0) {
+      if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_perror("read inotify");
+      }
+      return;
+    }
+    for (ssize_t off = 0; off < len;) {
+      struct inotify_event *event = (struct inotify_event *)&buffer[off];
+      off += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // events got lost, nothing can be trusted
+        while (!lru.empty()) {
+          bump(counters.invalidations);
+          remove(lru.back());
+        }
+      } else if (event->mask &
+                 (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+        invalidate_dir(event->wd);
+      } else if (event->len > 0) {
+        auto dir = dirs.find(event->wd);
+        if (dir == dirs.end()) {
+          continue;
+        }
+        auto range = dir->second.entries.equal_range(event->name);
+        std::vector<Entry *> victims;
+        for (auto it = range.first; it != range.second; ++it) {
+          victims.push_back(it->second);
+        }
+        for (Entry *entry : victims) {
+          bump(counters.invalidations);
+          remove(entry);
+        }
+      }
+    }
+  }
+}
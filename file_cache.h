@@ -0,0 +1,138 @@
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+// bounded cache of open files and their stat, keyed by file name, one per
+// event loop. small files also have their content kept in memory, within a
+// byte budget, once it has been read by the caller.
+//
+// entries are reference counted: an entry that gets invalidated or evicted
+// while downloads still use it keeps its fd and content until the last one is
+// done, so readers must use explicit offsets instead of the file position.
+// entries are invalidated by inotify events on their parent directory.
+class FileCache {
+public:
+  struct Entry {
+    std::string name;
+    int fd;
+    struct stat st;
+    // all st.st_size bytes of the file, NULL if not kept in memory
+    uint8_t *data;
+    // the content is being read
+    bool loading;
+    // compressed copy of the file, -1 if not made yet
+    int zfd;
+    uint64_t zsize;
+    // compressing was tried and didn't pay off, or is in progress
+    bool incompressible;
+    bool compressing;
+    // crc32c of the whole file, valid if has_crc
+    uint32_t crc;
+    bool has_crc;
+    int refs;
+    // still reachable by name
+    bool cached;
+    // inotify watch of the parent directory
+    int wd;
+    std::list<Entry *>::iterator lru;
+    std::list<Entry *>::iterator data_lru;
+  };
+
+  // counters are written by the owning event loop and read by any thread
+  struct Stats {
+    std::atomic<uint64_t> hits;
+    // hits with the content in memory
+    std::atomic<uint64_t> memory_hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> invalidations;
+    std::atomic<uint64_t> evictions;
+    // compressed copies made
+    std::atomic<uint64_t> compressions;
+  };
+
+  FileCache();
+  ~FileCache();
+
+  // start caching at most capacity files, and the content of files no larger
+  // than data_max in at most data_budget bytes. returns the fd of the inotify
+  // instance to watch for readability, or -1 when nothing will be cached
+  int init(size_t capacity, size_t data_budget, size_t data_max);
+
+  // find an entry and take a reference to it, NULL on miss
+  Entry *lookup(const char *name);
+  // the blocking part of insert(), safe on any thread: watch the directory
+  // of name for changes. returns the watch, -1 if changes can't be seen.
+  // only changes after it are seen, so it goes before the open, or the name
+  // is checked after it to still be the file opened
+  int watch(const char *name) const;
+  // how many watches have been removed so far. a watch() that started
+  // before that changed may have got one of them
+  uint64_t unwatched() const { return unwatch_count; }
+  // cache fd opened for reading under name and take a reference to it,
+  // NULL (with fd closed) if it is not a regular file. st is the stat of fd
+  // and wd the watch() that started when unwatched() was epoch
+  Entry *insert(const char *name, int fd, const struct stat &st, int wd,
+                uint64_t epoch);
+  // drop a watch() whose file is not inserted after all
+  void unwatch(int wd);
+  // take one more reference to an entry already held
+  void hold(Entry *entry);
+  // drop a reference taken by lookup(), insert() or hold()
+  void release(Entry *entry);
+  // a buffer to read the content of entry into if it should be kept in
+  // memory, NULL if not. the entry keeps a reference until loaded()
+  uint8_t *start_load(Entry *entry);
+  // the content was read into data from start_load(), unless ok is false
+  void loaded(Entry *entry, uint8_t *data, bool ok);
+  // whether the caller should make a compressed copy of the file: it isn't
+  // too small and nobody tried yet. the entry keeps a reference until
+  // compressed()
+  bool start_compress(Entry *entry);
+  // the copy from start_compress() is in zfd, -1 if the file doesn't
+  // compress, with zsize bytes and the crc32c of the uncompressed content
+  void compressed(Entry *entry, int zfd, uint64_t zsize, uint32_t crc);
+  // forget name, e.g. after it has been uploaded
+  void invalidate(const char *name);
+  // drain pending inotify events
+  void handle_events();
+
+  const Stats &stats() const { return counters; }
+
+private:
+  struct Dir {
+    int refs = 0;
+    // entries in this directory by base name
+    std::multimap<std::string, Entry *> entries;
+  };
+
+  void remove(Entry *entry);
+  void destroy(Entry *entry);
+  void invalidate_dir(int wd);
+
+  size_t capacity;
+  size_t data_budget;
+  size_t data_max;
+  // bytes of content held by cached entries
+  size_t data_bytes;
+  int inotify_fd;
+  uint64_t unwatch_count;
+  std::unordered_map<std::string, Entry *> table;
+  // most recently used first
+  std::list<Entry *> lru;
+  // entries with content, most recently used first
+  std::list<Entry *> data_lru;
+  std::unordered_map<int, Dir> dirs;
+  // reused for lookups so that they don't allocate
+  std::string key;
+  Stats counters;
+};
+
+#endif
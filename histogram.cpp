@@ -0,0 +1,65 @@
+#include "histogram.h"
+#include <algorithm>
+#include <math.h>
+
+// values below SUB_BUCKETS are counted exactly, then every power of two from
+// SUB_BITS to 63 has SUB_BUCKETS buckets
+const int BUCKETS = (64 - Histogram::SUB_BITS + 1) * Histogram::SUB_BUCKETS;
+
+Histogram::Histogram()
+    : counts(BUCKETS), total(0), lowest(UINT64_MAX), highest(0), sum(0) {}
+
+int Histogram::index(uint64_t value) {
+  if (value < (uint64_t)SUB_BUCKETS) {
+    return value;
+  }
+  // the highest set bit selects the power of two, the SUB_BITS bits below
+  // it the bucket within
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - SUB_BITS;
+  int sub = (value >> shift) - SUB_BUCKETS;
+  return (shift + 1) * SUB_BUCKETS + sub;
+}
+
+uint64_t Histogram::highest_in(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  return low + ((1ull << shift) - 1);
+}
+
+void Histogram::record(uint64_t value) {
+  counts[index(value)]++;
+  total++;
+  lowest = std::min(lowest, value);
+  highest = std::max(highest, value);
+  sum += value;
+}
+
+void Histogram::merge(const Histogram &other) {
+  for (int i = 0; i < BUCKETS; i++) {
+    counts[i] += other.counts[i];
+  }
+  total += other.total;
+  lowest = std::min(lowest, other.lowest);
+  highest = std::max(highest, other.highest);
+  sum += other.sum;
+}
+
+uint64_t Histogram::percentile(double q) const {
+  if (total == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)ceil(q * total);
+  rank = std::max(rank, (uint64_t)1);
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return std::min(highest_in(i), highest);
+    }
+  }
+  return highest;
+}
@@ -0,0 +1,43 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <vector>
+
+// histogram of 64-bit values in the style of HdrHistogram: buckets double in
+// width with every power of two and are split into SUB_BUCKETS linear ones,
+// so every value is counted within 1/SUB_BUCKETS of itself, with the same
+// memory for nanoseconds as for hours
+class Histogram {
+public:
+  static const int SUB_BITS = 7;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+
+  Histogram();
+
+  void record(uint64_t value);
+  // add the values recorded in other
+  void merge(const Histogram &other);
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total > 0 ? lowest : 0; }
+  uint64_t max() const { return highest; }
+  double mean() const { return total > 0 ? (double)sum / total : 0; }
+  // the value that a fraction q (0 to 1) of the recorded values are not
+  // above, rounded up to the end of its bucket. 0 if nothing was recorded
+  uint64_t percentile(double q) const;
+
+private:
+  static int index(uint64_t value);
+  // the largest value counted in counts[index]
+  static uint64_t highest_in(int index);
+
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t lowest;
+  uint64_t highest;
+  // may wrap around for huge values, only used for the mean
+  uint64_t sum;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "log.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+LogLevel log_level = LOG_INFO;
+
+// bytes of the ring of each thread
+static const size_t RING_SIZE = 256 * 1024;
+// how often the flusher drains the rings
+static const int FLUSH_INTERVAL_US = 10000;
+
+// precedes every line in a ring
+struct LineHeader {
+  uint32_t len;
+  uint32_t level;
+};
+
+// lines of one thread, written by it and read by the flusher. head and tail
+// count bytes from the start, so the ring is full when they are RING_SIZE
+// apart. rings are never freed, there is one per thread that ever logged
+struct LogRing {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  // only written by the thread
+  std::atomic<uint64_t> dropped;
+  char data[RING_SIZE];
+
+  LogRing() : head(0), tail(0), dropped(0) {}
+
+  void copy_in(uint64_t pos, const void *from, size_t len) {
+    size_t off = pos % RING_SIZE;
+    size_t first = std::min(len, RING_SIZE - off);
+    memcpy(&data[off], from, first);
+    memcpy(data, (const char *)from + first, len - first);
+  }
+
+  void copy_out(uint64_t pos, void *to, size_t len) const {
+    size_t off = pos % RING_SIZE;
+    size_t first = std::min(len, RING_SIZE - off);
+    memcpy(to, &data[off], first);
+    memcpy((char *)to + first, data, len - first);
+  }
+};
+
+static std::mutex rings_lock;
+static std::vector<LogRing *> rings;
+static thread_local LogRing *own_ring = NULL;
+static std::atomic<bool> started(false);
+// one drain at a time, by the flusher or log_flush()
+static std::mutex drain_lock;
+static uint64_t reported_drops = 0;
+
+static void write_all(int fd, const char *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t res = write(fd, buffer, len);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // nowhere to report it
+      return;
+    }
+    buffer += res;
+    len -= res;
+  }
+}
+
+bool parse_log_level(const char *s, LogLevel *level) {
+  const char *names[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i <= LOG_DEBUG; i++) {
+    if (strcmp(s, names[i]) == 0) {
+      *level = (LogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void log_write(LogLevel level, const char *format, ...) {
+  char line[MAX_LOG_LINE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len >= sizeof(line)) {
+    len = sizeof(line) - 1;
+    line[len - 1] = '\n';
+  }
+  int fd = level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO;
+  if (!started.load(std::memory_order_acquire)) {
+    write_all(fd, line, len);
+    return;
+  }
+
+  if (own_ring == NULL) {
+    own_ring = new LogRing;
+    std::lock_guard<std::mutex> guard(rings_lock);
+    rings.push_back(own_ring);
+  }
+  LogRing *ring = own_ring;
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  LineHeader header = {(uint32_t)len, (uint32_t)level};
+  if (head + sizeof(header) + len -
+          ring->tail.load(std::memory_order_acquire) >
+      RING_SIZE) {
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+    return;
+  }
+  ring->copy_in(head, &header, sizeof(header));
+  ring->copy_in(head + sizeof(header), line, len);
+  ring->head.store(head + sizeof(header) + len, std::memory_order_release);
+}
+
+// take the lines of ring, errors and warnings into err and the rest into out
+static void drain(LogRing *ring, std::string &out, std::string &err) {
+  uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  while (tail < head) {
+    LineHeader header;
+    ring->copy_out(tail, &header, sizeof(header));
+    std::string &to = header.level <= LOG_WARN ? err : out;
+    size_t at = to.size();
+    to.resize(at + header.len);
+    ring->copy_out(tail + sizeof(header), &to[at], header.len);
+    tail += sizeof(header) + header.len;
+  }
+  ring->tail.store(tail, std::memory_order_release);
+}
+
+static void drain_all() {
+  std::lock_guard<std::mutex> guard(drain_lock);
+  // reused by every drain, so that draining doesn't allocate once they are
+  // as large as they get
+  static std::vector<LogRing *> all;
+  static std::string out;
+  static std::string err;
+  {
+    std::lock_guard<std::mutex> guard(rings_lock);
+    all = rings;
+  }
+  out.clear();
+  err.clear();
+  uint64_t drops = 0;
+  for (LogRing *ring : all) {
+    drain(ring, out, err);
+    drops += ring->dropped.load(std::memory_order_relaxed);
+  }
+  if (drops > reported_drops) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "log dropped %llu lines\n",
+                       (unsigned long long)(drops - reported_drops));
+    err.append(line, len);
+    reported_drops = drops;
+  }
+  write_all(STDOUT_FILENO, out.data(), out.size());
+  write_all(STDERR_FILENO, err.data(), err.size());
+}
+
+static void flush_loop() {
+  while (true) {
+    usleep(FLUSH_INTERVAL_US);
+    drain_all();
+  }
+}
+
+void log_start() {
+  // lines written directly so far may sit in the stdio buffer
+  fflush(stdout);
+  started.store(true, std::memory_order_release);
+  std::thread(flush_loop).detach();
+}
+
+void log_flush() {
+  if (started.load(std::memory_order_acquire)) {
+    drain_all();
+  }
+}
+
+uint64_t log_dropped() {
+  std::lock_guard<std::mutex> guard(rings_lock);
+  uint64_t drops = 0;
+  for (LogRing *ring : rings) {
+    drops += ring->dropped.load(std::memory_order_relaxed);
+  }
+  return drops;
+}
+
+void log_quote(char *out, size_t size, const char *s) {
+  size_t len = 0;
+  out[len++] = '"';
+  // while an escaped byte, the closing quote and the NUL still fit
+  for (; *s != 0 && len + 4 + 2 <= size; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out[len++] = '\\';
+      out[len++] = c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      len += snprintf(&out[len], size - len, "\\x%02x", c);
+    } else {
+      out[len++] = c;
+    }
+  }
+  out[len++] = '"';
+  out[len] = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// asynchronous logging: every thread formats its lines into a ring of its
+// own, and a flusher thread drains all rings every few milliseconds with one
+// write per output. a thread never waits for the flusher or the outputs:
+// when its ring is full the line is dropped and counted
+enum LogLevel { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+// lines above this level are not even formatted, set before threads start
+extern LogLevel log_level;
+
+// parse error, warn, info or debug
+bool parse_log_level(const char *s, LogLevel *level);
+// start the flusher, lines logged before go out right away
+void log_start();
+// write out what the rings hold now, before exiting
+void log_flush();
+// lines dropped because a ring was full
+uint64_t log_dropped();
+
+// errors and warnings go to stderr, the rest to stdout. lines longer than
+// MAX_LOG_LINE are cut
+void log_write(LogLevel level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+const size_t MAX_LOG_LINE = 2048;
+
+#define log_at(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= log_level) {                                                \
+      log_write((level), __VA_ARGS__);                                         \
+    }                                                                          \
+  } while (0)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+// like perror
+#define log_perror(what) log_error("%s: %s\n", (what), strerror(errno))
+
+// write s to out as a quoted string for structured records: quotes,
+// backslashes and bytes that are not printable ascii are escaped, and it is
+// cut to fit size
+void log_quote(char *out, size_t size, const char *s);
+
+#endif
@@ -0,0 +1,98 @@
+// LD_PRELOAD shim that counts heap allocations, to see whether the server
+// allocates while it handles requests: every malloc, calloc, realloc and
+// aligned allocation is counted (operator new goes through malloc), and
+// SIGUSR2 prints the count so far to stderr. the difference between two
+// counts taken around a bench run is what the run allocated. glibc only, and
+// not together with ASan, which replaces malloc itself
+//
+//   LD_PRELOAD=./libmalloc_count.so ./server 8080
+//   kill -USR2 $(pidof server)
+#include <atomic>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+// the allocator of glibc under its own names, so that nothing has to be
+// looked up with dlsym, which allocates
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<uint64_t> allocations(0);
+
+static void bump() { allocations.fetch_add(1, std::memory_order_relaxed); }
+
+// a signal handler, so only async-signal-safe calls
+static void print_count(int) {
+  char line[64] = "malloc_count: ";
+  size_t len = strlen(line);
+  char digits[24];
+  int n = 0;
+  uint64_t value = allocations.load(std::memory_order_relaxed);
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (n > 0) {
+    line[len++] = digits[--n];
+  }
+  line[len++] = '\n';
+  ssize_t res = write(STDERR_FILENO, line, len);
+  (void)res;
+}
+
+__attribute__((constructor)) static void install() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = print_count;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &action, NULL);
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+  bump();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  bump();
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bump();
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  bump();
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  bump();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  bump();
+  void *ptr = __libc_memalign(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *out = ptr;
+  return 0;
+}
+}
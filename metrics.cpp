@@ -0,0 +1,49 @@
+#include "metrics.h"
+#include <stdio.h>
+
+void MetricsWriter::header(const char *name, const char *type,
+                           const char *help) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+void MetricsWriter::sample(const char *name, const std::string &labels,
+                           double value) {
+  char line[512];
+  // counters exactly, sums of seconds without noise digits
+  const char *format = value == (uint64_t)value && value < 1e15
+                           ? "%s{%s} %.0f\n"
+                           : "%s{%s} %.9g\n";
+  snprintf(line, sizeof(line), format, name, labels.c_str(), value);
+  out += line;
+}
+
+void MetricsWriter::histogram(const char *name, const std::string &labels,
+                              const Log2Histogram &h, double scale) {
+  std::string bucket = std::string(name) + "_bucket";
+  std::string sep = labels.empty() ? "" : ",";
+  // buckets are cumulative in prometheus
+  uint64_t seen = 0;
+  for (int i = 0; i < Log2Histogram::BUCKETS; i++) {
+    seen += h.count(i);
+    char le[64];
+    if (i == Log2Histogram::BUCKETS - 1) {
+      snprintf(le, sizeof(le), "le=\"+Inf\"");
+    } else {
+      snprintf(le, sizeof(le), "le=\"%.12g\"", h.bound(i) * scale);
+    }
+    sample(bucket.c_str(), labels + sep + le, seen);
+  }
+  sample((std::string(name) + "_sum").c_str(), labels,
+         h.sum_of_values() * scale);
+  // the buckets are read one by one while the owner keeps writing, so the
+  // count is taken from them to stay consistent
+  sample((std::string(name) + "_count").c_str(), labels, seen);
+}
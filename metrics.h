@@ -0,0 +1,94 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+// building with NO_METRICS (cmake -DMETRICS=OFF) turns every update below
+// into nothing, to measure what the metrics cost
+
+// counter written by one thread and read by any. the writer needs no atomic
+// read-modify-write: a relaxed load and store is a plain add
+class Counter {
+public:
+  Counter() : value(0) {}
+  void add(uint64_t n = 1) {
+#ifndef NO_METRICS
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+#endif
+  }
+  uint64_t load() const { return value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value;
+};
+
+// histogram with fixed power of two bucket bounds, written by one thread and
+// read by any: bucket i counts values up to 2^(shift + i), the last one
+// everything above
+class Log2Histogram {
+public:
+  static const int BUCKETS = 26;
+
+  // the default suits nanoseconds: bounds from 1us to 34s
+  explicit Log2Histogram(int shift = 10) : shift(shift) {}
+
+  void record(uint64_t value) {
+#ifndef NO_METRICS
+    int i = 0;
+    if (value > 1) {
+      i = std::max(64 - __builtin_clzll(value - 1) - shift, 0);
+      i = std::min(i, BUCKETS - 1);
+    }
+    counts[i].add();
+    total.add();
+    sum.add(value);
+#endif
+  }
+
+  // upper bound of bucket i, the last one has none
+  uint64_t bound(int i) const { return 1ull << (shift + i); }
+  uint64_t count(int i) const { return counts[i].load(); }
+  uint64_t count() const { return total.load(); }
+  uint64_t sum_of_values() const { return sum.load(); }
+
+private:
+  int shift;
+  Counter counts[BUCKETS];
+  Counter total;
+  Counter sum;
+};
+
+// timestamps for the histograms in nanoseconds, 0 without metrics
+inline uint64_t metrics_now() {
+#ifndef NO_METRICS
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+// builds a page in the prometheus text format. all samples of a metric must
+// follow its header, labels are given like worker="0",state="SendFile"
+class MetricsWriter {
+public:
+  void header(const char *name, const char *type, const char *help);
+  void sample(const char *name, const std::string &labels, double value);
+  // the _bucket, _sum and _count samples of h, with bounds and sum
+  // multiplied by scale, e.g. 1e-9 for nanoseconds as seconds
+  void histogram(const char *name, const std::string &labels,
+                 const Log2Histogram &h, double scale);
+
+  const std::string &text() const { return out; }
+
+private:
+  std::string out;
+};
+
+#endif
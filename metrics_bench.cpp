@@ -0,0 +1,57 @@
+// measures what the server metrics cost: the clock read of every state
+// change, counter adds and histogram records, and what a request pays for
+// all of them together
+#include "metrics.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+const int ITERATIONS = 100000000;
+
+double now() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// nanoseconds per call of fn
+template <typename F> double per_call(F fn) {
+  double begin = now();
+  for (int i = 0; i < ITERATIONS; i++) {
+    fn(i);
+  }
+  return (now() - begin) * 1e9 / ITERATIONS;
+}
+
+int main() {
+  Counter counter;
+  Log2Histogram histogram;
+  std::atomic<uint64_t> shared(0);
+  uint64_t sink = 0;
+
+#ifdef NO_METRICS
+  printf("built with NO_METRICS, updates are compiled out\n");
+#endif
+  double clock = per_call([&](int) { sink += metrics_now(); });
+  double add = per_call([&](int) { counter.add(); });
+  double record = per_call([&](int i) { histogram.record(i * 977ull); });
+  // what a counter shared by threads would cost instead
+  double fetch_add = per_call(
+      [&](int) { shared.fetch_add(1, std::memory_order_relaxed); });
+  printf("clock read: %.1f ns\n", clock);
+  printf("counter add: %.1f ns\n", add);
+  printf("histogram record: %.1f ns\n", record);
+  printf("atomic fetch_add, for comparison: %.1f ns\n", fetch_add);
+
+  // a download served from memory reads the clock twice (when it starts and
+  // when it is back to WaitForRequest), records 3 histograms and adds about
+  // 6 counters
+  double request = 2 * clock + 3 * record + 6 * add;
+  printf("per request: about %.0f ns, %.2f%% of a request at 100k requests "
+         "per second on a core\n",
+         request, request / 10000 * 100);
+  if (sink == 1 || counter.load() + histogram.count() + shared == 0) {
+    printf("lucky\n");
+  }
+  return 0;
+}
@@ -0,0 +1,110 @@
+#include "rate_limit.h"
+#include <algorithm>
+
+const uint64_t NS_PER_SEC = 1000000000;
+
+uint64_t burst_of(uint64_t rate, uint64_t min) {
+  return std::max(rate / 10, min);
+}
+
+void TokenBucket::init(uint64_t rate, uint64_t burst) {
+  this->rate = rate;
+  this->burst_ns = 0;
+  this->paid_at = 0;
+  if (rate > 0) {
+    burst_ns = cost(burst);
+  }
+}
+
+uint64_t TokenBucket::cost(uint64_t n) const {
+  // rounded up, and wide enough for any rate
+  return ((unsigned __int128)n * NS_PER_SEC + rate - 1) / rate;
+}
+
+uint64_t TokenBucket::available(uint64_t now) const {
+  if (!limited()) {
+    return UINT64_MAX;
+  }
+  // what came in since everything was paid for, up to a full bucket
+  uint64_t base = std::max(paid_at, now);
+  if (base - now >= burst_ns) {
+    return 0;
+  }
+  return (unsigned __int128)(now + burst_ns - base) * rate / NS_PER_SEC;
+}
+
+void TokenBucket::take(uint64_t now, uint64_t n) {
+  if (limited()) {
+    paid_at = std::max(paid_at, now) + cost(n);
+  }
+}
+
+uint64_t TokenBucket::wait(uint64_t now, uint64_t n) const {
+  if (!limited()) {
+    return 0;
+  }
+  uint64_t ready_at = std::max(paid_at, now) + cost(n);
+  ready_at = ready_at > burst_ns ? ready_at - burst_ns : 0;
+  return ready_at > now ? ready_at - now : 0;
+}
+
+void RateLimiter::init(const Rates &per_client, const Rates &global) {
+  enabled = per_client.bytes > 0 || per_client.requests > 0 ||
+            global.bytes > 0 || global.requests > 0;
+  client_rates = per_client;
+  bytes.init(global.bytes, burst_of(global.bytes, MIN_GRANT));
+  requests.init(global.requests, burst_of(global.requests, 1));
+}
+
+RateLimiter::Client *RateLimiter::acquire(const std::string &address) {
+  std::lock_guard<std::mutex> guard(lock);
+  Client &client = clients[address];
+  if (client.refs == 0) {
+    // a new address, or one whose connections all went away
+    client.address = address;
+    client.bytes.init(client_rates.bytes,
+                      burst_of(client_rates.bytes, MIN_GRANT));
+    client.requests.init(client_rates.requests,
+                         burst_of(client_rates.requests, 1));
+  }
+  client.refs++;
+  return &client;
+}
+
+void RateLimiter::release(Client *client) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (--client->refs == 0) {
+    clients.erase(client->address);
+  }
+}
+
+uint64_t RateLimiter::allowance(Client *client, uint64_t now, uint64_t min,
+                                uint64_t max, uint64_t *wait) {
+  std::lock_guard<std::mutex> guard(lock);
+  uint64_t n = std::min(
+      {max, client->bytes.available(now), bytes.available(now)});
+  if (n >= min) {
+    return n;
+  }
+  *wait = std::max(client->bytes.wait(now, min), bytes.wait(now, min));
+  client->bytes.take(now, min);
+  bytes.take(now, min);
+  return 0;
+}
+
+void RateLimiter::take_bytes(Client *client, uint64_t now, uint64_t n) {
+  std::lock_guard<std::mutex> guard(lock);
+  client->bytes.take(now, n);
+  bytes.take(now, n);
+}
+
+bool RateLimiter::take_request(Client *client, uint64_t now, uint64_t *wait) {
+  std::lock_guard<std::mutex> guard(lock);
+  bool ok =
+      client->requests.available(now) >= 1 && requests.available(now) >= 1;
+  *wait = ok ? 0
+             : std::max(client->requests.wait(now, 1), requests.wait(now, 1));
+  client->requests.take(now, 1);
+  requests.take(now, 1);
+  return ok;
+}
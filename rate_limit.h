@@ -0,0 +1,90 @@
+#ifndef __RATE_LIMIT_H__
+#define __RATE_LIMIT_H__
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+// token bucket in the form of the generic cell rate algorithm: instead of a
+// token count it keeps the time at which everything taken so far is paid
+// for, so nothing needs to be refilled. taking more than is there is allowed
+// and delays the tokens that follow. times are in nanoseconds
+class TokenBucket {
+public:
+  TokenBucket() : rate(0), burst_ns(0), paid_at(0) {}
+
+  // rate tokens per second, 0 for no limit, and up to burst of them at once
+  void init(uint64_t rate, uint64_t burst);
+  bool limited() const { return rate > 0; }
+
+  // tokens there at now
+  uint64_t available(uint64_t now) const;
+  void take(uint64_t now, uint64_t n);
+  // time from now until n tokens are there
+  uint64_t wait(uint64_t now, uint64_t n) const;
+
+private:
+  // time for n tokens to come in
+  uint64_t cost(uint64_t n) const;
+
+  uint64_t rate;
+  uint64_t burst_ns;
+  uint64_t paid_at;
+};
+
+// rates in tokens per second, 0 for no limit
+struct Rates {
+  uint64_t bytes;
+  uint64_t requests;
+};
+
+// bandwidth and request rate of every client address and of everything,
+// shared by all event loops. bytes are counted in both directions
+class RateLimiter {
+public:
+  // the buckets of a client address, held by its connections
+  struct Client {
+    std::string address;
+    TokenBucket bytes;
+    TokenBucket requests;
+    int refs;
+  };
+
+  RateLimiter() : enabled(false) {}
+
+  void init(const Rates &per_client, const Rates &global);
+  bool limited() const { return enabled; }
+
+  // the buckets of address, for as long as it is not released
+  Client *acquire(const std::string &address);
+  void release(Client *client);
+
+  // how many bytes client may move now, up to max. when there are fewer
+  // than min, min are taken in advance and 0 is returned, with *wait set to
+  // the time until they are paid for. taking in advance lets clients that
+  // share a limit take turns instead of racing for it
+  uint64_t allowance(Client *client, uint64_t now, uint64_t min, uint64_t max,
+                     uint64_t *wait);
+  // count bytes moved
+  void take_bytes(Client *client, uint64_t now, uint64_t n);
+  // take one request, in advance like allowance() when there is none now
+  bool take_request(Client *client, uint64_t now, uint64_t *wait);
+
+private:
+  bool enabled;
+  Rates client_rates;
+  std::mutex lock;
+  TokenBucket bytes;
+  TokenBucket requests;
+  std::unordered_map<std::string, Client> clients;
+};
+
+// fewest bytes moved at once when limited, unless fewer are left, so that
+// a slow rate doesn't turn into tiny writes
+const uint64_t MIN_GRANT = 16 * 1024;
+
+// burst of a bucket: what comes in within 100ms, and at least min
+uint64_t burst_of(uint64_t rate, uint64_t min);
+
+#endif
@@ -0,0 +1,79 @@
+#include "recv_ring.h"
+#include <string.h>
+#include <sys/uio.h>
+
+void RecvRing::attach(uint8_t *buffer, size_t capacity) {
+  data = buffer;
+  cap = capacity;
+  head = 0;
+  len = 0;
+  filling = false;
+}
+
+uint8_t *RecvRing::detach() {
+  uint8_t *buffer = data;
+  data = NULL;
+  cap = 0;
+  head = 0;
+  len = 0;
+  return buffer;
+}
+
+ssize_t RecvRing::fill(int fd) {
+  // free space is at most two segments: after the tail and before the head
+  size_t tail = (head + len) & (cap - 1);
+  struct iovec iov[2];
+  int iovcnt = 1;
+  if (tail >= head && len != cap) {
+    iov[0].iov_base = &data[tail];
+    iov[0].iov_len = cap - tail;
+    if (head > 0) {
+      iov[1].iov_base = data;
+      iov[1].iov_len = head;
+      iovcnt = 2;
+    }
+  } else {
+    iov[0].iov_base = &data[tail];
+    iov[0].iov_len = head - tail;
+  }
+  ssize_t res = readv(fd, iov, iovcnt);
+  if (res > 0) {
+    len += res;
+  }
+  return res;
+}
+
+uint8_t *RecvRing::back(size_t *seg_len) {
+  size_t tail = (head + len) & (cap - 1);
+  if (tail >= head && len != cap) {
+    *seg_len = cap - tail;
+  } else {
+    *seg_len = head - tail;
+  }
+  return &data[tail];
+}
+
+void RecvRing::peek(size_t off, void *dst, size_t n) const {
+  size_t start = (head + off) & (cap - 1);
+  size_t first = n < cap - start ? n : cap - start;
+  memcpy(dst, &data[start], first);
+  memcpy((uint8_t *)dst + first, data, n - first);
+}
+
+const uint8_t *RecvRing::front(size_t n, size_t *seg_len) const {
+  size_t first = cap - head;
+  if (n > len) {
+    n = len;
+  }
+  *seg_len = n < first ? n : first;
+  return &data[head];
+}
+
+void RecvRing::consume(size_t n) {
+  head = (head + n) & (cap - 1);
+  len -= n;
+  if (len == 0 && !filling) {
+    // keep reads contiguous when possible
+    head = 0;
+  }
+}
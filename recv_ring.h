@@ -0,0 +1,53 @@
+#ifndef __RECV_RING_H__
+#define __RECV_RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// receive buffer of a connection: a ring over a buffer borrowed from the
+// worker's pool, filled with one readv() per call and consumed from the head
+class RecvRing {
+public:
+  RecvRing() : data(NULL), cap(0), head(0), len(0), filling(false) {}
+
+  // start using buffer, capacity must be a power of two
+  void attach(uint8_t *buffer, size_t capacity);
+  // stop using the buffer and return it, the ring must be empty
+  uint8_t *detach();
+  bool attached() const { return data != NULL; }
+
+  // read as much as fits from fd, returns the result of readv()
+  ssize_t fill(int fd);
+  // contiguous free space after the tail, for filling by other means, and
+  // adding n bytes written there
+  uint8_t *back(size_t *seg_len);
+  void produce(size_t n) {
+    len += n;
+    filling = false;
+  }
+  // the same for a fill that finishes later, until produce() the tail stays
+  // where it is even when the ring runs empty
+  uint8_t *start_fill(size_t *seg_len) {
+    filling = true;
+    return back(seg_len);
+  }
+  // copy n bytes starting at offset off from the head
+  void peek(size_t off, void *dst, size_t n) const;
+  uint8_t at(size_t off) const { return data[(head + off) & (cap - 1)]; }
+  // contiguous bytes starting at the head, at most n
+  const uint8_t *front(size_t n, size_t *seg_len) const;
+  void consume(size_t n);
+
+  size_t size() const { return len; }
+  size_t space() const { return cap - len; }
+
+private:
+  uint8_t *data;
+  size_t cap;
+  size_t head;
+  size_t len;
+  bool filling;
+};
+
+#endif
@@ -1,477 +1,4245 @@
+#include "blob_store.h"
+#include "buffer_pool.h"
 #include "common.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "disk_pool.h"
+#include "file_cache.h"
+#include "log.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include "recv_ring.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "uring.h"
 #include <algorithm>
+#include <atomic>
+#include <endian.h>
 #include <fcntl.h>
-#include <map>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <string>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
+// state of the request at the head of the queue
 enum State {
-  WaitForCommand,
-  WaitForName,
-  WaitForBodyLen,
-  WaitForBody,
-  SendResp,
-  SendFile,
+  Handshake,      // tls only: before the first request
+  WaitForRequest, // no request in progress
+  WaitForName,    // batch only: waiting for the next name of the batch
+  WaitForOpen,    // waiting for io_uring or the disk pool to open the file
+  WaitForBody,    // upload only
+  WaitForDisk,    // waiting for the disk pool to write the body or link a blob
+  WaitForSync,    // upload only: waiting for the body to be named, durably
+  SendResp,       // download only: flushing resp header before the file
+  SendFile,       // download only
+  SendData,       // download only: resp header and file content from memory
 };
-enum Command { Download, Upload };
+const int STATE_COUNT = State::SendData + 1;
+const char *STATE_NAMES[STATE_COUNT] = {
+    "Handshake",   "WaitForRequest", "WaitForName", "WaitForOpen",
+    "WaitForBody", "WaitForDisk",    "WaitForSync", "SendResp",
+    "SendFile",    "SendData",
+};
+enum Command { Download, Upload, Hello, Batch, Codecs, Have };
+const int COMMAND_COUNT = Command::Have + 1;
+const char *COMMAND_NAMES[COMMAND_COUNT] = {
+    "download", "upload", "hello", "batch", "codecs", "have",
+};
+// what a connection times out on, by what it waits for
+enum Timeout {
+  NoTimeout,     // the server, e.g. a file to open or the group commit
+  IdleTimeout,   // the next request
+  HeaderTimeout, // the rest of a request header, counted from its start
+  IoTimeout,     // progress of a body, a batch or a resp
+};
+const int TIMEOUT_COUNT = Timeout::IoTimeout + 1;
+const char *TIMEOUT_NAMES[TIMEOUT_COUNT] = {"none", "idle", "header", "io"};
+// how a tls handshake ended: the kernel took the records of both directions
+// or of sending only, openssl keeps them in user space, or it failed
+enum TlsResult { KernelTls, KernelSend, UserTls, TlsFailed };
+const int TLS_RESULT_COUNT = TlsResult::TlsFailed + 1;
+const char *TLS_RESULT_NAMES[TLS_RESULT_COUNT] = {"kernel", "kernel_send",
+                                                  "user", "failed"};
+enum Backend { Epoll, IoUring };
+// when uploads are made durable before they are answered
+enum Durability {
+  NoSync,      // left to the kernel
+  SyncFile,    // fdatasync of every upload
+  GroupCommit, // one syncfs for all uploads completed within an interval
+};
+enum SocketKind {
+  Listen, // listen socket
+  Client, // client socket
+  Notify, // inotify instance of the file cache
+  Timer,  // timerfd of the group commit
+  Pacer,  // timerfd waking connections that wait for tokens
+  Ticker, // timerfd ticking the timer wheel
+  Disk,   // eventfd of the jobs the disk pool finished
+};
+
+// newest protocol version understood
+const uint8_t MAX_VERSION = 2;
+// v2 request flag: the upload body is compressed, or the download resp may be
+const uint8_t FLAG_COMPRESSED = 0x01;
+// v2 request flag: the resp carries the crc32c of the file content
+const uint8_t FLAG_CHECKSUM = 0x02;
+// v2 request flag: over the unix socket, the download may be answered with
+// the file itself instead of its content
+const uint8_t FLAG_PASS_FILE = 0x04;
+// codecs understood
+const uint8_t SUPPORTED_CODECS = CODEC_ZLIB;
+// longest file name, not including NUL
+const int MAX_NAME_LEN = 256;
+// longest client address and port in access records, including NUL
+const int MAX_PEER_LEN = 64;
+// longest resp header: status and a 64-bit varint length
+const int MAX_RESP_LEN = 1 + MAX_VARINT_LEN;
+// size of the receive ring of a connection, a power of two
+const size_t RECV_BUFFER_LEN = 16 * 1024;
+// most parsed requests queued on a connection
+const int MAX_PIPELINE = 32;
+// size of the buffer for copying upload bodies when splice is not possible
+const size_t COPY_BUFFER_LEN = 256 * 1024;
+// upload bodies copied through user space are written in blocks of this size
+const size_t UPLOAD_BLOCK_LEN = 256 * 1024;
+// blocks of a connection being written by the disk pool or io_uring before
+// it stops receiving its upload body
+const int MAX_DISK_WRITES = 2;
+// a pipe holds whole pages of a file spliced into it
+const size_t PAGE_LEN = 4096;
+// threads of the disk pool
+const int DEFAULT_DISK_THREADS = 4;
+// interval of the group commit by default
+const int DEFAULT_COMMIT_MS = 2;
+// files kept open per worker by default
+const size_t DEFAULT_CACHED_FILES = 1024;
+// memory for file content per worker by default
+const size_t DEFAULT_CACHED_BYTES = 64 * 1024 * 1024;
+// largest file whose content is kept in memory by default
+const size_t DEFAULT_CACHED_FILE_MAX = 64 * 1024;
+// bytes a connection may move in one turn by default
+const size_t DEFAULT_TURN_BYTES = 256 * 1024;
+// time a connection may take in one turn by default, in microseconds
+const int DEFAULT_TURN_US = 500;
+// resolution of the timeouts
+const uint64_t TICK_NS = 100 * 1000000;
+// timeouts by default, in seconds
+const int DEFAULT_IDLE_TIMEOUT = 60;
+const int DEFAULT_HEADER_TIMEOUT = 10;
+const int DEFAULT_IO_TIMEOUT = 30;
+// connections open at once over all workers by default
+const int DEFAULT_MAX_CONNECTIONS = 10000;
+// entries reserved up front in the queues of connections of a worker, which
+// keep what they grow to beyond that
+const size_t QUEUE_RESERVE = 1024;
+
+// a parsed request whose header is still in the receive ring
+struct Request {
+  Command command;
+  // protocol version the request was framed with, resps use the same one
+  uint8_t version;
+  // FLAG_* of v2
+  uint8_t flags;
+  // bytes of the header, counted from the end of the previous request
+  uint32_t header_len;
+  // position of the name in the header
+  uint32_t name_off;
+  uint32_t name_len;
+  // Upload only
+  uint64_t body_len;
+  // Download only: bytes to send starting at range_off, 0 for up to the end
+  uint64_t range_off;
+  uint64_t range_len;
+  // Batch only: number of names following the header
+  uint64_t batch_count;
+  // Codecs only: codecs the client understands
+  uint8_t codecs;
+  // Have only: position of the sha256 of the content in the header
+  uint32_t digest_off;
+};
+
+// a pipe between a file and a socket
+struct SplicePipe {
+  int fds[2];
+  size_t size;
+};
+
+struct SocketState {
+  int fd;
+  SocketKind kind;
+  // address and port of the client, for access records
+  char peer[MAX_PEER_LEN];
+  // slot of this state, stored in epoll and io_uring events
+  uint64_t key;
+  // readiness seen from events, cleared on EAGAIN, or with io_uring when a
+  // receive or a splice is started
+  bool can_read;
+  bool can_write;
+  // got EOF from remote
+  bool peer_closed;
+  // remote shut down its side, seen from EPOLLRDHUP: a receive of io_uring
+  // then never waits, and a short one may leave the EOF behind
+  bool read_shut;
+  // accepted on the unix socket, so files can be passed to the client
+  bool local;
+  // used up its turn and waits in the ready queue of the worker
+  bool in_ready;
+  // tls of the connection, NULL for plain tcp. after the handshake, the
+  // directions the kernel doesn't take go through openssl
+  SSL *ssl;
+  bool tls_recv;
+  bool tls_send;
+  // bytes of the last tls write that found the socket full, which the next
+  // one has to pass again
+  size_t tls_retry;
+  // tokens of the connection, and of its client address when those are
+  // limited too
+  TokenBucket byte_tokens;
+  TokenBucket request_tokens;
+  RateLimiter::Client *client;
+  // taken in advance after running out, used from when they are paid for
+  // before taking more
+  uint64_t prepaid_bytes;
+  uint64_t bytes_paid_at;
+  bool prepaid_request;
+  uint64_t request_paid_at;
+  // when the tokens it ran out of in this turn are there, 0 if it didn't
+  uint64_t pace_at;
+  // when it is woken from the paced queue of the worker, 0 if not waiting
+  uint64_t paced_at;
+  // what it times out on and when, 0 for never. moving the deadline later
+  // leaves the timer in the wheel, which is moved when it expires
+  Timeout timeout;
+  uint64_t deadline;
+  // tick of its timer in the wheel, 0 if there is none
+  uint64_t timer_tick;
+
+  // bytes received but not consumed yet, holds a pooled buffer only while
+  // there is something in it
+  RecvRing recv;
+  // parsed requests waiting for their turn, responses go out in this order
+  Request requests[MAX_PIPELINE];
+  int req_head;
+  int req_count;
+  // bytes of recv covered by queued requests
+  size_t parsed_len;
+  // protocol version of the next request to parse, changed by hellos
+  uint8_t parse_version;
+  // an upload is queued or in progress: its body follows its header, so
+  // nothing after it can be parsed until the body is consumed
+  bool upload_pending;
+  // the same for the names of a batch, which are received into recv
+  bool batch_pending;
+
+  // request in progress
+  State state;
+  // when state was entered, and the request in progress started
+  uint64_t state_since;
+  uint64_t request_start;
+  bool in_request;
+  // content bytes moved for the request in progress, and whether it is
+  // answered with a failure
+  uint64_t request_bytes;
+  bool request_failed;
+  Command current_command;
+  uint8_t version;
+  // codecs agreed on with the client
+  uint8_t codecs;
+  // body of the upload is compressed, or the download may be
+  bool compressed;
+  // crc32c of the file content goes after the download body or in the
+  // upload resp
+  bool checksum;
+  uint32_t crc;
+  // the download may pass its file instead of sending it
+  bool pass_file;
+  char file_name[MAX_NAME_LEN + 1];
+  // resp headers not sent yet, several small ones are sent together
+  uint8_t write_buffer[32];
+  int write_len;
+  int buffer_written;
+  // file sent along with the resp header at pass_at in write_buffer, -1 if
+  // none
+  int pass_fd;
+  int pass_at;
+  // Download only: the file is shared with other downloads, so it is read
+  // from an offset of our own
+  FileCache::Entry *file;
+  // the file or its compressed copy
+  int send_fd;
+  uint64_t range_off;
+  uint64_t range_len;
+  off_t file_off;
+  uint64_t file_remaining;
+  // with tls in user space, the file is read on the disk pool into chunk, a
+  // block of the worker's pool, and written through openssl from there.
+  // chunk_busy while a read runs
+  uint8_t *chunk;
+  size_t chunk_len;
+  size_t chunk_sent;
+  bool chunk_busy;
+  // crc is computed from what sendfile sent, by checksum jobs on the disk
+  // pool: of the content up to crc_off so far, crc_busy while one runs
+  bool crc_streaming;
+  bool crc_busy;
+  off_t crc_off;
+  // crc of a download sent from memory, after its content
+  uint8_t trailer[4];
+  int trailer_len;
+  int trailer_written;
+  // Batch only: names not taken from recv yet
+  uint64_t batch_remaining;
+  // the download in progress is part of a batch
+  bool in_batch;
+  // Upload only: the body goes to an unnamed file, which is given the name
+  // when complete
+  int file_fd;
+  char dir_name[MAX_NAME_LEN + 1];
+  // body not written to the file yet, from the worker's pool
+  uint8_t *block;
+  size_t block_len;
+  uint64_t body_len;
+  uint64_t written_len;
+  // false after splice into the file failed, then the body is copied
+  bool splice_body;
+  // with the disk pool or io_uring: where the next block goes in the file,
+  // and blocks being written
+  off_t write_off;
+  int disk_pending;
+  // decompresses the body, NULL if it is not compressed
+  Inflater *inflater;
+  // hashes the decompressed body for the blob store, NULL without one
+  Sha256 *hasher;
+
+  // io_uring only: receives, sends and splices of the socket in flight,
+  // at most one receive and one send or splice at a time. they use the
+  // buffers of the connection, which stay until they complete, even after
+  // it is closed
+  int ring_ops;
+  bool recv_busy;
+  bool send_busy;
+  // bytes asked for by the receive in flight
+  size_t recv_len;
+  struct msghdr send_msg;
+  struct iovec send_iov[3];
+  // pipe a download is spliced through, and bytes of the file in it
+  SplicePipe pipe;
+  size_t pipe_len;
+};
+
+// counters and histograms of a worker, written by its event loop and read by
+// the metrics thread. times are in nanoseconds
+struct Metrics {
+  Counter accepted;
+  Counter closed;
+  Counter requests[COMMAND_COUNT];
+  // requests answered with 0x00, and connections closed for invalid data
+  Counter failed;
+  Counter invalid;
+  Counter received_bytes;
+  Counter sent_bytes;
+  // reads and writes of sockets that found nothing to do
+  Counter read_eagain;
+  Counter write_eagain;
+  // readiness events and completions handled
+  Counter events;
+  // turns ended by the budget rather than by running out of work
+  Counter turns_exceeded;
+  // connections put to sleep until they have tokens again
+  Counter paced;
+  // connections closed for taking too long, by what they waited for
+  Counter timeouts[TIMEOUT_COUNT];
+  // connections closed right after accept, over the limit or out of fds
+  Counter rejected;
+  Counter tls_handshakes[TLS_RESULT_COUNT];
+  // downloads answered with the file rather than its content
+  Counter passed_files;
+  // time spent in each state, and from taking a request off the queue until
+  // the next one can be taken
+  Log2Histogram state_time[STATE_COUNT];
+  Log2Histogram request_time[COMMAND_COUNT];
+  // bytes moved per call, from 512 bytes on
+  Log2Histogram sendfile_bytes;
+  Log2Histogram splice_bytes;
+
+  Metrics() : sendfile_bytes(9), splice_bytes(9) {}
+};
+
+enum CommitStep { SyncFiles, NameFiles, SyncDirs, CommitIdle };
+
+// a connection waiting for tokens until at
+struct Wakeup {
+  uint64_t at;
+  uint64_t key;
+};
+
+// one event loop per thread, each with its own listen sockets and connections
+struct Worker {
+  int id;
+  Backend backend;
+  int epoll_fd;
+  Uring ring;
+  // connection states, keyed by slot
+  Slab<SocketState> state;
+  // receive buffers of connections
+  BufferPool buffers;
+  // blocks for writing upload bodies
+  BufferPool blocks;
+  // runs opens and upload writes when enabled, finished jobs come back
+  // through disk_done
+  DiskPool *disk;
+  DiskQueue disk_done;
+  std::vector<DiskJob> disk_jobs;
+  // files of closed connections, closed when the jobs still running on them
+  // are done
+  std::unordered_map<int, int> orphan_files;
+  // files opened for downloads
+  FileCache files;
+  // where uploads go when deduplicating
+  BlobStore store;
+  // accepted connections speak tls when set
+  SSL_CTX *tls;
+  // pipe for splicing upload bodies into files, always drained before the
+  // worker moves on to another connection
+  int pipe_fds[2];
+  size_t pipe_size;
+  // io_uring only: upload blocks being written, finished like the writes of
+  // the disk pool
+  Slab<DiskJob> ring_writes;
+  // io_uring only: empty pipes for splicing downloads
+  std::vector<SplicePipe> pipes;
+  // io_uring only: connections closed while socket operations were in
+  // flight, by the key those carry. they keep their slot under a new key
+  // until the last one completes
+  std::unordered_map<uint64_t, uint64_t> closing;
+  // scratch buffer for copying upload bodies
+  std::vector<uint8_t> copy_buffer;
+  Durability durability;
+  // GroupCommit only: the timer fires commit_ms after the first upload
+  // waits, which is when all uploads waiting by then are made durable
+  int commit_ms;
+  int commit_timer_fd;
+  std::vector<uint64_t> commit_pending;
+  // the uploads of the group commit in progress, which syncs their files,
+  // then gives them their names, then syncs the directories they are in.
+  // each step is a batch of disk jobs, the next one starts when all are done
+  std::vector<uint64_t> committing;
+  CommitStep commit_step;
+  int commit_jobs;
+  std::vector<const char *> commit_dirs;
+  // makes temporary names unique
+  uint64_t temp_seq;
+  // a connection gets a turn when it has an event, which ends after it
+  // moved turn_bytes or took turn_ns (0 for no time limit). if it could go
+  // on, it waits in ready for another turn after the connections with events.
+  // the ones getting it are moved to running, so that connections whose
+  // turn ends again wait in ready for the next round
+  size_t turn_bytes;
+  uint64_t turn_ns;
+  // bytes left in the turn in progress
+  size_t turn_left;
+  std::vector<uint64_t> ready;
+  std::vector<uint64_t> running;
+  // limits of clients and of everything, shared by all workers, and the
+  // limits of every connection. limited if any of them is
+  RateLimiter *limiter;
+  Rates conn_rates;
+  bool limited;
+  // connections waiting for tokens, a heap with the first to be woken on
+  // top, woken by the timer, which is set for the first one or disarmed at 0
+  int pace_timer_fd;
+  std::vector<Wakeup> paced;
+  uint64_t pace_armed;
+  // time of the round of events, for the timeouts
+  uint64_t now;
+  // length of each Timeout, 0 for none
+  uint64_t timeouts[TIMEOUT_COUNT];
+  // timers of the connection deadlines, ticked by a timerfd while not empty
+  TimerWheel wheel;
+  int tick_timer_fd;
+  std::vector<TimerWheel::Timer> expired;
+  // client connections of all workers, and how many may be open at once, 0
+  // for no limit
+  std::atomic<int> *connections;
+  int max_connections;
+  // closed to accept and close a connection when out of fds
+  int spare_fd;
+  Metrics metrics;
+
+  Worker()
+      : buffers(RECV_BUFFER_LEN), blocks(UPLOAD_BLOCK_LEN),
+        copy_buffer(COPY_BUFFER_LEN) {}
+};
+
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// count bytes moved against the turn in progress
+void use_turn(Worker &w, size_t len) {
+  w.turn_left -= std::min(len, w.turn_left);
+}
+
+// wait for tokens until at, or earlier if other tokens are there by then
+void wait_tokens(SocketState &s, uint64_t at) {
+  s.pace_at = s.pace_at == 0 ? at : std::min(s.pace_at, at);
+}
+
+// how many of want bytes the connection may move now, by its own limit and
+// the ones it shares. when it has to wait for tokens, they are taken in
+// advance so that connections sharing a limit take turns, and it returns 0
+uint64_t allowance(Worker &w, SocketState &s, uint64_t want) {
+  if (!w.limited) {
+    return want;
+  }
+  uint64_t now = monotonic_ns();
+  if (s.prepaid_bytes > 0) {
+    if (now < s.bytes_paid_at) {
+      wait_tokens(s, s.bytes_paid_at);
+      return 0;
+    }
+    return std::min(want, s.prepaid_bytes);
+  }
+  uint64_t min = std::min(want, MIN_GRANT);
+  uint64_t n = std::min(want, s.byte_tokens.available(now));
+  uint64_t wait = 0;
+  if (n < min) {
+    wait = s.byte_tokens.wait(now, min);
+    n = 0;
+  }
+  if (w.limiter->limited()) {
+    // with nothing allowed by the own limit, this only takes in advance
+    uint64_t shared_wait = 0;
+    n = w.limiter->allowance(s.client, now, min, n, &shared_wait);
+    wait = std::max(wait, shared_wait);
+  }
+  if (n > 0) {
+    return n;
+  }
+  s.byte_tokens.take(now, min);
+  s.prepaid_bytes = min;
+  s.bytes_paid_at = now + wait;
+  wait_tokens(s, s.bytes_paid_at);
+  return 0;
+}
+
+// count content bytes moved for the request in progress, and against the
+// limits of the connection
+void take_bytes(Worker &w, SocketState &s, uint64_t n) {
+  s.request_bytes += n;
+  if (!w.limited) {
+    return;
+  }
+  uint64_t prepaid = std::min(n, s.prepaid_bytes);
+  s.prepaid_bytes -= prepaid;
+  n -= prepaid;
+  if (n == 0) {
+    return;
+  }
+  uint64_t now = monotonic_ns();
+  s.byte_tokens.take(now, n);
+  if (w.limiter->limited()) {
+    w.limiter->take_bytes(s.client, now, n);
+  }
+}
+
+// take a token for the next request, or take it in advance like allowance()
+// and return false
+bool take_request(Worker &w, SocketState &s) {
+  if (!w.limited) {
+    return true;
+  }
+  uint64_t now = monotonic_ns();
+  if (s.prepaid_request) {
+    if (now < s.request_paid_at) {
+      wait_tokens(s, s.request_paid_at);
+      return false;
+    }
+    s.prepaid_request = false;
+    return true;
+  }
+  bool ok = s.request_tokens.available(now) >= 1;
+  uint64_t wait = s.request_tokens.wait(now, 1);
+  s.request_tokens.take(now, 1);
+  if (w.limiter->limited()) {
+    uint64_t shared_wait = 0;
+    ok = w.limiter->take_request(s.client, now, &shared_wait) && ok;
+    wait = std::max(wait, shared_wait);
+  }
+  if (!ok) {
+    s.prepaid_request = true;
+    s.request_paid_at = now + wait;
+    wait_tokens(s, s.request_paid_at);
+  }
+  return ok;
+}
+
+// set the pacing timer to fire at a time of CLOCK_MONOTONIC
+void arm_pace_timer(Worker &w, uint64_t at) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = at / 1000000000;
+  spec.it_value.tv_nsec = at % 1000000000;
+  if (timerfd_settime(w.pace_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    log_perror("timerfd_settime");
+  }
+  w.pace_armed = at;
+}
+
+// orders the heap of paced connections
+bool wakes_later(const Wakeup &a, const Wakeup &b) { return a.at > b.at; }
+
+// put a connection that ran out of tokens to sleep until pace_at
+void pace(Worker &w, SocketState &s) {
+  w.metrics.paced.add();
+  s.paced_at = s.pace_at;
+  w.paced.push_back(Wakeup{s.pace_at, s.key});
+  std::push_heap(w.paced.begin(), w.paced.end(), wakes_later);
+  if (w.pace_armed == 0 || s.pace_at < w.pace_armed) {
+    arm_pace_timer(w, s.pace_at);
+  }
+}
+
+// start or stop the ticks of the timer wheel
+void arm_tick_timer(Worker &w, bool on) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (on) {
+    spec.it_value.tv_nsec = TICK_NS;
+    spec.it_interval.tv_nsec = TICK_NS;
+  }
+  if (timerfd_settime(w.tick_timer_fd, 0, &spec, NULL) < 0) {
+    log_perror("timerfd_settime");
+  }
+}
+
+// make sure the timer of a connection expires by its deadline
+void schedule_timeout(Worker &w, SocketState &s) {
+  if (s.deadline == 0 ||
+      (s.timer_tick != 0 && s.timer_tick * w.wheel.tick_ns() <= s.deadline)) {
+    // the timer expiring first finds out whether the deadline has passed
+    return;
+  }
+  if (w.wheel.size() == 0) {
+    arm_tick_timer(w, true);
+  }
+  s.timer_tick = w.wheel.add(s.key, s.deadline);
+}
+
+// what a connection times out on while it waits in its state
+Timeout timeout_of(const SocketState &s) {
+  switch (s.state) {
+  case State::Handshake:
+    // bounded like a header, it can't be dragged out either
+    return Timeout::HeaderTimeout;
+  case State::WaitForOpen:
+  case State::WaitForDisk:
+  case State::WaitForSync:
+    return Timeout::NoTimeout;
+  case State::WaitForRequest:
+    if (s.write_len > 0 || s.req_count > 0) {
+      // resps to send before the next request
+      return Timeout::IoTimeout;
+    } else if (s.recv.size() > s.parsed_len) {
+      return Timeout::HeaderTimeout;
+    }
+    return Timeout::IdleTimeout;
+  default:
+    return Timeout::IoTimeout;
+  }
+}
+
+// when a connection waiting from now on times out on timeout, 0 for never
+uint64_t deadline_after(const Worker &w, Timeout timeout) {
+  return w.timeouts[timeout] > 0 ? w.now + w.timeouts[timeout] : 0;
+}
+
+// move the deadline of a connection when it waits for something else, or
+// made progress. a header has to be complete by its deadline, or one byte at
+// a time would keep the connection forever
+void update_deadline(Worker &w, SocketState &s, bool progress,
+                     bool started) {
+  Timeout timeout = timeout_of(s);
+  if (timeout == s.timeout &&
+      !(timeout == Timeout::HeaderTimeout ? started : progress)) {
+    return;
+  }
+  s.timeout = timeout;
+  s.deadline = deadline_after(w, timeout);
+  if (s.deadline == 0) {
+    // the timer left in the wheel is ignored when it expires
+    s.timer_tick = 0;
+  }
+  schedule_timeout(w, s);
+}
+
+// io_uring user data: | kind (8 bits) | slot key (56 bits) |
+enum Completion {
+  PollReady,
+  FileOpened,
+  // the receive of a connection into its ring, or into its upload block
+  Received,
+  BodyReceived,
+  Sent,
+  // a download spliced from the file into the pipe, and from there into the
+  // socket
+  PipeFilled,
+  Spliced,
+  // keyed by the disk job in ring_writes
+  Written,
+  Ignored
+};
+
+uint64_t make_user_data(Completion kind, uint64_t key) {
+  return ((uint64_t)kind << 56) | key;
+}
+
+// socket reads and writes of a client go through io_uring with it, except
+// the ones openssl makes
+bool recv_on_ring(const Worker &w, const SocketState &s) {
+  return w.backend == Backend::IoUring && !s.tls_recv;
+}
+
+bool send_on_ring(const Worker &w, const SocketState &s) {
+  return w.backend == Backend::IoUring && !s.tls_send;
+}
+
+// io_uring: receive at most len bytes into buffer, completing as kind
+void start_recv(Worker &w, SocketState &s, Completion kind, uint8_t *buffer,
+                size_t len) {
+  w.ring.prep_recv(s.fd, buffer, len, make_user_data(kind, s.key));
+  s.ring_ops++;
+  s.recv_busy = true;
+  s.recv_len = len;
+  // the receive waits for data itself, readiness seen from now on is new
+  s.can_read = false;
+}
+
+// io_uring: send the pieces of iov, completing as Sent
+void start_send(Worker &w, SocketState &s, const struct iovec *iov,
+                int iovcnt, int flags) {
+  memcpy(s.send_iov, iov, iovcnt * sizeof(*iov));
+  memset(&s.send_msg, 0, sizeof(s.send_msg));
+  s.send_msg.msg_iov = s.send_iov;
+  s.send_msg.msg_iovlen = iovcnt;
+  w.ring.prep_sendmsg(s.fd, &s.send_msg, flags, make_user_data(Sent, s.key));
+  s.ring_ops++;
+  s.send_busy = true;
+}
+
+// read from the socket of a client, through openssl when the kernel doesn't
+// decrypt for it
+ssize_t socket_read(SocketState &s, void *buffer, size_t len) {
+  if (s.tls_recv) {
+    return tls_read(s.ssl, buffer, len);
+  }
+  return read(s.fd, buffer, len);
+}
+
+// write to the socket of a client, through openssl when the kernel doesn't
+// encrypt for it. more is MSG_MORE, which user space tls does without
+ssize_t socket_write(SocketState &s, const void *buffer, size_t len,
+                     bool more) {
+  if (!s.tls_send) {
+    return send(s.fd, buffer, len, more ? MSG_MORE : 0);
+  }
+  ssize_t res = tls_write(s.ssl, buffer, len);
+  if (res < 0 && errno == EAGAIN) {
+    s.tls_retry = std::min(len, TLS_MAX_RECORD);
+  } else {
+    s.tls_retry = 0;
+  }
+  return res;
+}
+
+// write buffer through openssl, which takes a record per call, until the
+// socket is full. returns the bytes written, -1 if none were
+ssize_t tls_write_some(SocketState &s, const uint8_t *buffer, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t res = socket_write(s, &buffer[written], len - written, false);
+    if (res < 0) {
+      if (written > 0 && errno == EAGAIN) {
+        break;
+      }
+      return res;
+    }
+    written += res;
+  }
+  return written;
+}
+
+// write to a unix socket with fd attached to the first byte, which the
+// client receives along with it
+ssize_t send_with_fd(int sock, const void *buffer, size_t len, int fd) {
+  struct iovec iov;
+  iov.iov_base = (void *)buffer;
+  iov.iov_len = len;
+  char control[CMSG_SPACE(sizeof(fd))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+  return sendmsg(sock, &msg, 0);
+}
+
+// writev() to the socket of a client. openssl gets the pieces copied
+// together, so that small ones share a record
+ssize_t socket_writev(Worker &w, SocketState &s, const struct iovec *iov,
+                      int iovcnt) {
+  if (!s.tls_send) {
+    return writev(s.fd, iov, iovcnt);
+  }
+  size_t len = 0;
+  for (int i = 0; i < iovcnt && len < w.copy_buffer.size(); i++) {
+    size_t copy = std::min(iov[i].iov_len, w.copy_buffer.size() - len);
+    memcpy(&w.copy_buffer[len], iov[i].iov_base, copy);
+    len += copy;
+  }
+  return tls_write_some(s, w.copy_buffer.data(), len);
+}
+
+// read as much as the receive ring can hold, returns the result of read(),
+// or -1 with EINPROGRESS when io_uring receives it
+ssize_t fill_recv(Worker &w, SocketState &s) {
+  if (!s.recv.attached()) {
+    s.recv.attach(w.buffers.get(), w.buffers.buffer_size());
+  }
+  if (recv_on_ring(w, s)) {
+    size_t seg_len;
+    uint8_t *seg = s.recv.start_fill(&seg_len);
+    start_recv(w, s, Completion::Received, seg, seg_len);
+    errno = EINPROGRESS;
+    return -1;
+  }
+  ssize_t res;
+  if (s.tls_recv) {
+    // what openssl decrypted beyond this stays there, and is read next
+    size_t seg_len;
+    uint8_t *seg = s.recv.back(&seg_len);
+    res = tls_read(s.ssl, seg, seg_len);
+    if (res > 0) {
+      s.recv.produce(res);
+    }
+  } else {
+    res = s.recv.fill(s.fd);
+  }
+  if (res > 0) {
+    w.metrics.received_bytes.add(res);
+  }
+  if (s.recv.size() == 0) {
+    // nothing buffered, keep idle connections cheap
+    w.buffers.put(s.recv.detach());
+  }
+  return res;
+}
+
+// consume bytes of the receive ring, giving its buffer back when empty and
+// not being received into
+void consume_recv(Worker &w, SocketState &s, size_t len) {
+  s.recv.consume(len);
+  if (s.recv.size() == 0 && !s.recv_busy) {
+    w.buffers.put(s.recv.detach());
+  }
+}
+
+// append a resp header to write_buffer
+void append_resp(SocketState &s, const uint8_t *data, int len) {
+  memcpy(&s.write_buffer[s.write_len], data, len);
+  s.write_len += len;
+}
+
+// append a download resp header in the framing of the request in progress,
+// status is 0x02, or 0x04 for a compressed body
+void append_download_resp(SocketState &s, uint8_t status, uint64_t size) {
+  uint8_t resp[MAX_RESP_LEN];
+  int len = 0;
+  resp[len++] = status;
+  if (s.version == 1) {
+    // length in big endian
+    resp[len++] = size >> 24;
+    resp[len++] = size >> 16;
+    resp[len++] = size >> 8;
+    resp[len++] = size;
+  } else {
+    len += put_varint(&resp[len], size);
+  }
+  append_resp(s, resp, len);
+}
+
+// append the crc of the request in progress to write_buffer
+void append_crc(SocketState &s) {
+  uint8_t resp[4];
+  put_u32_be(resp, s.crc);
+  append_resp(s, resp, sizeof(resp));
+}
+
+// send pending resp headers, more tells the kernel a file follows
+//
+// returns true when write_buffer is empty, false when blocked or on error
+bool flush_resp(Worker &w, SocketState &s, bool more, bool &error) {
+  while (s.buffer_written < s.write_len) {
+    if (s.send_busy || !s.can_write) {
+      return false;
+    }
+    ssize_t written;
+    if (s.pass_fd >= 0 && s.buffer_written == s.pass_at) {
+      // a partial write has passed the file already
+      written = send_with_fd(s.fd, &s.write_buffer[s.buffer_written],
+                             s.write_len - s.buffer_written, s.pass_fd);
+      if (written > 0) {
+        s.pass_fd = -1;
+      }
+    } else {
+      // up to the resp the file goes with
+      int end = s.pass_fd >= 0 ? s.pass_at : s.write_len;
+      if (send_on_ring(w, s)) {
+        // the rest goes when the send is done
+        struct iovec iov;
+        iov.iov_base = &s.write_buffer[s.buffer_written];
+        iov.iov_len = end - s.buffer_written;
+        start_send(w, s, &iov, 1, more ? MSG_MORE : 0);
+        return false;
+      }
+      written = socket_write(s, &s.write_buffer[s.buffer_written],
+                             end - s.buffer_written, more);
+    }
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        w.metrics.write_eagain.add();
+        s.can_write = false;
+        return false;
+      }
+      log_perror("write");
+      error = true;
+      return false;
+    }
+    w.metrics.sent_bytes.add(written);
+    s.buffer_written += written;
+  }
+  s.write_len = 0;
+  s.buffer_written = 0;
+  return true;
+}
+
+// write all of buffer to fd, returns false on error
+bool write_all(int fd, const uint8_t *buffer, size_t len) {
+  size_t write_len = 0;
+  while (write_len < len) {
+    ssize_t res = write(fd, &buffer[write_len], len - write_len);
+    if (res < 0) {
+      log_perror("write");
+      return false;
+    }
+    write_len += res;
+  }
+  return true;
+}
+
+void close_file(Worker &w, int fd);
+
+// close the file of the upload in progress, or leave it to the last job of
+// the disk pool still running on it
+void drop_upload_file(Worker &w, SocketState &s) {
+  if (s.disk_pending > 0) {
+    w.orphan_files[s.file_fd] = s.disk_pending;
+  } else {
+    close_file(w, s.file_fd);
+  }
+  s.file_fd = -1;
+}
+
+// upload blocks are written by the disk pool or io_uring, rather than by the
+// event loop as they fill up
+bool write_behind(const Worker &w) {
+  return w.backend == Backend::IoUring || w.disk->enabled();
+}
+
+// io_uring: write the block of job, which finishes as Written
+void ring_write(Worker &w, DiskJob &&job) {
+  uint64_t key = w.ring_writes.alloc();
+  DiskJob &ring_job = *w.ring_writes.lookup(key);
+  ring_job = std::move(job);
+  w.ring.prep_write(ring_job.fd, ring_job.buffer, ring_job.len, ring_job.off,
+                    make_user_data(Written, key));
+}
+
+// write the staged upload body to the file, returns false on write error.
+// written behind, the block goes to the disk pool or io_uring and the body
+// goes on in a new one
+bool flush_block(Worker &w, SocketState &s) {
+  if (s.block_len > 0 && write_behind(w)) {
+    DiskJob job;
+    job.op = DiskJob::Write;
+    job.key = s.key;
+    job.done = &w.disk_done;
+    job.fd = s.file_fd;
+    job.buffer = s.block;
+    job.len = s.block_len;
+    job.off = s.write_off;
+    if (w.backend == Backend::IoUring) {
+      ring_write(w, std::move(job));
+    } else {
+      w.disk->submit(std::move(job));
+    }
+    s.write_off += s.block_len;
+    s.disk_pending++;
+    s.block = w.blocks.get();
+    s.block_len = 0;
+    return true;
+  }
+  bool ok = write_all(s.file_fd, s.block, s.block_len);
+  s.block_len = 0;
+  return ok;
+}
+
+// add a piece of decompressed upload body to the crc and the hash when
+// needed
+void digest_output(SocketState &s, const uint8_t *data, size_t len) {
+  if (s.checksum) {
+    s.crc = crc32c(s.crc, data, len);
+  }
+  if (s.hasher != NULL) {
+    s.hasher->update(data, len);
+  }
+}
+
+// write a piece of decompressed upload body to the file, adding it to the
+// crc and the hash when needed. the body is staged in a block, so that the
+// file gets large writes at aligned offsets. returns false on write error
+bool write_output(Worker &w, SocketState &s, const uint8_t *data,
+                  size_t len) {
+  digest_output(s, data, len);
+  if (s.block_len == 0 && len >= UPLOAD_BLOCK_LEN && !write_behind(w)) {
+    // whole blocks don't need to be staged
+    size_t direct = len - len % UPLOAD_BLOCK_LEN;
+    if (!write_all(s.file_fd, data, direct)) {
+      return false;
+    }
+    data += direct;
+    len -= direct;
+  }
+  while (len > 0) {
+    size_t copy = std::min(len, UPLOAD_BLOCK_LEN - s.block_len);
+    memcpy(&s.block[s.block_len], data, copy);
+    s.block_len += copy;
+    data += copy;
+    len -= copy;
+    if (s.block_len == UPLOAD_BLOCK_LEN && !flush_block(w, s)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// write a piece of upload body to the file, decompressing it if needed, or
+// discard it when the file is not open. returns false on write error
+bool write_body(Worker &w, SocketState &s, const uint8_t *data, size_t len) {
+  if (s.file_fd < 0) {
+    return true;
+  } else if (s.inflater == NULL) {
+    return write_output(w, s, data, len);
+  }
+  if (!s.inflater->write(data, len,
+                         [&w, &s](const uint8_t *out, size_t out_len) {
+                           return write_output(w, s, out, out_len);
+                         })) {
+    // the rest of the body is thrown away, and the upload fails
+    log_error("unable to decompress upload: %s\n", s.file_name);
+    drop_upload_file(w, s);
+  }
+  return true;
+}
+
+// copy at most len bytes of upload body from the socket to the file, or
+// discard them when the file is not open. io_uring receives the body into
+// the block when it goes to the file as it is, otherwise into the receive
+// ring, which is written from there
+//
+// returns bytes consumed from the socket, 0 on EOF or -1 on error, with
+// EINPROGRESS when io_uring receives them
+ssize_t copy_body(Worker &w, SocketState &s, size_t len) {
+  if (recv_on_ring(w, s)) {
+    if (s.file_fd >= 0 && s.inflater == NULL) {
+      start_recv(w, s, Completion::BodyReceived, &s.block[s.block_len],
+                 std::min(len, UPLOAD_BLOCK_LEN - s.block_len));
+    } else {
+      if (!s.recv.attached()) {
+        s.recv.attach(w.buffers.get(), w.buffers.buffer_size());
+      }
+      size_t seg_len;
+      uint8_t *seg = s.recv.start_fill(&seg_len);
+      start_recv(w, s, Completion::Received, seg, std::min(len, seg_len));
+    }
+    errno = EINPROGRESS;
+    return -1;
+  }
+  if (w.disk->enabled() && s.file_fd >= 0 && s.inflater == NULL) {
+    // straight into the block the disk pool writes from
+    uint8_t *data = &s.block[s.block_len];
+    ssize_t res =
+        socket_read(s, data, std::min(len, UPLOAD_BLOCK_LEN - s.block_len));
+    if (res > 0) {
+      digest_output(s, data, res);
+      s.block_len += res;
+      if (s.block_len == UPLOAD_BLOCK_LEN) {
+        flush_block(w, s);
+      }
+    }
+    return res;
+  }
+  ssize_t res = socket_read(s, w.copy_buffer.data(),
+                            std::min(len, w.copy_buffer.size()));
+  if (res <= 0) {
+    return res;
+  }
+  if (!write_body(w, s, w.copy_buffer.data(), res)) {
+    errno = EIO;
+    return -1;
+  }
+  return res;
+}
+
+// add what sendfile sent of the download in progress to its crc on the disk
+// pool, read back from the page cache. one job at a time keeps them in order
+void checksum_sent(Worker &w, SocketState &s) {
+  if (s.crc_busy || s.crc_off == s.file_off) {
+    return;
+  }
+  DiskJob job;
+  job.op = DiskJob::Checksum;
+  job.key = s.key;
+  job.done = &w.disk_done;
+  job.fd = s.send_fd;
+  job.off = s.crc_off;
+  job.len = s.file_off - s.crc_off;
+  job.crc = s.crc;
+  // the fd stays open when the connection is closed first
+  w.files.hold(s.file);
+  job.entry = s.file;
+  w.disk->submit(std::move(job));
+  s.crc_busy = true;
+}
+
+// throw away len bytes left in the worker's pipe
+void discard_pipe(Worker &w, size_t len) {
+  while (len > 0) {
+    ssize_t res = read(w.pipe_fds[0], w.copy_buffer.data(),
+                       std::min(len, w.copy_buffer.size()));
+    if (res <= 0) {
+      // data would leak into the next upload
+      log_perror("read from pipe");
+      abort();
+    }
+    len -= res;
+  }
+}
+
+// move at most len bytes of upload body from the socket to the file through
+// the worker's pipe, without copying them to user space
+//
+// returns bytes consumed from the socket, 0 on EOF or -1 on error
+ssize_t splice_body(Worker &w, SocketState &s, size_t len) {
+  ssize_t res = splice(s.fd, NULL, w.pipe_fds[1], NULL,
+                       std::min(len, w.pipe_size),
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (res < 0 && errno == EINVAL) {
+    // socket can't be spliced
+    s.splice_body = false;
+    return copy_body(w, s, len);
+  }
+  if (res <= 0) {
+    return res;
+  }
+  w.metrics.splice_bytes.record(res);
+
+  // drain the pipe into the file
+  size_t in_pipe = res;
+  while (in_pipe > 0) {
+    ssize_t res2;
+    if (s.splice_body) {
+      res2 =
+          splice(w.pipe_fds[0], NULL, s.file_fd, NULL, in_pipe, SPLICE_F_MOVE);
+      if (res2 < 0 && errno == EINVAL) {
+        // file system can't be spliced into, copy from now on
+        s.splice_body = false;
+        continue;
+      }
+      if (res2 < 0) {
+        log_perror("splice");
+      }
+    } else {
+      res2 = read(w.pipe_fds[0], w.copy_buffer.data(),
+                  std::min(in_pipe, w.copy_buffer.size()));
+      if (res2 > 0 && !write_all(s.file_fd, w.copy_buffer.data(), res2)) {
+        res2 = -1;
+      }
+    }
+    if (res2 <= 0) {
+      // the pipe is shared by all connections of the worker, so it must be
+      // empty before leaving
+      discard_pipe(w, in_pipe);
+      errno = EIO;
+      return -1;
+    }
+    in_pipe -= res2;
+  }
+  return res;
+}
+
+// add a new socket to the worker and start watching it for events
+SocketState *add_socket(Worker &w, int fd, SocketKind kind, uint32_t events) {
+  uint64_t key = w.state.alloc();
+  SocketState &ss = *w.state.lookup(key);
+  ss.fd = fd;
+  ss.kind = kind;
+  ss.key = key;
+  ss.parse_version = 1;
+  ss.state = State::WaitForRequest;
+  ss.state_since = metrics_now();
+  ss.file_fd = -1;
+  ss.pass_fd = -1;
+  ss.pipe.fds[0] = -1;
+
+  if (w.backend == Backend::IoUring) {
+    // multishot poll fires on every wakeup, the same as edge trigger
+    w.ring.prep_poll_multishot(fd, events & ~EPOLLET,
+                               make_user_data(PollReady, key));
+    return &ss;
+  }
+  struct epoll_event event;
+  event.data.u64 = key;
+  event.events = events;
+  if (epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    log_perror("epoll_ctl");
+    w.state.free(key);
+    return NULL;
+  }
+  return &ss;
+}
+
+// close a file, asynchronously when using io_uring
+void close_file(Worker &w, int fd) {
+  if (w.backend == Backend::IoUring) {
+    w.ring.prep_close(fd, make_user_data(Ignored, 0));
+  } else {
+    close(fd);
+  }
+}
+
+// give the block of the upload in progress back to the pool
+void release_block(Worker &w, SocketState &s) {
+  if (s.block != NULL) {
+    w.blocks.put(s.block);
+    s.block = NULL;
+  }
+}
+
+// give the chunk of the download in progress back to the pool, unless a read
+// still fills it, which gives it back when done
+void release_chunk(Worker &w, SocketState &s) {
+  if (s.chunk != NULL && !s.chunk_busy) {
+    w.blocks.put(s.chunk);
+  }
+  s.chunk = NULL;
+  s.chunk_len = 0;
+  s.chunk_sent = 0;
+}
+
+// give a connection a pipe to splice its download through, returns false on
+// error
+bool take_pipe(Worker &w, SocketState &s) {
+  if (!w.pipes.empty()) {
+    s.pipe = w.pipes.back();
+    w.pipes.pop_back();
+    return true;
+  }
+  if (pipe2(s.pipe.fds, O_CLOEXEC) < 0) {
+    log_perror("pipe");
+    s.pipe.fds[0] = -1;
+    return false;
+  }
+  // as large as the one for uploads, so that a turn fits
+  int size = fcntl(s.pipe.fds[1], F_SETPIPE_SZ, (int)w.pipe_size);
+  if (size < 0) {
+    size = fcntl(s.pipe.fds[1], F_GETPIPE_SZ);
+  }
+  s.pipe.size = size > 0 ? size : PAGE_LEN;
+  return true;
+}
+
+// give the pipe of a connection back to the worker when it is empty,
+// otherwise close it
+void put_pipe(Worker &w, SocketState &s) {
+  if (s.pipe.fds[0] < 0) {
+    return;
+  }
+  if (s.pipe_len == 0) {
+    w.pipes.push_back(s.pipe);
+  } else {
+    close_file(w, s.pipe.fds[0]);
+    close_file(w, s.pipe.fds[1]);
+  }
+  s.pipe.fds[0] = -1;
+  s.pipe_len = 0;
+}
+
+// structured access record of the request in progress, status is ok,
+// failed or aborted. the duration comes from the metrics clock, so it is 0
+// without metrics
+void log_access(Worker &w, SocketState &s, uint64_t now, const char *status) {
+  if (log_level < LOG_INFO) {
+    return;
+  }
+  // quoted, every byte escaped at worst
+  char name[4 * MAX_NAME_LEN + 3];
+  name[0] = 0;
+  Command command = s.current_command;
+  if (command == Command::Download || command == Command::Upload ||
+      command == Command::Have) {
+    log_quote(name, sizeof(name), s.file_name);
+  }
+  // coarse, as it is only printed in milliseconds
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  log_info("access time=%lld.%03ld worker=%d peer=%s command=%s%s%s "
+           "status=%s bytes=%llu duration_us=%llu\n",
+           (long long)ts.tv_sec, ts.tv_nsec / 1000000, w.id, s.peer,
+           COMMAND_NAMES[command], name[0] ? " name=" : "", name, status,
+           (unsigned long long)s.request_bytes,
+           (unsigned long long)(now - s.request_start) / 1000);
+}
+
+// free what is left of a closed connection: the buffers, the socket and the
+// slot
+void release_conn(Worker &w, SocketState &s) {
+  if (s.file != NULL) {
+    w.files.release(s.file);
+  }
+  release_block(w, s);
+  release_chunk(w, s);
+  if (s.recv.attached()) {
+    w.buffers.put(s.recv.detach());
+  }
+  put_pipe(w, s);
+  int fd = s.fd;
+  w.state.free(s.key);
+  close(fd);
+}
+
+// remove a connection and close its socket
+void close_conn(Worker &w, SocketState &s) {
+  if (w.backend == Backend::IoUring) {
+    w.ring.prep_poll_remove(make_user_data(PollReady, s.key),
+                            make_user_data(Ignored, 0));
+    if (s.ring_ops > 0) {
+      // the socket stays open until they are done, so that its fd isn't
+      // reused while they are
+      w.ring.prep_cancel_fd(s.fd, make_user_data(Ignored, 0));
+    }
+    if (s.state == State::WaitForOpen) {
+      // the pending open still points to file_name or dir_name
+      w.ring.submit(0);
+    }
+  }
+  if (s.file_fd >= 0) {
+    // closed in the middle of a transfer
+    drop_upload_file(w, s);
+  }
+  delete s.inflater;
+  delete s.hasher;
+  if (s.client != NULL) {
+    w.limiter->release(s.client);
+  }
+  if (s.in_request) {
+    log_access(w, s, metrics_now(), "aborted");
+  }
+  SSL_free(s.ssl);
+  if (s.kind == SocketKind::Client) {
+    w.connections->fetch_sub(1);
+    w.metrics.closed.add();
+  }
+  if (s.ring_ops > 0) {
+    // released when the last one completes, nothing else finds it
+    uint64_t key = s.key;
+    s.key = w.state.rekey(key);
+    w.closing[key] = s.key;
+    return;
+  }
+  release_conn(w, s);
+}
+
+// the request in progress is answered, count how long it took
+void finish_request(Worker &w, SocketState &s, uint64_t now) {
+  if (s.in_request) {
+    w.metrics.request_time[s.current_command].record(now - s.request_start);
+    s.in_request = false;
+    log_access(w, s, now, s.request_failed ? "failed" : "ok");
+  }
+}
+
+// move the request in progress to state, counting the time spent in the one
+// it leaves
+void set_state(Worker &w, SocketState &s, State state) {
+  if (state == s.state) {
+    return;
+  }
+  uint64_t now;
+  if (s.state == State::WaitForRequest) {
+    // only start_request() leaves it, and has read the clock just now, so
+    // the time since goes to the first state of the request
+    now = s.state_since;
+  } else {
+    now = metrics_now();
+    w.metrics.state_time[s.state].record(now - s.state_since);
+  }
+  s.state = state;
+  s.state_since = now;
+  if (state == State::WaitForRequest) {
+    finish_request(w, s, now);
+  }
+}
+
+// move on after the download in progress is done or failed
+void download_done(Worker &w, SocketState &s) {
+  if (!s.in_batch) {
+    set_state(w, s, State::WaitForRequest);
+  } else if (s.batch_remaining > 0) {
+    set_state(w, s, State::WaitForName);
+  } else {
+    // last file of the batch, send what is held back
+    s.in_batch = false;
+    if (!s.local) {
+      tcp_cork(s.fd, false);
+    }
+    set_state(w, s, State::WaitForRequest);
+  }
+}
+
+// get the crc of the download in progress ready: known already for the whole
+// file, computed at once when the content is in memory, or while sending
+void start_checksum(SocketState &s, uint64_t size) {
+  bool whole = s.range_off == 0 && size == (uint64_t)s.file->st.st_size;
+  s.crc_streaming = false;
+  if (whole && s.file->has_crc) {
+    s.crc = s.file->crc;
+  } else if (s.file->data != NULL) {
+    s.crc = crc32c(0, &s.file->data[s.range_off], size);
+  } else {
+    s.crc = 0;
+    s.crc_streaming = true;
+    s.crc_off = s.range_off;
+    return;
+  }
+  if (whole) {
+    s.file->crc = s.crc;
+    s.file->has_crc = true;
+  }
+  if (s.state == State::SendData) {
+    // sent in the same writev as the content
+    put_u32_be(s.trailer, s.crc);
+    s.trailer_len = sizeof(s.trailer);
+    s.trailer_written = 0;
+  }
+}
+
+// make a compressed copy of a file on the disk pool, for the compressed
+// downloads after it is done
+void compress_file(Worker &w, FileCache::Entry *entry) {
+  if (!w.files.start_compress(entry)) {
+    return;
+  }
+  DiskJob job;
+  job.op = DiskJob::Compress;
+  job.done = &w.disk_done;
+  job.fd = entry->fd;
+  job.len = entry->st.st_size;
+  job.entry = entry;
+  w.disk->submit(std::move(job));
+}
+
+// start sending the file of the current download, s.file is NULL if it
+// couldn't be opened
+void start_download(Worker &w, SocketState &s) {
+  if (s.file != NULL && s.range_off > (uint64_t)s.file->st.st_size) {
+    log_error("range starts beyond the end of file: %s\n", s.file_name);
+  } else if (s.file != NULL && s.compressed && !s.pass_file &&
+             s.range_off == 0 && s.range_len == 0 && s.file->zfd >= 0) {
+    // the whole file, compressed, its crc was computed while compressing
+    s.send_fd = s.file->zfd;
+    s.file_off = 0;
+    s.file_remaining = s.file->zsize;
+    s.crc = s.file->crc;
+    s.crc_streaming = false;
+    append_download_resp(s, 0x04, s.file_remaining);
+    set_state(w, s, State::SendResp);
+    return;
+  } else if (s.file != NULL) {
+    if (s.compressed && !s.pass_file && s.range_off == 0 &&
+        s.range_len == 0) {
+      // the copy is made for the downloads after this one
+      compress_file(w, s.file);
+    }
+    // the range is cut at the end of file
+    uint64_t size = s.file->st.st_size - s.range_off;
+    if (s.range_len > 0 && s.range_len < size) {
+      size = s.range_len;
+    }
+
+    // 4GiB handling, only v1 has 32-bit lengths
+    if (s.version > 1 || size <= 0xFFFFFFFF) {
+      s.send_fd = s.file->fd;
+      s.file_off = s.range_off;
+      s.file_remaining = size;
+      if (s.file->data != NULL) {
+        // small enough to be in memory, sent together with the resp
+        append_download_resp(s, 0x02, size);
+        set_state(w, s, State::SendData);
+        if (s.checksum) {
+          start_checksum(s, size);
+        }
+        return;
+      }
+      if (s.checksum) {
+        start_checksum(s, size);
+      }
+      if (s.pass_file && !(s.checksum && s.crc_streaming)) {
+        // the client reads the file itself, the resp passes it and only the
+        // crc follows. the content counts as sent, but takes no tokens
+        s.pass_fd = s.send_fd;
+        s.pass_at = s.write_len;
+        s.file_remaining = 0;
+        s.request_bytes += size;
+        w.metrics.passed_files.add();
+        append_download_resp(s, 0x05, size);
+      } else {
+        append_download_resp(s, 0x02, size);
+      }
+      set_state(w, s, State::SendResp);
+      return;
+    }
+  } else {
+    log_error("unable to open file: %s\n", s.file_name);
+  }
+  if (s.file != NULL) {
+    w.files.release(s.file);
+    s.file = NULL;
+  }
+
+  // error handling
+  // error resp
+  uint8_t resp = 0x00;
+  append_resp(s, &resp, 1);
+  w.metrics.failed.add();
+  s.request_failed = true;
+  download_done(w, s);
+}
+
+// read the content of a file just cached into memory on the disk pool if it
+// is small enough, the downloads until then send it from the file
+void load_file(Worker &w, FileCache::Entry *entry) {
+  uint8_t *data = w.files.start_load(entry);
+  if (data == NULL) {
+    return;
+  }
+  DiskJob job;
+  job.op = DiskJob::Read;
+  job.done = &w.disk_done;
+  job.fd = entry->fd;
+  job.buffer = data;
+  job.len = entry->st.st_size;
+  job.off = 0;
+  job.entry = entry;
+  job.download = false;
+  w.disk->submit(std::move(job));
+}
+
+// stat a file just opened for the current download and watch it for the
+// cache, on the disk pool. path must outlive the job
+void stat_file(Worker &w, SocketState &s, const char *path, int fd) {
+  DiskJob job;
+  job.op = DiskJob::Stat;
+  job.key = s.key;
+  job.done = &w.disk_done;
+  job.path = path;
+  job.fd = fd;
+  job.files = &w.files;
+  job.wd = -1;
+  job.epoch = w.files.unwatched();
+  w.disk->submit(std::move(job));
+  set_state(w, s, State::WaitForOpen);
+}
+
+// continue the current request after its file is opened, fd < 0 on error.
+// job is the Open or Stat job that stat'ed a file opened for reading, NULL if
+// it isn't stat'ed yet
+void file_opened(Worker &w, SocketState &s, int fd, const DiskJob *job) {
+  if (s.current_command == Command::Upload) {
+    if (fd < 0) {
+      log_error("unable to open file: %s\n", s.file_name);
+
+      // error handling: the body is still read and thrown away
+      s.file_fd = -1;
+    } else if (s.inflater == NULL && s.body_len > 0 &&
+               fallocate(fd, 0, 0, s.body_len) < 0 && errno == ENOSPC) {
+      // the size is known unless compressed, so preallocating it keeps the
+      // file in few extents, and a full disk fails the upload before the
+      // body is received. file systems without fallocate are fine
+      log_error("no space for upload: %s\n", s.file_name);
+      close_file(w, fd);
+      s.file_fd = -1;
+    } else {
+      s.file_fd = fd;
+      s.splice_body = true;
+      s.block = w.blocks.get();
+      s.block_len = 0;
+      s.write_off = 0;
+    }
+    set_state(w, s, State::WaitForBody);
+    return;
+  }
+
+  if (fd >= 0 && job == NULL) {
+    stat_file(w, s, s.file_name, fd);
+    return;
+  }
+  // keep the file open for later downloads
+  s.file = fd >= 0 ? w.files.insert(s.file_name, fd, job->st, job->wd,
+                                    job->epoch)
+                   : NULL;
+  if (s.file != NULL) {
+    load_file(w, s.file);
+  }
+  start_download(w, s);
+}
+
+// open a file for the current request, asynchronously when using io_uring,
+// so path must outlive the open, e.g. by being part of s, or the disk pool
+void open_file(Worker &w, SocketState &s, const char *path, int flags,
+               mode_t mode) {
+  if (w.backend == Backend::IoUring) {
+    w.ring.prep_openat(path, flags, mode, make_user_data(FileOpened, s.key));
+    set_state(w, s, State::WaitForOpen);
+  } else if (w.disk->enabled()) {
+    DiskJob job;
+    job.op = DiskJob::Open;
+    job.key = s.key;
+    job.done = &w.disk_done;
+    job.path = path;
+    job.flags = flags;
+    job.mode = mode;
+    job.files = &w.files;
+    job.wd = -1;
+    job.epoch = w.files.unwatched();
+    w.disk->submit(std::move(job));
+    set_state(w, s, State::WaitForOpen);
+  } else {
+    file_opened(w, s, open(path, flags, mode), NULL);
+  }
+}
+
+// the directory part of a file name, "." if there is none
+void parent_dir(const char *name, char *dir) {
+  const char *slash = strrchr(name, '/');
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else if (slash == name) {
+    strcpy(dir, "/");
+  } else {
+    memcpy(dir, name, slash - name);
+    dir[slash - name] = 0;
+  }
+}
+
+// the job giving the complete body of the upload in progress its name,
+// replacing the file that had it: stored under its hash when deduplicating,
+// otherwise through a unique temporary name
+DiskJob publish_job(Worker &w, SocketState &s) {
+  DiskJob job;
+  job.op = DiskJob::Publish;
+  job.key = s.key;
+  job.done = &w.disk_done;
+  job.path = s.file_name;
+  job.fd = s.file_fd;
+  job.store = NULL;
+  job.durable = false;
+  if (s.hasher != NULL) {
+    job.store = &w.store;
+    s.hasher->final(job.digest);
+  } else {
+    char temp_name[MAX_NAME_LEN + 64];
+    snprintf(temp_name, sizeof(temp_name), "%s.%d-%d-%llu.tmp", s.file_name,
+             (int)getpid(), w.id, (unsigned long long)++w.temp_seq);
+    job.temp = temp_name;
+  }
+  return job;
+}
+
+// give the complete body of the upload in progress its name on the disk
+// pool, which answers it when done. with fdatasync durability the content
+// is synced before and the name after
+void start_publish(Worker &w, SocketState &s) {
+  DiskJob job = publish_job(w, s);
+  if (w.durability == Durability::SyncFile) {
+    job.durable = true;
+    job.dir = s.dir_name;
+  }
+  w.disk->submit(std::move(job));
+  s.disk_pending++;
+  set_state(w, s, State::WaitForSync);
+}
+
+// answer the upload in progress and move on to the next request
+void upload_done(Worker &w, SocketState &s, bool ok) {
+  // upload resp, or error resp
+  uint8_t resp = ok ? 0x01 : 0x00;
+  append_resp(s, &resp, 1);
+  if (ok && s.checksum) {
+    append_crc(s);
+  } else if (!ok) {
+    w.metrics.failed.add();
+    s.request_failed = true;
+  }
+  delete s.hasher;
+  s.hasher = NULL;
+  set_state(w, s, State::WaitForRequest);
+}
+
+enum ParseResult { ParseOk, ParseIncomplete, ParseInvalid };
+
+// parse a v1 request starting at offset off of the receive ring
+ParseResult parse_request_v1(const RecvRing &recv, size_t off, Request &req) {
+  size_t avail = recv.size() - off;
+  uint8_t command = recv.at(off);
+  if (command == 0x00) {
+    req.command = Command::Download;
+    req.header_len = 1 + MAX_NAME_LEN;
+  } else if (command == 0x01) {
+    req.command = Command::Upload;
+    req.header_len = 1 + MAX_NAME_LEN + 4;
+  } else if (command == 0x02) {
+    // ranged download
+    req.command = Command::Download;
+    req.header_len = 1 + MAX_NAME_LEN + 16;
+  } else {
+    return ParseInvalid;
+  }
+  if (avail < req.header_len) {
+    return ParseIncomplete;
+  }
+
+  // name is zero padded to 256 bytes
+  req.name_off = 1;
+  req.name_len = MAX_NAME_LEN;
+  if (req.command == Command::Upload) {
+    uint32_t body_len;
+    recv.peek(off + 1 + MAX_NAME_LEN, &body_len, sizeof(body_len));
+    req.body_len = ntohl(body_len);
+  } else if (command == 0x02) {
+    uint64_t range[2];
+    recv.peek(off + 1 + MAX_NAME_LEN, range, sizeof(range));
+    req.range_off = be64toh(range[0]);
+    req.range_len = be64toh(range[1]);
+  } else {
+    // the whole file
+    req.range_off = 0;
+    req.range_len = 0;
+  }
+  return ParseOk;
+}
+
+// parse a varint at offset off of the receive ring and move off past it
+ParseResult parse_varint(const RecvRing &recv, size_t &off, uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (off >= recv.size()) {
+      return ParseIncomplete;
+    }
+    uint8_t byte = recv.at(off++);
+    value |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return ParseOk;
+    }
+  }
+  // longer than 10 bytes
+  return ParseInvalid;
+}
+
+// parse a v2 request starting at offset off of the receive ring
+ParseResult parse_request_v2(const RecvRing &recv, size_t off, Request &req) {
+  size_t start = off;
+  uint8_t command = recv.at(off++);
+  if (command == 0xF1) {
+    // | 0xF1 | CODECS |
+    if (off >= recv.size()) {
+      return ParseIncomplete;
+    }
+    req.command = Command::Codecs;
+    req.codecs = recv.at(off++);
+    req.header_len = off - start;
+    req.name_off = 0;
+    req.name_len = 0;
+    return ParseOk;
+  } else if (command == 0x00 || command == 0x02) {
+    req.command = Command::Download;
+  } else if (command == 0x01) {
+    req.command = Command::Upload;
+  } else if (command == 0x03) {
+    req.command = Command::Batch;
+  } else if (command == 0x04) {
+    req.command = Command::Have;
+  } else {
+    return ParseInvalid;
+  }
+
+  if (off >= recv.size()) {
+    return ParseIncomplete;
+  }
+  req.flags = recv.at(off++);
+  if (req.flags & ~(FLAG_COMPRESSED | FLAG_CHECKSUM | FLAG_PASS_FILE)) {
+    // unknown flags
+    return ParseInvalid;
+  }
+
+  req.name_off = 0;
+  req.name_len = 0;
+  if (command == 0x03) {
+    // names follow the header, they are taken one by one
+    ParseResult res = parse_varint(recv, off, req.batch_count);
+    req.header_len = off - start;
+    return res;
+  }
+
+  uint64_t name_len;
+  ParseResult res = parse_varint(recv, off, name_len);
+  if (res != ParseOk) {
+    return res;
+  }
+  if (name_len > MAX_NAME_LEN) {
+    return ParseInvalid;
+  }
+  req.name_off = off - start;
+  req.name_len = name_len;
+  off += name_len;
+  if (off > recv.size()) {
+    return ParseIncomplete;
+  }
+
+  req.range_off = 0;
+  req.range_len = 0;
+  if (command == 0x01) {
+    res = parse_varint(recv, off, req.body_len);
+  } else if (command == 0x02) {
+    res = parse_varint(recv, off, req.range_off);
+    if (res == ParseOk) {
+      res = parse_varint(recv, off, req.range_len);
+    }
+  } else if (command == 0x04) {
+    req.digest_off = off - start;
+    off += SHA256_LEN;
+    if (off > recv.size()) {
+      return ParseIncomplete;
+    }
+  }
+  req.header_len = off - start;
+  return res;
+}
+
+// parse one request starting at offset off of the receive ring, version is
+// the protocol version it is framed with and gets updated by hellos
+ParseResult parse_request(const RecvRing &recv, size_t off, uint8_t &version,
+                          Request &req) {
+  size_t avail = recv.size() - off;
+  if (avail < 1) {
+    return ParseIncomplete;
+  }
+  req.version = version;
+  req.flags = 0;
+  if (recv.at(off) == 0xF0) {
+    // hello, the same in every version
+    if (avail < 2) {
+      return ParseIncomplete;
+    }
+    uint8_t wanted = recv.at(off + 1);
+    if (wanted == 0) {
+      return ParseInvalid;
+    }
+    req.command = Command::Hello;
+    req.header_len = 2;
+    req.name_off = 0;
+    req.name_len = 0;
+    // agree on the newest version both sides know, requests after the hello
+    // use it
+    version = std::min(wanted, MAX_VERSION);
+    req.version = version;
+    return ParseOk;
+  }
+  return version == 1 ? parse_request_v1(recv, off, req)
+                      : parse_request_v2(recv, off, req);
+}
+
+// queue every complete request in the receive ring, returns the number of
+// requests parsed or -1 on invalid data
+int parse_requests(SocketState &s) {
+  int parsed = 0;
+  while (s.req_count < MAX_PIPELINE && !s.upload_pending &&
+         !s.batch_pending) {
+    Request &req = s.requests[(s.req_head + s.req_count) % MAX_PIPELINE];
+    ParseResult res =
+        parse_request(s.recv, s.parsed_len, s.parse_version, req);
+    if (res == ParseIncomplete) {
+      break;
+    } else if (res == ParseInvalid) {
+      return -1;
+    }
+    s.req_count++;
+    s.parsed_len += req.header_len;
+    if (req.command == Command::Upload) {
+      s.upload_pending = true;
+    } else if (req.command == Command::Batch && req.batch_count > 0) {
+      s.batch_pending = true;
+    }
+    parsed++;
+  }
+  return parsed;
+}
+
+// start the download of the current file name, of the whole file unless a
+// range is set
+void start_file(Worker &w, SocketState &s) {
+  log_debug("user wants to download: %s\n", s.file_name);
+  s.file = w.files.lookup(s.file_name);
+  if (s.file != NULL) {
+    start_download(w, s);
+  } else {
+    open_file(w, s, s.file_name, O_RDONLY, 0);
+  }
+}
+
+// take the next name of the batch in progress from recv and start its
+// download, returns true on progress
+bool next_batch_name(Worker &w, SocketState &s, bool &error) {
+  // | NAME_LEN | NAME |
+  size_t off = 0;
+  uint64_t name_len;
+  ParseResult res = parse_varint(s.recv, off, name_len);
+  if (res == ParseOk && name_len > MAX_NAME_LEN) {
+    res = ParseInvalid;
+  } else if (res == ParseOk && off + name_len > s.recv.size()) {
+    res = ParseIncomplete;
+  }
+  if (res == ParseInvalid || (res == ParseIncomplete && s.peer_closed)) {
+    log_info("client sent invalid batch, closing\n");
+    w.metrics.invalid.add();
+    error = true;
+    return false;
+  } else if (res == ParseIncomplete) {
+    return false;
+  }
+
+  s.recv.peek(off, s.file_name, name_len);
+  s.file_name[name_len] = 0;
+  consume_recv(w, s, off + name_len);
+  s.batch_remaining--;
+  if (s.batch_remaining == 0) {
+    // what follows the last name is the next request
+    s.batch_pending = false;
+  }
+  s.range_off = 0;
+  s.range_len = 0;
+  start_file(w, s);
+  return true;
+}
+
+// make the request at the head of the queue the one in progress
+void start_request(Worker &w, SocketState &s) {
+  Request &req = s.requests[s.req_head];
+  s.req_head = (s.req_head + 1) % MAX_PIPELINE;
+  s.req_count--;
+
+  s.recv.peek(req.name_off, s.file_name, req.name_len);
+  // append NUL if length of name is 256 bytes
+  s.file_name[req.name_len] = 0;
+  uint8_t digest[SHA256_LEN];
+  if (req.command == Command::Have) {
+    s.recv.peek(req.digest_off, digest, sizeof(digest));
+  }
+  s.current_command = req.command;
+  // the connection waited for this request until now
+  uint64_t now = metrics_now();
+  w.metrics.state_time[State::WaitForRequest].record(now - s.state_since);
+  s.state_since = now;
+  s.request_start = now;
+  s.in_request = true;
+  s.request_bytes = 0;
+  s.request_failed = false;
+  w.metrics.requests[req.command].add();
+  s.version = req.version;
+  // only with a codec agreed on
+  s.compressed = (req.flags & FLAG_COMPRESSED) && (s.codecs & CODEC_ZLIB);
+  s.checksum = req.flags & FLAG_CHECKSUM;
+  // only on the unix socket, elsewhere the file would mean nothing
+  s.pass_file = s.local && (req.flags & FLAG_PASS_FILE);
+  s.crc = 0;
+  consume_recv(w, s, req.header_len);
+  s.parsed_len -= req.header_len;
+
+  if (s.current_command == Command::Hello) {
+    // hello resp with the version agreed on
+    log_debug("client speaks protocol v%d\n", s.version);
+    uint8_t resp[2] = {0xF0, s.version};
+    append_resp(s, resp, sizeof(resp));
+  } else if (s.current_command == Command::Codecs) {
+    // codecs resp with the codecs agreed on
+    s.codecs = req.codecs & SUPPORTED_CODECS;
+    log_debug("client agrees on codecs 0x%02x\n", s.codecs);
+    uint8_t resp[2] = {0xF1, s.codecs};
+    append_resp(s, resp, sizeof(resp));
+  } else if (s.current_command == Command::Upload) {
+    // upload
+    log_debug("user wants to upload: %s\n", s.file_name);
+    s.body_len = req.body_len;
+    s.written_len = 0;
+    log_debug("receiving %sfile of size %llu\n",
+              s.compressed ? "compressed " : "",
+              (unsigned long long)s.body_len);
+    if ((req.flags & FLAG_COMPRESSED) && !s.compressed) {
+      // can't be decoded, the body is thrown away
+      log_error("compressed upload without a codec: %s\n", s.file_name);
+      s.file_fd = -1;
+      set_state(w, s, State::WaitForBody);
+      return;
+    }
+    if (s.compressed) {
+      s.inflater = new Inflater;
+      if (!s.inflater->init()) {
+        log_error("unable to start decompressing: %s\n", s.file_name);
+      }
+    }
+    // the old content is served until the new one is renamed over it
+    parent_dir(s.file_name, s.dir_name);
+    const char *dir = s.dir_name;
+    if (w.store.enabled()) {
+      s.hasher = new Sha256;
+      dir = w.store.temp_dir();
+    }
+    open_file(w, s, dir, O_TMPFILE | O_WRONLY, 0644);
+  } else if (s.current_command == Command::Have) {
+    log_debug("user wants to upload by hash: %s\n", s.file_name);
+    if (w.store.enabled()) {
+      // answered when the disk pool linked the blob
+      DiskJob job;
+      job.op = DiskJob::Link;
+      job.key = s.key;
+      job.done = &w.disk_done;
+      job.path = s.file_name;
+      job.store = &w.store;
+      memcpy(job.digest, digest, sizeof(digest));
+      w.disk->submit(std::move(job));
+      set_state(w, s, State::WaitForDisk);
+    } else {
+      // have resp: the content isn't there
+      uint8_t resp = 0x00;
+      append_resp(s, &resp, 1);
+    }
+  } else if (s.current_command == Command::Batch) {
+    // batch resp header, then a download resp for every name
+    log_debug("user wants to download a batch of %llu files\n",
+              (unsigned long long)req.batch_count);
+    uint8_t resp[MAX_RESP_LEN];
+    resp[0] = 0x03;
+    int len = 1 + put_varint(&resp[1], req.batch_count);
+    append_resp(s, resp, len);
+    s.batch_remaining = req.batch_count;
+    if (s.batch_remaining > 0) {
+      // let the files of the batch fill whole segments
+      if (!s.local) {
+        tcp_cork(s.fd, true);
+      }
+      s.in_batch = true;
+      set_state(w, s, State::WaitForName);
+    }
+  } else {
+    // download
+    s.range_off = req.range_off;
+    s.range_len = req.range_len;
+    start_file(w, s);
+  }
+  if (s.state == State::WaitForRequest) {
+    // answered already
+    finish_request(w, s, metrics_now());
+  }
+}
+
+// start the timer of the group commit
+void arm_commit_timer(Worker &w) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = w.commit_ms / 1000;
+  // 0 would disarm it
+  spec.it_value.tv_nsec = std::max(w.commit_ms % 1000 * 1000000L, 1L);
+  if (timerfd_settime(w.commit_timer_fd, 0, &spec, NULL) < 0) {
+    log_perror("timerfd_settime");
+  }
+}
+
+// receive the body of the upload in progress, returns true on progress
+bool receive_body(Worker &w, SocketState &s, bool &error) {
+  bool progress = false;
+  while (s.written_len < s.body_len) {
+    if (s.disk_pending >= MAX_DISK_WRITES) {
+      // receive more when a block is free
+      set_state(w, s, State::WaitForDisk);
+      return progress;
+    }
+    // a receive of io_uring waits for the body itself
+    if (w.turn_left == 0 ||
+        (s.recv.size() == 0 && !s.can_read && !recv_on_ring(w, s))) {
+      return progress;
+    }
+    // never consume more than the body, the next request may follow
+    size_t len = std::min(s.body_len - s.written_len, (uint64_t)w.turn_left);
+    len = allowance(w, s, len);
+    if (len == 0) {
+      return progress;
+    }
+    if (s.recv.size() > 0) {
+      // body received together with the header
+      size_t seg_len;
+      const uint8_t *seg = s.recv.front(len, &seg_len);
+      if (!write_body(w, s, seg, seg_len)) {
+        error = true;
+        return progress;
+      }
+      consume_recv(w, s, seg_len);
+      s.written_len += seg_len;
+      use_turn(w, seg_len);
+      take_bytes(w, s, seg_len);
+      progress = true;
+      continue;
+    }
+    if (s.recv_busy) {
+      // the rest comes with the receive in progress
+      return progress;
+    }
+
+    // compressed, checksummed or hashed bodies go through user space, and
+    // so do all written behind, which is done from blocks, and all that
+    // openssl decrypts
+    bool splice = s.file_fd >= 0 && s.splice_body && s.inflater == NULL &&
+                  !s.checksum && s.hasher == NULL && !write_behind(w) &&
+                  !s.tls_recv;
+    if (splice && s.block_len > 0 && !flush_block(w, s)) {
+      // body received with the header goes first
+      error = true;
+      return progress;
+    }
+    ssize_t res = splice ? splice_body(w, s, len) : copy_body(w, s, len);
+    if (res < 0 && errno == EINPROGRESS) {
+      return progress;
+    } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      w.metrics.read_eagain.add();
+      s.can_read = false;
+      return progress;
+    } else if (res <= 0) {
+      if (res < 0) {
+        log_perror("receive body");
+      } else {
+        log_error("remote closed connection in the middle of a body\n");
+      }
+      error = true;
+      return progress;
+    }
+    w.metrics.received_bytes.add(res);
+    s.written_len += res;
+    use_turn(w, res);
+    take_bytes(w, s, res);
+    progress = true;
+  }
+
+  if (s.inflater != NULL) {
+    if (s.file_fd >= 0 && !s.inflater->done()) {
+      log_error("compressed upload ended early: %s\n", s.file_name);
+      drop_upload_file(w, s);
+    }
+    delete s.inflater;
+    s.inflater = NULL;
+  }
+
+  if (s.file_fd >= 0 && !flush_block(w, s)) {
+    close_file(w, s.file_fd);
+    s.file_fd = -1;
+  }
+  if (s.disk_pending > 0) {
+    // done when the last block is written
+    set_state(w, s, State::WaitForDisk);
+    return true;
+  }
+  release_block(w, s);
+  s.upload_pending = false;
+  if (s.file_fd < 0) {
+    upload_done(w, s, false);
+  } else if (w.durability != Durability::GroupCommit) {
+    start_publish(w, s);
+  } else {
+    // answered after the next group commit
+    if (w.commit_pending.empty()) {
+      arm_commit_timer(w);
+    }
+    w.commit_pending.push_back(s.key);
+    set_state(w, s, State::WaitForSync);
+  }
+  return true;
+}
+
+// tls in user space: read the next chunk of the download in progress, at
+// s.file_off, on the disk pool
+void read_chunk(Worker &w, SocketState &s) {
+  if (s.chunk == NULL) {
+    s.chunk = w.blocks.get();
+  }
+  DiskJob job;
+  job.op = DiskJob::Read;
+  job.key = s.key;
+  job.done = &w.disk_done;
+  job.fd = s.send_fd;
+  job.buffer = s.chunk;
+  job.len = std::min(s.file_remaining, (uint64_t)w.blocks.buffer_size());
+  job.off = s.file_off;
+  // the fd stays open when the connection is closed first
+  w.files.hold(s.file);
+  job.entry = s.file;
+  job.download = true;
+  w.disk->submit(std::move(job));
+  s.chunk_busy = true;
+}
+
+// sendfile() for tls in user space: write the chunk read at s.file_off
+// through openssl
+ssize_t tls_sendfile(SocketState &s, size_t len) {
+  // a record half written goes again
+  len = std::min(std::max(len, s.tls_retry), s.chunk_len - s.chunk_sent);
+  ssize_t res = tls_write_some(s, &s.chunk[s.chunk_sent], len);
+  if (res > 0) {
+    s.chunk_sent += res;
+    s.file_off += res;
+  }
+  return res;
+}
+
+// io_uring: splice at most len bytes of the download in progress to the
+// socket, through the pipe of the connection: from the file into the pipe
+// and, linked to that, from the pipe into the socket. what the socket didn't
+// take the last time goes first. returns false on error
+bool splice_file(Worker &w, SocketState &s, size_t len) {
+  if (s.pipe.fds[0] < 0 && !take_pipe(w, s)) {
+    return false;
+  }
+  s.send_busy = true;
+  // a splice into a full socket fails rather than waiting, readiness seen
+  // from now on is new
+  s.can_write = false;
+  if (s.pipe_len > 0) {
+    w.ring.prep_splice(s.pipe.fds[0], -1, s.fd, std::min(len, s.pipe_len),
+                       false, make_user_data(Spliced, s.key));
+    s.ring_ops++;
+    return true;
+  }
+  // whole pages of the file fit in the pipe, the first may be partial
+  len = std::min(len, s.pipe.size - s.file_off % PAGE_LEN);
+  w.ring.prep_splice(s.send_fd, s.file_off, s.pipe.fds[1], len, true,
+                     make_user_data(PipeFilled, s.key));
+  w.ring.prep_splice(s.pipe.fds[0], -1, s.fd, len, false,
+                     make_user_data(Spliced, s.key));
+  s.ring_ops += 2;
+  return true;
+}
+
+// send the file of the download in progress, returns true on progress
+bool send_file(Worker &w, SocketState &s, bool &error) {
+  bool progress = false;
+  while (s.file_remaining > 0) {
+    if (s.send_busy || s.chunk_busy || !s.can_write || w.turn_left == 0) {
+      return progress;
+    }
+    size_t len = std::min(s.file_remaining, (uint64_t)w.turn_left);
+    len = allowance(w, s, len);
+    if (len == 0) {
+      return progress;
+    }
+    if (send_on_ring(w, s)) {
+      // the rest goes when the splice is done
+      error = !splice_file(w, s, len);
+      return progress;
+    }
+    if (s.tls_send && s.chunk_sent == s.chunk_len) {
+      // the rest goes when the next chunk is read
+      read_chunk(w, s);
+      return progress;
+    }
+    ssize_t res = s.tls_send ? tls_sendfile(s, len)
+                             : sendfile(s.fd, s.send_fd, &s.file_off, len);
+    if (res < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        w.metrics.write_eagain.add();
+        s.can_write = false;
+        return progress;
+      }
+      log_perror("sendfile");
+      error = true;
+      return progress;
+    } else if (res == 0) {
+      // file got truncated, the promised length can't be sent any more
+      log_error("file shrank while sending: %s\n", s.file_name);
+      error = true;
+      return progress;
+    }
+    w.metrics.sendfile_bytes.record(res);
+    w.metrics.sent_bytes.add(res);
+    use_turn(w, res);
+    take_bytes(w, s, res);
+    if (s.crc_streaming) {
+      checksum_sent(w, s);
+    }
+    s.file_remaining -= res;
+    progress = true;
+  }
+
+  if (s.crc_streaming && (s.crc_busy || s.crc_off < s.file_off)) {
+    // the crc follows once the disk pool has caught up
+    checksum_sent(w, s);
+    return progress;
+  }
+  log_debug("complete sending file to client\n");
+  put_pipe(w, s);
+  release_chunk(w, s);
+  if (s.checksum) {
+    if (s.crc_streaming && s.range_off == 0 &&
+        s.file_off == s.file->st.st_size) {
+      // the next download of the whole file doesn't need to read it again
+      s.file->crc = s.crc;
+      s.file->has_crc = true;
+    }
+    append_crc(s);
+  }
+  w.files.release(s.file);
+  s.file = NULL;
+  download_done(w, s);
+  return true;
+}
+
+// send pending resp headers and the content of the download in progress from
+// memory, together in one writev(), returns true on progress
+bool send_data(Worker &w, SocketState &s, bool &error) {
+  bool progress = false;
+  while (s.buffer_written < s.write_len || s.file_remaining > 0 ||
+         s.trailer_written < s.trailer_len) {
+    if (s.send_busy || !s.can_write || w.turn_left == 0) {
+      return progress;
+    }
+    struct iovec iov[3];
+    int iovcnt = 0;
+    if (s.buffer_written < s.write_len) {
+      iov[iovcnt].iov_base = &s.write_buffer[s.buffer_written];
+      iov[iovcnt].iov_len = s.write_len - s.buffer_written;
+      iovcnt++;
+    }
+    // the rest of the content may be left for the next turn or until there
+    // are tokens, and its crc with it
+    uint64_t content_len = std::min(s.file_remaining, (uint64_t)w.turn_left);
+    if (content_len > 0) {
+      content_len = allowance(w, s, content_len);
+      if (content_len == 0) {
+        return progress;
+      }
+      // a record half written goes again
+      content_len =
+          std::max(content_len, std::min(s.file_remaining, s.tls_retry));
+      iov[iovcnt].iov_base = &s.file->data[s.file_off];
+      iov[iovcnt].iov_len = content_len;
+      iovcnt++;
+    }
+    if (content_len == s.file_remaining &&
+        s.trailer_written < s.trailer_len) {
+      iov[iovcnt].iov_base = &s.trailer[s.trailer_written];
+      iov[iovcnt].iov_len = s.trailer_len - s.trailer_written;
+      iovcnt++;
+    }
+    if (send_on_ring(w, s)) {
+      // the rest goes when the send is done
+      start_send(w, s, iov, iovcnt, 0);
+      return progress;
+    }
+    ssize_t res = socket_writev(w, s, iov, iovcnt);
+    if (res < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        w.metrics.write_eagain.add();
+        s.can_write = false;
+        return progress;
+      }
+      log_perror("writev");
+      error = true;
+      return progress;
+    }
+    w.metrics.sent_bytes.add(res);
+    use_turn(w, res);
+    // the resp headers go first, then the content and its crc
+    size_t header =
+        std::min((size_t)res, (size_t)(s.write_len - s.buffer_written));
+    s.buffer_written += header;
+    res -= header;
+    size_t body = std::min((uint64_t)res, s.file_remaining);
+    s.file_off += body;
+    s.file_remaining -= body;
+    s.trailer_written += res - body;
+    take_bytes(w, s, body);
+    progress = true;
+  }
+
+  log_debug("complete sending file to client\n");
+  s.write_len = 0;
+  s.buffer_written = 0;
+  s.trailer_len = 0;
+  s.trailer_written = 0;
+  w.files.release(s.file);
+  s.file = NULL;
+  download_done(w, s);
+  return true;
+}
+
+// bind listen sockets of a worker, return number of sockets bound
+int listen_on(Worker &w, const char *port, bool reuseport) {
+  int error;
+  int count = 0;
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  error = getaddrinfo(NULL, port, &hints, &res);
+  if (error != 0 || res == NULL) {
+    log_error("getaddrinfo: %s\n", gai_strerror(error));
+    return 0;
+  }
+  for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+    int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) {
+      log_perror("socket");
+      continue;
+    }
+
+    // set v6only when needed
+    if (p->ai_family == AF_INET6) {
+      int on = 1;
+      if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0) {
+        close(fd);
+        log_perror("setsockopt");
+        continue;
+      }
+    }
+
+    // set reuseaddr
+    if (!so_reuseaddr(fd)) {
+      // fail
+      close(fd);
+      continue;
+    }
+
+    // set reuseport so that each worker gets its own accept queue
+    if (reuseport && !so_reuseport(fd)) {
+      // fail
+      close(fd);
+      continue;
+    }
+
+    // bind
+    if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
+      close(fd);
+      log_perror("bind");
+      continue;
+    }
+
+    // listen
+    if (listen(fd, SOMAXCONN) < 0) {
+      close(fd);
+      log_perror("listen");
+      continue;
+    }
+
+    // set non blocking
+    if (!nonblocking(fd)) {
+      // error
+      close(fd);
+      continue;
+    }
+
+    // print info
+    char hbuf[NI_MAXHOST];
+    char sbuf[NI_MAXSERV];
+    error = getnameinfo(p->ai_addr, p->ai_addrlen, hbuf, sizeof(hbuf), sbuf,
+                        sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
+    if (error != 0) {
+      log_error("getnameinfo: %s\n", gai_strerror(error));
+      close(fd);
+      continue;
+    }
+
+    // add to epoll
+    if (add_socket(w, fd, SocketKind::Listen, EPOLLIN | EPOLLET) == NULL) {
+      close(fd);
+      continue;
+    }
+    log_info("worker %d listening to %s:%s\n", w.id, hbuf, sbuf);
+    count++;
+  }
+  freeaddrinfo(res);
+  return count;
+}
+
+// bind the unix socket at path, which all workers accept from. returns the
+// listen socket, -1 on error
+int listen_unix(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_error("unix socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    log_perror("socket");
+    return -1;
+  }
+  // left behind by an earlier run
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    log_perror("bind unix socket");
+    close(fd);
+    return -1;
+  }
+  log_info("listening to %s\n", path);
+  return fd;
+}
+
+// accept all incoming sockets
+void accept_all(Worker &w, int listen_fd) {
+  for (;;) {
+    struct sockaddr_storage in_addr;
+    memset(&in_addr, 0, sizeof(in_addr));
+    socklen_t in_len = sizeof(in_addr);
+    int fd = accept(listen_fd, (struct sockaddr *)&in_addr, &in_len);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // no more socket to accept
+        break;
+      } else if ((errno == EMFILE || errno == ENFILE) && w.spare_fd >= 0) {
+        // out of fds: the connection would stay in the backlog with no
+        // event to retry, so make room to accept and close it
+        close(w.spare_fd);
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) {
+          close(fd);
+          w.metrics.rejected.add();
+        }
+        w.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        log_error("out of fds, rejected a connection\n");
+        continue;
+      } else {
+        log_perror("accept");
+        break;
+      }
+    }
+
+    // set non blocking
+    if (!nonblocking(fd)) {
+      // error
+      close(fd);
+      continue;
+    }
+
+    // print info, a local client goes by its pid
+    bool local = in_addr.ss_family == AF_UNIX;
+    char hbuf[NI_MAXHOST];
+    char sbuf[NI_MAXSERV];
+    if (local) {
+      struct ucred cred;
+      socklen_t cred_len = sizeof(cred);
+      if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+        cred.pid = 0;
+      }
+      strcpy(hbuf, "unix");
+      snprintf(sbuf, sizeof(sbuf), "%d", (int)cred.pid);
+    } else {
+      tcp_nodelay(fd);
+      int error =
+          getnameinfo((struct sockaddr *)&in_addr, in_len, hbuf, sizeof(hbuf),
+                      sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
+      if (error != 0) {
+        log_error("getnameinfo: %s\n", gai_strerror(error));
+        close(fd);
+        continue;
+      }
+    }
+    log_debug("worker %d get connection from %s:%s\n", w.id, hbuf, sbuf);
+
+    // admit it within the limit of all workers
+    int open_count = w.connections->fetch_add(1);
+    if (w.max_connections > 0 && open_count >= w.max_connections) {
+      w.connections->fetch_sub(1);
+      log_info("too many connections, closing\n");
+      w.metrics.rejected.add();
+      close(fd);
+      continue;
+    }
+
+    // add to epoll and state
+    SocketState *s = add_socket(w, fd, SocketKind::Client,
+                                EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    if (s == NULL) {
+      w.connections->fetch_sub(1);
+      close(fd);
+      continue;
+    }
+    w.metrics.accepted.add();
+    // brackets keep the port apart from an ipv6 address
+    const char *peer_format = strchr(hbuf, ':') ? "[%s]:%s" : "%s:%s";
+    snprintf(s->peer, sizeof(s->peer), peer_format, hbuf, sbuf);
+    s->local = local;
+    if (w.tls != NULL && !local) {
+      s->ssl = tls_new(w.tls, fd, true);
+      if (s->ssl == NULL) {
+        log_error("unable to start tls: %s\n", tls_error());
+        close_conn(w, *s);
+        continue;
+      }
+      s->state = State::Handshake;
+    }
+    update_deadline(w, *s, true, false);
+    s->byte_tokens.init(w.conn_rates.bytes,
+                        burst_of(w.conn_rates.bytes, MIN_GRANT));
+    s->request_tokens.init(w.conn_rates.requests,
+                           burst_of(w.conn_rates.requests, 1));
+    if (w.limiter->limited()) {
+      // shares its limits with all connections from the same address
+      s->client = w.limiter->acquire(hbuf);
+    }
+  }
+}
+
+// go on with the tls handshake of a connection, returns true when it is done
+bool shake_hands(Worker &w, SocketState &s, bool &error) {
+  if (tls_handshake(s.ssl) < 0) {
+    if (errno != EAGAIN) {
+      log_info("tls handshake with %s failed: %s\n", s.peer, tls_error());
+      w.metrics.tls_handshakes[TlsResult::TlsFailed].add();
+      error = true;
+    }
+    return false;
+  }
+  s.tls_send = !tls_kernel_send(s.ssl);
+  s.tls_recv = !tls_kernel_recv(s.ssl);
+  TlsResult result = s.tls_send    ? TlsResult::UserTls
+                     : s.tls_recv ? TlsResult::KernelSend
+                                  : TlsResult::KernelTls;
+  w.metrics.tls_handshakes[result].add();
+  log_debug("tls with %s: %s, %s\n", s.peer, SSL_get_version(s.ssl),
+            TLS_RESULT_NAMES[result]);
+  set_state(w, s, State::WaitForRequest);
+  return true;
+}
+
+// run the state machine of a client until it can't make progress or its turn
+// is over, return false if the connection should be closed
+bool handle_client(Worker &w, SocketState &s) {
+  // try to read/write as much as possible until EAGAIN/EWOUDLBLOCK
+  bool error = false;
+  bool progress = true;
+  bool turn_over = false;
+  // for the deadline: whether anything happened, and a request started
+  bool moved = false;
+  bool started = false;
+  s.pace_at = 0;
+  w.turn_left = w.turn_bytes;
+  uint64_t turn_end = w.turn_ns > 0 ? monotonic_ns() + w.turn_ns : 0;
+  while (progress && !error) {
+    if (w.turn_left == 0 || (turn_end > 0 && monotonic_ns() >= turn_end)) {
+      // let the other connections have theirs before going on
+      turn_over = true;
+      break;
+    }
+    progress = false;
+
+    if (s.state == State::Handshake) {
+      // nothing else goes over the connection until it is done
+      if (!shake_hands(w, s, error)) {
+        break;
+      }
+      progress = true;
+    }
+
+    // receive in bulk, except when an upload is queued: its body is moved
+    // from the socket to the file directly
+    if (s.can_read && !s.recv_busy && !s.peer_closed && !s.upload_pending &&
+        s.req_count < MAX_PIPELINE &&
+        (!s.recv.attached() || s.recv.space() > 0)) {
+      ssize_t res = fill_recv(w, s);
+      if (res > 0) {
+        progress = true;
+      } else if (res == 0) {
+        s.peer_closed = true;
+      } else if (errno == EINPROGRESS) {
+        // goes on when it is received
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        w.metrics.read_eagain.add();
+        s.can_read = false;
+      } else {
+        log_perror("read");
+        error = true;
+        break;
+      }
+    }
+
+    // decode every complete header received so far
+    int parsed = parse_requests(s);
+    if (parsed < 0) {
+      log_info("client sent invalid data, closing\n");
+      w.metrics.invalid.add();
+      error = true;
+      break;
+    } else if (parsed > 0) {
+      progress = true;
+    }
+
+    // start the next request when its resp header fits and the rate allows
+    if (s.state == State::WaitForRequest && s.req_count > 0 &&
+        s.write_len + MAX_RESP_LEN <= (int)sizeof(s.write_buffer) &&
+        take_request(w, s)) {
+      start_request(w, s);
+      started = true;
+      progress = true;
+    }
+
+    // the same for the next name of a batch
+    if (s.state == State::WaitForName &&
+        s.write_len + MAX_RESP_LEN <= (int)sizeof(s.write_buffer)) {
+      progress |= next_batch_name(w, s, error);
+    }
+
+    if (s.state == State::WaitForBody) {
+      progress |= receive_body(w, s, error);
+    }
+
+    if (s.state == State::SendResp) {
+      // send resp header, the file follows in the same segment
+      if (flush_resp(w, s, true, error)) {
+        set_state(w, s, State::SendFile);
+        progress = true;
+      }
+    }
+
+    if (s.state == State::SendFile) {
+      progress |= send_file(w, s, error);
+    }
+
+    if (s.state == State::SendData) {
+      progress |= send_data(w, s, error);
+    }
+
+    // nothing else to do for now, send resps collected so far
+    if (!progress && !error && s.write_len > 0 &&
+        s.state != State::SendResp && s.state != State::SendData) {
+      progress = flush_resp(w, s, false, error);
+    }
+    moved |= progress;
+  }
+
+  if (error) {
+    return false;
+  }
+  if (turn_over && !s.in_ready) {
+    w.metrics.turns_exceeded.add();
+    s.in_ready = true;
+    w.ready.push_back(s.key);
+  }
+  if (s.pace_at > 0 && (s.paced_at == 0 || s.pace_at < s.paced_at)) {
+    // a later wakeup it is waiting for is ignored when it comes
+    pace(w, s);
+  }
+  if (s.peer_closed && s.state == State::WaitForRequest &&
+      s.req_count == 0 && s.write_len == 0) {
+    // remote closed connection
+    log_debug("remote closed connection\n");
+    return false;
+  }
+  update_deadline(w, s, moved, started);
+  return true;
+}
+
+// wake the connections whose tokens are there
+void wake_paced(Worker &w) {
+  uint64_t expirations;
+  if (read(w.pace_timer_fd, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+  w.pace_armed = 0;
+  uint64_t now = monotonic_ns();
+  // connections that run out again sleep until after now
+  while (!w.paced.empty() && w.paced.front().at <= now) {
+    Wakeup first = w.paced.front();
+    std::pop_heap(w.paced.begin(), w.paced.end(), wakes_later);
+    w.paced.pop_back();
+    SocketState *s = w.state.lookup(first.key);
+    // closed in the meantime, or waiting for an earlier wakeup
+    if (s == NULL || s->paced_at != first.at) {
+      continue;
+    }
+    s->paced_at = 0;
+    if (!handle_client(w, *s)) {
+      close_conn(w, *s);
+    }
+  }
+  // waking may have set the timer for a later one
+  if (!w.paced.empty() && w.paced.front().at != w.pace_armed) {
+    arm_pace_timer(w, w.paced.front().at);
+  }
+}
+
+// close the connections whose deadlines have passed
+void expire_timeouts(Worker &w) {
+  uint64_t expirations;
+  if (read(w.tick_timer_fd, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+  w.expired.clear();
+  w.wheel.advance(w.now, w.expired);
+  for (const TimerWheel::Timer &timer : w.expired) {
+    SocketState *s = w.state.lookup(timer.key);
+    // closed in the meantime, or has an earlier timer
+    if (s == NULL || s->timer_tick != timer.tick) {
+      continue;
+    }
+    s->timer_tick = 0;
+    if (s->paced_at != 0) {
+      // held back by a rate limit, not by the client
+      s->deadline = deadline_after(w, s->timeout);
+    }
+    if (s->deadline > w.now) {
+      // moved since the timer was set
+      schedule_timeout(w, *s);
+      continue;
+    } else if (s->deadline == 0) {
+      continue;
+    }
+    log_info("connection timed out waiting for %s\n",
+             TIMEOUT_NAMES[s->timeout]);
+    w.metrics.timeouts[s->timeout].add();
+    close_conn(w, *s);
+  }
+  if (w.wheel.size() == 0) {
+    arm_tick_timer(w, false);
+  }
+}
+
+// count a job of the disk pool on the file of a connection as done, closing
+// the file when nobody waits for it any more. returns the connection, NULL if
+// it is gone
+SocketState *file_job_done(Worker &w, const DiskJob &job) {
+  auto orphan = w.orphan_files.find(job.fd);
+  if (orphan != w.orphan_files.end() && --orphan->second == 0) {
+    // the last job of a file nobody waits for any more
+    close_file(w, job.fd);
+    w.orphan_files.erase(orphan);
+  }
+  SocketState *s = w.state.lookup(job.key);
+  if (s != NULL) {
+    s->disk_pending--;
+  }
+  return s;
+}
+
+// go on with a connection after the disk pool moved it to another state
+void resume(Worker &w, SocketState &s) {
+  w.metrics.events.add();
+  if (!handle_client(w, s)) {
+    close_conn(w, s);
+  }
+}
+
+void write_done(Worker &w, DiskJob &job) {
+  w.blocks.put(job.buffer);
+  SocketState *s = file_job_done(w, job);
+  if (s == NULL) {
+    return;
+  }
+  if (job.result < 0) {
+    log_error("unable to write upload: %s: %s\n", s->file_name,
+              strerror(-job.result));
+    close_conn(w, *s);
+    return;
+  }
+  if (s->state == State::WaitForDisk && s->disk_pending < MAX_DISK_WRITES) {
+    set_state(w, *s, State::WaitForBody);
+    resume(w, *s);
+  }
+}
+
+void publish_done(Worker &w, DiskJob &job) {
+  // downloads that opened the file before got the old content
+  w.files.invalidate(job.path.c_str());
+  SocketState *s = file_job_done(w, job);
+  if (s == NULL || s->file_fd != job.fd) {
+    return;
+  }
+  close_file(w, s->file_fd);
+  s->file_fd = -1;
+  upload_done(w, *s, job.result == 0);
+  resume(w, *s);
+}
+
+void link_done(Worker &w, DiskJob &job) {
+  if (job.result == 0) {
+    w.files.invalidate(job.path.c_str());
+  }
+  SocketState *s = w.state.lookup(job.key);
+  if (s == NULL) {
+    return;
+  }
+  // have resp: whether name now has the content
+  uint8_t resp = job.result == 0 ? 0x01 : 0x00;
+  append_resp(*s, &resp, 1);
+  set_state(w, *s, State::WaitForRequest);
+  resume(w, *s);
+}
+
+void chunk_read(Worker &w, DiskJob &job) {
+  w.files.release(job.entry);
+  SocketState *s = w.state.lookup(job.key);
+  if (s == NULL) {
+    w.blocks.put(job.buffer);
+    return;
+  }
+  s->chunk_busy = false;
+  if (job.result == -ENODATA) {
+    // file got truncated, the promised length can't be sent any more
+    log_error("file shrank while sending: %s\n", s->file_name);
+    close_conn(w, *s);
+    return;
+  } else if (job.result < 0) {
+    log_error("unable to read download: %s: %s\n", s->file_name,
+              strerror(-job.result));
+    close_conn(w, *s);
+    return;
+  }
+  s->chunk_len = job.len;
+  s->chunk_sent = 0;
+  resume(w, *s);
+}
+
+void checksum_done(Worker &w, DiskJob &job) {
+  w.files.release(job.entry);
+  SocketState *s = w.state.lookup(job.key);
+  if (s == NULL) {
+    return;
+  }
+  s->crc_busy = false;
+  if (job.result < 0) {
+    log_error("unable to read back download: %s: %s\n", s->file_name,
+              strerror(-job.result));
+    close_conn(w, *s);
+    return;
+  }
+  s->crc = job.crc;
+  s->crc_off += job.len;
+  // what has been sent in the meantime
+  checksum_sent(w, *s);
+  resume(w, *s);
+}
+
+// answer the uploads of the group commit that is done, the ones whose file is
+// still open made it through all steps
+void finish_commit(Worker &w) {
+  for (uint64_t key : w.committing) {
+    SocketState *s = w.state.lookup(key);
+    // the connection may be gone, and the slot reused
+    if (s == NULL || s->state != State::WaitForSync) {
+      continue;
+    }
+    bool ok = s->file_fd >= 0;
+    if (ok) {
+      close_file(w, s->file_fd);
+      s->file_fd = -1;
+    }
+    upload_done(w, *s, ok);
+    resume(w, *s);
+  }
+  w.committing.clear();
+  // the timer may have fired in the meantime
+  if (!w.commit_pending.empty()) {
+    arm_commit_timer(w);
+  }
+}
+
+// submit the jobs of the step the group commit is at, for the uploads that
+// haven't failed yet, moving on while a step has none. after the last step
+// the uploads are answered
+void run_commit_step(Worker &w) {
+  while (w.commit_step != CommitStep::CommitIdle) {
+    w.commit_dirs.clear();
+    for (uint64_t key : w.committing) {
+      SocketState *s = w.state.lookup(key);
+      if (s == NULL || s->state != State::WaitForSync || s->file_fd < 0) {
+        continue;
+      }
+      if (w.commit_step == CommitStep::SyncFiles) {
+        DiskJob job;
+        job.op = DiskJob::Sync;
+        job.key = key;
+        job.done = &w.disk_done;
+        job.fd = s->file_fd;
+        w.disk->submit(std::move(job));
+      } else if (w.commit_step == CommitStep::NameFiles) {
+        w.disk->submit(publish_job(w, *s));
+      } else {
+        // one sync per directory
+        auto same = [s](const char *dir) {
+          return strcmp(dir, s->dir_name) == 0;
+        };
+        if (std::none_of(w.commit_dirs.begin(), w.commit_dirs.end(), same)) {
+          w.commit_dirs.push_back(s->dir_name);
+        }
+        continue;
+      }
+      s->disk_pending++;
+      w.commit_jobs++;
+    }
+    for (const char *dir : w.commit_dirs) {
+      DiskJob job;
+      job.op = DiskJob::SyncDir;
+      job.done = &w.disk_done;
+      job.path = dir;
+      w.disk->submit(std::move(job));
+      w.commit_jobs++;
+    }
+    if (w.commit_jobs > 0) {
+      return;
+    }
+    w.commit_step = (CommitStep)(w.commit_step + 1);
+  }
+  finish_commit(w);
+}
+
+// start the group commit of the uploads waiting for it when the timer fires,
+// unless one is in progress, which arms the timer again when it is done
+void group_commit(Worker &w) {
+  uint64_t expirations;
+  if (read(w.commit_timer_fd, &expirations, sizeof(expirations)) < 0 ||
+      w.commit_step != CommitStep::CommitIdle) {
+    return;
+  }
+  w.committing.swap(w.commit_pending);
+  w.commit_step = CommitStep::SyncFiles;
+  run_commit_step(w);
+}
+
+// a job of the group commit is done, a failure fails the uploads it was for
+// and the commit goes on with the others
+void commit_job_done(Worker &w, DiskJob &job) {
+  if (job.op == DiskJob::SyncDir) {
+    for (uint64_t key : w.committing) {
+      SocketState *s = w.state.lookup(key);
+      if (job.result < 0 && s != NULL && s->state == State::WaitForSync &&
+          s->file_fd >= 0 && strcmp(s->dir_name, job.path.c_str()) == 0) {
+        close_file(w, s->file_fd);
+        s->file_fd = -1;
+      }
+    }
+  } else {
+    if (job.op == DiskJob::Publish) {
+      // downloads that opened the file before got the old content
+      w.files.invalidate(job.path.c_str());
+    }
+    SocketState *s = file_job_done(w, job);
+    if (s != NULL && job.result < 0 && s->file_fd == job.fd) {
+      close_file(w, s->file_fd);
+      s->file_fd = -1;
+    }
+  }
+  if (--w.commit_jobs == 0) {
+    w.commit_step = (CommitStep)(w.commit_step + 1);
+    run_commit_step(w);
+  }
+}
+
+// continue the connections whose jobs the disk pool finished
+void finish_disk_jobs(Worker &w) {
+  w.disk_jobs.clear();
+  w.disk_done.take(w.disk_jobs);
+  for (DiskJob &job : w.disk_jobs) {
+    if (job.op == DiskJob::Open || job.op == DiskJob::Stat) {
+      SocketState *s = w.state.lookup(job.key);
+      if (s == NULL || job.result < 0) {
+        // the watch isn't needed after all
+        w.files.unwatch(job.wd);
+      }
+      if (s == NULL) {
+        // connection is gone
+        if (job.result >= 0) {
+          close_file(w, job.result);
+        }
+        continue;
+      }
+      file_opened(w, *s, job.result, &job);
+      resume(w, *s);
+    } else if (job.op == DiskJob::Write) {
+      write_done(w, job);
+    } else if (job.op == DiskJob::Read && job.download) {
+      chunk_read(w, job);
+    } else if (job.op == DiskJob::Read) {
+      w.files.loaded(job.entry, job.buffer, job.result == 0);
+    } else if (job.op == DiskJob::Compress) {
+      w.files.compressed(job.entry, job.result, job.zsize, job.crc);
+    } else if (job.op == DiskJob::Checksum) {
+      checksum_done(w, job);
+    } else if (job.op == DiskJob::Publish &&
+               w.durability != Durability::GroupCommit) {
+      publish_done(w, job);
+    } else if (job.op == DiskJob::Link) {
+      link_done(w, job);
+    } else {
+      // Sync, Publish and SyncDir of the group commit
+      commit_job_done(w, job);
+    }
+  }
+}
+
+// pin the calling thread to the n-th cpu it is allowed to run on
+void pin_to_cpu(int n) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    log_perror("sched_getaffinity");
+    return;
+  }
+  int count = CPU_COUNT(&allowed);
+  if (count == 0) {
+    return;
+  }
+  n %= count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      if (error != 0) {
+        log_error("pthread_setaffinity_np: %s\n", strerror(error));
+      }
+      return;
+    }
+  }
+}
+
+// handle readiness of a socket, events are EPOLL* or the equal POLL* flags
+void handle_event(Worker &w, uint64_t key, uint32_t events) {
+  w.metrics.events.add();
+  SocketState *s = w.state.lookup(key);
+  if (s == NULL) {
+    // closed earlier in this round
+    return;
+  }
+
+  if (events & EPOLLERR | events & EPOLLHUP) {
+    log_error("fd %d got error\n", s->fd);
+    close_conn(w, *s);
+    return;
+  }
+
+  if (s->kind == SocketKind::Listen) {
+    accept_all(w, s->fd);
+    return;
+  } else if (s->kind == SocketKind::Notify) {
+    w.files.handle_events();
+    return;
+  } else if (s->kind == SocketKind::Timer) {
+    group_commit(w);
+    return;
+  } else if (s->kind == SocketKind::Pacer) {
+    wake_paced(w);
+    return;
+  } else if (s->kind == SocketKind::Ticker) {
+    expire_timeouts(w);
+    return;
+  } else if (s->kind == SocketKind::Disk) {
+    finish_disk_jobs(w);
+    return;
+  }
+
+  if (events & (EPOLLIN | EPOLLRDHUP)) {
+    s->can_read = true;
+  }
+  if (events & EPOLLRDHUP) {
+    s->read_shut = true;
+  }
+  if (events & EPOLLOUT) {
+    s->can_write = true;
+  }
+  if (!handle_client(w, *s)) {
+    close_conn(w, *s);
+  }
+}
+
+// give the connections whose turn was over another one, in the order their
+// turns ended. the ones whose turn ends again wait for the next round
+void run_ready(Worker &w) {
+  w.running.swap(w.ready);
+  for (uint64_t key : w.running) {
+    SocketState *s = w.state.lookup(key);
+    // closed in the meantime
+    if (s == NULL || !s->in_ready) {
+      continue;
+    }
+    s->in_ready = false;
+    if (!handle_client(w, *s)) {
+      close_conn(w, *s);
+    }
+  }
+  w.running.clear();
+}
+
+void run_epoll(Worker &w) {
+  int max_event_count = 4096;
+  struct epoll_event *events = (struct epoll_event *)malloc(
+      max_event_count * sizeof(struct epoll_event));
+  memset(events, 0, max_event_count * sizeof(struct epoll_event));
 
-struct SocketState {
-  int fd;
-  int is_listen; // true for listen socket, false for client socket
-  State state;
-  Command current_command;
-  std::vector<uint8_t> read_buffer;
-  std::string file_name;
-  // resp header
-  std::vector<uint8_t> write_buffer;
-  int buffer_written;
-  // Download only
-  int file_fd;
-  // Upload only
-  uint32_t body_len;
-  uint32_t written_len;
+  // event loop
+  while (true) {
+    // only poll while connections are waiting for their turn
+    int timeout = w.ready.empty() ? -1 : 0;
+    int count = epoll_wait(w.epoll_fd, events, max_event_count, timeout);
+    w.now = monotonic_ns();
+    for (int i = 0; i < count; i++) {
+      handle_event(w, events[i].data.u64, events[i].events);
+    }
+    run_ready(w);
+  }
+
+  free(events);
+}
+
+// io_uring: an upload block was written
+void ring_write_done(Worker &w, uint64_t key, int res) {
+  DiskJob *job = w.ring_writes.lookup(key);
+  if (job == NULL) {
+    return;
+  }
+  // a short write stopped at an error
+  job->result = res < 0 ? res : (size_t)res == job->len ? 0 : -EIO;
+  write_done(w, *job);
+  w.ring_writes.free(key);
+}
+
+// io_uring: a receive into the ring or the upload block of a connection is
+// done
+void recv_done(Worker &w, SocketState &s, Completion kind, int res) {
+  s.recv_busy = false;
+  if (res < 0 && res != -EAGAIN) {
+    log_error("read: %s\n", strerror(-res));
+    close_conn(w, s);
+    return;
+  }
+  if (res == 0 &&
+      (kind == Completion::BodyReceived || s.state == State::WaitForBody)) {
+    log_error("remote closed connection in the middle of a body\n");
+    close_conn(w, s);
+    return;
+  }
+  if (res == 0) {
+    s.peer_closed = true;
+  } else if ((size_t)res == s.recv_len || s.read_shut) {
+    // there may be more, or the EOF
+    s.can_read = true;
+  }
+  if (kind == Completion::Received) {
+    s.recv.produce(std::max(res, 0));
+    if (s.recv.size() == 0) {
+      w.buffers.put(s.recv.detach());
+    }
+  } else if (res > 0) {
+    digest_output(s, &s.block[s.block_len], res);
+    s.block_len += res;
+    s.written_len += res;
+    take_bytes(w, s, res);
+    if (s.block_len == UPLOAD_BLOCK_LEN) {
+      flush_block(w, s);
+    }
+  }
+  if (res > 0) {
+    w.metrics.received_bytes.add(res);
+    update_deadline(w, s, true, false);
+  }
+  resume(w, s);
+}
+
+// io_uring: a send of resp headers, or of them and the content of a download
+// from memory, is done
+void send_done(Worker &w, SocketState &s, int res) {
+  s.send_busy = false;
+  if (res < 0 && res != -EAGAIN) {
+    log_error("write: %s\n", strerror(-res));
+    close_conn(w, s);
+    return;
+  }
+  if (res > 0) {
+    w.metrics.sent_bytes.add(res);
+    // the resp headers go first, then the content and its crc
+    size_t header =
+        std::min((size_t)res, (size_t)(s.write_len - s.buffer_written));
+    s.buffer_written += header;
+    res -= header;
+    if (s.state == State::SendData) {
+      size_t body = std::min((uint64_t)res, s.file_remaining);
+      s.file_off += body;
+      s.file_remaining -= body;
+      s.trailer_written += res - body;
+      take_bytes(w, s, body);
+    }
+    update_deadline(w, s, true, false);
+    // it waited for room itself
+    s.can_write = true;
+  }
+  resume(w, s);
+}
+
+// io_uring: the file of a download got into the pipe, the splice into the
+// socket linked to it is next
+void pipe_filled(Worker &w, SocketState &s, int res) {
+  if (res < 0) {
+    log_error("splice: %s\n", strerror(-res));
+    close_conn(w, s);
+  } else if (res == 0) {
+    // file got truncated, the promised length can't be sent any more
+    log_error("file shrank while sending: %s\n", s.file_name);
+    close_conn(w, s);
+  }
+}
+
+// io_uring: a splice of a download from the pipe into the socket is done
+void splice_done(Worker &w, SocketState &s, int res) {
+  s.send_busy = false;
+  if (res == -EAGAIN) {
+    // socket is full, the pipe is sent on when it has room
+    w.metrics.write_eagain.add();
+  } else if (res == -ECANCELED) {
+    // only part of the file got into the pipe, which is sent on as it is
+    s.can_write = true;
+  } else if (res < 0) {
+    log_error("splice: %s\n", strerror(-res));
+    close_conn(w, s);
+    return;
+  } else {
+    w.metrics.sendfile_bytes.record(res);
+    w.metrics.sent_bytes.add(res);
+    take_bytes(w, s, res);
+    s.file_off += res;
+    s.file_remaining -= res;
+    if (s.crc_streaming) {
+      checksum_sent(w, s);
+    }
+    s.can_write = true;
+    update_deadline(w, s, true, false);
+  }
+  resume(w, s);
+}
+
+// io_uring: a socket operation of a connection is done, which may have been
+// closed in the meantime
+void socket_op_done(Worker &w, Completion kind, uint64_t key, int res) {
+  SocketState *s = w.state.lookup(key);
+  auto closing = w.closing.end();
+  if (s == NULL) {
+    closing = w.closing.find(key);
+    if (closing == w.closing.end()) {
+      return;
+    }
+    s = w.state.lookup(closing->second);
+  }
+  s->ring_ops--;
+  // the pipe is only used again when empty
+  if (kind == Completion::PipeFilled && res > 0) {
+    s->pipe_len += res;
+  } else if (kind == Completion::Spliced && res > 0) {
+    s->pipe_len -= res;
+  }
+  if (closing != w.closing.end()) {
+    if (s->ring_ops == 0) {
+      w.closing.erase(closing);
+      release_conn(w, *s);
+    }
+    return;
+  }
+
+  if (kind == Completion::Received || kind == Completion::BodyReceived) {
+    recv_done(w, *s, kind, res);
+  } else if (kind == Completion::Sent) {
+    send_done(w, *s, res);
+  } else if (kind == Completion::PipeFilled) {
+    pipe_filled(w, *s, res);
+  } else {
+    splice_done(w, *s, res);
+  }
+}
+
+void run_uring(Worker &w) {
+  // event loop: one io_uring_enter both submits everything queued by the
+  // previous round and waits for new completions, unless connections are
+  // waiting for their turn
+  while (true) {
+    w.ring.submit(w.ready.empty() ? 1 : 0);
+    w.now = monotonic_ns();
+    struct io_uring_cqe *cqe;
+    while ((cqe = w.ring.peek_cqe()) != NULL) {
+      Completion kind = (Completion)(cqe->user_data >> 56);
+      uint64_t key = cqe->user_data & ((1ULL << 56) - 1);
+      int res = cqe->res;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+      w.ring.cqe_seen();
+
+      if (kind == Completion::Ignored) {
+        continue;
+      } else if (kind == Completion::Written) {
+        ring_write_done(w, key, res);
+        continue;
+      } else if (kind != Completion::PollReady &&
+                 kind != Completion::FileOpened) {
+        socket_op_done(w, kind, key, res);
+        continue;
+      }
+      SocketState *s = w.state.lookup(key);
+      if (kind == Completion::PollReady) {
+        if (s == NULL) {
+          continue;
+        }
+        if (res < 0) {
+          if (res != -ECANCELED) {
+            log_error("poll on fd %d: %s\n", s->fd, strerror(-res));
+          }
+          close_conn(w, *s);
+          continue;
+        }
+        if (!more) {
+          // multishot poll got terminated, e.g. on cq overflow: re-arm
+          uint32_t events = s->kind == SocketKind::Client
+                                ? POLLIN | POLLOUT | POLLRDHUP
+                                : POLLIN;
+          w.ring.prep_poll_multishot(s->fd, events,
+                                     make_user_data(PollReady, key));
+        }
+        handle_event(w, key, res);
+      } else if (kind == Completion::FileOpened) {
+        if (s == NULL) {
+          // connection is gone
+          if (res >= 0) {
+            close_file(w, res);
+          }
+          continue;
+        }
+        w.metrics.events.add();
+        file_opened(w, *s, res, NULL);
+        if (!handle_client(w, *s)) {
+          close_conn(w, *s);
+        }
+      }
+    }
+    run_ready(w);
+  }
+}
+
+// event loop of a worker
+void run_worker(Worker *worker, bool pin_cpu) {
+  Worker &w = *worker;
+  if (pin_cpu) {
+    pin_to_cpu(w.id);
+  }
+
+  if (w.backend == Backend::IoUring) {
+    run_uring(w);
+  } else {
+    run_epoll(w);
+  }
+}
+
+// print file cache counters of every worker, at any log level since they
+// were asked for
+void print_stats(std::vector<Worker> &workers) {
+  for (Worker &w : workers) {
+    const FileCache::Stats &stats = w.files.stats();
+    log_write(LOG_INFO,
+              "worker %d file cache: %llu hits (%llu in memory), %llu "
+              "misses, %llu invalidations, %llu evictions, %llu "
+              "compressions\n",
+              w.id, (unsigned long long)stats.hits.load(),
+              (unsigned long long)stats.memory_hits.load(),
+              (unsigned long long)stats.misses.load(),
+              (unsigned long long)stats.invalidations.load(),
+              (unsigned long long)stats.evictions.load(),
+              (unsigned long long)stats.compressions.load());
+    if (w.store.enabled()) {
+      const BlobStore::Stats &store = w.store.stats();
+      uint64_t bytes = store.bytes.load();
+      uint64_t saved = store.bytes_saved.load();
+      // bytes uploaded per byte stored
+      double ratio = bytes > saved ? (double)bytes / (bytes - saved) : 1.0;
+      log_write(LOG_INFO,
+                "worker %d blob store: %llu uploads (%llu duplicates), %llu "
+                "have hits, %llu have misses, %llu bytes saved of %llu, "
+                "dedup ratio %.2f\n",
+                w.id, (unsigned long long)store.uploads.load(),
+                (unsigned long long)store.duplicates.load(),
+                (unsigned long long)store.have_hits.load(),
+                (unsigned long long)store.have_misses.load(),
+                (unsigned long long)saved, (unsigned long long)bytes, ratio);
+    }
+  }
+}
+
+// counters of a worker exposed as prometheus counters
+struct CounterInfo {
+  const char *name;
+  const char *help;
+  Counter Metrics::*counter;
+};
+const CounterInfo COUNTERS[] = {
+    {"fileserver_connections_accepted_total", "Connections accepted.",
+     &Metrics::accepted},
+    {"fileserver_connections_closed_total", "Connections closed.",
+     &Metrics::closed},
+    {"fileserver_requests_failed_total", "Requests answered with a failure.",
+     &Metrics::failed},
+    {"fileserver_invalid_requests_total",
+     "Connections closed for sending invalid data.", &Metrics::invalid},
+    {"fileserver_received_bytes_total", "Bytes received from clients.",
+     &Metrics::received_bytes},
+    {"fileserver_sent_bytes_total", "Bytes sent to clients.",
+     &Metrics::sent_bytes},
+    {"fileserver_read_eagain_total", "Socket reads that found nothing.",
+     &Metrics::read_eagain},
+    {"fileserver_write_eagain_total", "Socket writes that found no room.",
+     &Metrics::write_eagain},
+    {"fileserver_events_total", "Readiness events and completions handled.",
+     &Metrics::events},
+    {"fileserver_turns_exceeded_total",
+     "Turns of a connection ended by the budget.", &Metrics::turns_exceeded},
+    {"fileserver_paced_total",
+     "Times a connection waited for tokens of a rate limit.",
+     &Metrics::paced},
+    {"fileserver_connections_rejected_total",
+     "Connections closed right after accept, over the limit or out of fds.",
+     &Metrics::rejected},
+    {"fileserver_passed_files_total",
+     "Downloads answered with the file over the unix socket.",
+     &Metrics::passed_files},
 };
 
-int read_exact(struct SocketState &state, size_t len) {
-  size_t read_len = 0;
-  char buffer[128];
-  while (read_len < len) {
-    int res = read(state.fd, buffer, std::min(sizeof(buffer), len - read_len));
-    if (res == 0) {
-      break;
+// the metrics of all workers in the prometheus text format
+std::string format_metrics(std::vector<Worker> &workers) {
+  MetricsWriter m;
+  std::vector<std::string> labels;
+  for (Worker &w : workers) {
+    labels.push_back("worker=\"" + std::to_string(w.id) + "\"");
+  }
+
+  for (const CounterInfo &info : COUNTERS) {
+    m.header(info.name, "counter", info.help);
+    for (size_t i = 0; i < workers.size(); i++) {
+      m.sample(info.name, labels[i], (workers[i].metrics.*info.counter).load());
     }
-    if (res < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        break;
+  }
+  m.header("fileserver_log_dropped_total", "counter",
+           "Log lines dropped because the ring of their thread was full.");
+  m.sample("fileserver_log_dropped_total", "", log_dropped());
+  m.header("fileserver_connections", "gauge", "Connections open.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    const Metrics &metrics = workers[i].metrics;
+    // closed is read first, so that this is never negative
+    uint64_t closed = metrics.closed.load();
+    m.sample("fileserver_connections", labels[i],
+             metrics.accepted.load() - closed);
+  }
+  m.header("fileserver_requests_total", "counter",
+           "Requests taken off the queue, by command.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+      m.sample("fileserver_requests_total",
+               labels[i] + ",command=\"" + COMMAND_NAMES[c] + "\"",
+               workers[i].metrics.requests[c].load());
+    }
+  }
+  m.header("fileserver_timeouts_total", "counter",
+           "Connections closed for taking too long, by what they waited for.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    for (int t = Timeout::IdleTimeout; t < TIMEOUT_COUNT; t++) {
+      m.sample("fileserver_timeouts_total",
+               labels[i] + ",timeout=\"" + TIMEOUT_NAMES[t] + "\"",
+               workers[i].metrics.timeouts[t].load());
+    }
+  }
+  m.header("fileserver_tls_handshakes_total", "counter",
+           "TLS handshakes, by who handles the records afterwards.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    for (int r = 0; r < TLS_RESULT_COUNT; r++) {
+      m.sample("fileserver_tls_handshakes_total",
+               labels[i] + ",result=\"" + TLS_RESULT_NAMES[r] + "\"",
+               workers[i].metrics.tls_handshakes[r].load());
+    }
+  }
+  m.header("fileserver_file_cache_lookups_total", "counter",
+           "File cache lookups, by result.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    const FileCache::Stats &stats = workers[i].files.stats();
+    uint64_t hits = stats.hits.load();
+    uint64_t memory_hits = stats.memory_hits.load();
+    m.sample("fileserver_file_cache_lookups_total",
+             labels[i] + ",result=\"memory_hit\"", memory_hits);
+    m.sample("fileserver_file_cache_lookups_total",
+             labels[i] + ",result=\"hit\"", hits - memory_hits);
+    m.sample("fileserver_file_cache_lookups_total",
+             labels[i] + ",result=\"miss\"", stats.misses.load());
+  }
+
+  m.header("fileserver_state_seconds", "histogram",
+           "Time connections spend in each state of a request.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    for (int st = 0; st < STATE_COUNT; st++) {
+      m.histogram("fileserver_state_seconds",
+                  labels[i] + ",state=\"" + STATE_NAMES[st] + "\"",
+                  workers[i].metrics.state_time[st], 1e-9);
+    }
+  }
+  m.header("fileserver_request_seconds", "histogram",
+           "Time from taking a request off the queue until it is answered.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    for (int c = 0; c < COMMAND_COUNT; c++) {
+      m.histogram("fileserver_request_seconds",
+                  labels[i] + ",command=\"" + COMMAND_NAMES[c] + "\"",
+                  workers[i].metrics.request_time[c], 1e-9);
+    }
+  }
+  m.header("fileserver_sendfile_bytes", "histogram",
+           "Bytes sent per sendfile call.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    m.histogram("fileserver_sendfile_bytes", labels[i],
+                workers[i].metrics.sendfile_bytes, 1);
+  }
+  m.header("fileserver_splice_bytes", "histogram",
+           "Upload bytes received per splice call.");
+  for (size_t i = 0; i < workers.size(); i++) {
+    m.histogram("fileserver_splice_bytes", labels[i],
+                workers[i].metrics.splice_bytes, 1);
+  }
+  return m.text();
+}
+
+// listen on a unix socket at path for metrics requests, returns -1 on error
+int listen_metrics(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_error("metrics socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    log_perror("socket");
+    return -1;
+  }
+  // left behind by an earlier run
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    log_perror("bind metrics socket");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// answer every connection to the metrics socket with the metrics page. a
+// request starting with GET gets it as an http resp, for curl --unix-socket
+// and for proxies in front of prometheus, anything else gets the bare page
+void serve_metrics(int listen_fd, std::vector<Worker> *workers) {
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        log_perror("accept metrics");
       }
-      return -1;
+      continue;
     }
-    state.read_buffer.insert(state.read_buffer.cend(), buffer, buffer + res);
-    read_len += res;
+    // a slow client must not hold up the next scrape for long, and whatever
+    // arrives within a moment tells how to answer
+    struct timeval send_timeout = {1, 0};
+    struct timeval recv_timeout = {0, 100000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+               sizeof(send_timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout,
+               sizeof(recv_timeout));
+    char req[256];
+    ssize_t len = recv(fd, req, 4, MSG_WAITALL);
+    bool http = len == 4 && memcmp(req, "GET ", 4) == 0;
+
+    std::string page = format_metrics(*workers);
+    if (http) {
+      char header[256];
+      int header_len =
+          snprintf(header, sizeof(header),
+                   "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                   "version=0.0.4\r\nContent-Length: %zu\r\nConnection: "
+                   "close\r\n\r\n",
+                   page.size());
+      page.insert(0, header, header_len);
+    }
+    write_all(fd, (const uint8_t *)page.data(), page.size());
+    // closing with the rest of the request unread would reset the
+    // connection and could lose the page, so wait for the client to close
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, req, sizeof(req), 0) > 0) {
+    }
+    close(fd);
+  }
+}
+
+// fds for as many connections as allowed
+void raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+// parse limits like conn=1m,client=10m,all=100m, leaving the ones not given
+bool parse_limits(const char *arg, uint64_t *conn, uint64_t *client,
+                  uint64_t *all) {
+  std::string limits = arg;
+  size_t start = 0;
+  while (start <= limits.size()) {
+    size_t end = limits.find(',', start);
+    if (end == std::string::npos) {
+      end = limits.size();
+    }
+    std::string limit = limits.substr(start, end - start);
+    size_t eq = limit.find('=');
+    if (eq == std::string::npos) {
+      return false;
+    }
+    std::string scope = limit.substr(0, eq);
+    uint64_t *rate = scope == "conn"     ? conn
+                     : scope == "client" ? client
+                     : scope == "all"    ? all
+                                         : NULL;
+    if (rate == NULL || !parse_size(limit.c_str() + eq + 1, rate)) {
+      return false;
+    }
+    start = end + 1;
   }
-  return read_len;
+  return true;
+}
+
+void usage(const char *name) {
+  eprintf("Usage: %s [--threads N] [--pin-cpu] [--backend epoll|io_uring] "
+          "[--cache-files N] [--cache-bytes N] [--cache-file-max N] "
+          "[--store DIR] [--durability none|fdatasync|group] "
+          "[--commit-ms N] [--disk-threads N] [--turn-bytes N] [--turn-us N] "
+          "[--limit-bytes LIMITS] [--limit-requests LIMITS] "
+          "[--idle-timeout S] [--header-timeout S] [--io-timeout S] "
+          "[--max-connections N] [--tls-cert FILE] [--tls-key FILE] "
+          "[--unix PATH] [--metrics PATH] "
+          "[--log-level error|warn|info|debug] port\n"
+          "\t--threads N: run N event loops, one per thread\n"
+          "\t--pin-cpu: pin each event loop thread to its own cpu\n"
+          "\t--backend: i/o backend of the event loops, defaults to epoll\n"
+          "\t--cache-files N: keep up to N files open per event loop, "
+          "defaults to %zu\n"
+          "\t--cache-bytes N: keep up to N bytes of file content in memory per "
+          "event loop, defaults to %zu\n"
+          "\t--cache-file-max N: only keep content of files up to N bytes, "
+          "defaults to %zu\n"
+          "\t--store DIR: deduplicate uploads through a content addressed "
+          "store in DIR\n"
+          "\t--durability: how uploads are made durable before they are "
+          "answered: not at all (the default), by an fdatasync each, or by a "
+          "group commit of all uploads within an interval\n"
+          "\t--commit-ms N: interval of the group commit in milliseconds, "
+          "defaults to %d\n"
+          "\t--disk-threads N: run opens, upload writes and the other file "
+          "operations that may block on N threads, so that a slow disk "
+          "doesn't stall the event loops, 0 to run them in the event loops, "
+          "defaults to %d\n"
+          "\t--turn-bytes N: move at most N bytes for a connection before "
+          "serving the others, 0 for no limit, defaults to %zu\n"
+          "\t--turn-us N: spend at most N microseconds on a connection "
+          "before serving the others, 0 for no limit, defaults to %d\n"
+          "\t--limit-bytes LIMITS: limit the bytes per second moved in both "
+          "directions, LIMITS are like conn=1m,client=10m,all=100m: for each "
+          "connection, each client address and everything\n"
+          "\t--limit-requests LIMITS: limit the requests per second, in the "
+          "same way\n"
+          "\t--idle-timeout S: close connections waiting S seconds for their "
+          "next request, defaults to %d\n"
+          "\t--header-timeout S: close connections whose request header is "
+          "not complete S seconds after it started, defaults to %d\n"
+          "\t--io-timeout S: close connections whose upload, batch or "
+          "download makes no progress for S seconds, defaults to %d\n"
+          "\t--max-connections N: close new connections while N are open, "
+          "defaults to %d\n"
+          "\tthe timeouts and the limit are off when 0\n"
+          "\t--tls-cert FILE: speak tls with the certificate chain in the "
+          "pem FILE, with the records encrypted by the kernel when it can\n"
+          "\t--tls-key FILE: private key of the certificate, defaults to the "
+          "certificate file\n"
+          "\t--unix PATH: also listen on a unix socket at PATH, where "
+          "downloads may be answered with the file itself\n"
+          "\t--metrics PATH: serve metrics in the prometheus text format on "
+          "a unix socket at PATH, over http when asked with GET\n"
+          "\t--log-level: print lines up to this level, defaults to info: "
+          "an access record for every request. debug adds the steps of "
+          "each request\n"
+          "send SIGUSR1 to print file cache and store counters\n",
+          name, DEFAULT_CACHED_FILES, DEFAULT_CACHED_BYTES,
+          DEFAULT_CACHED_FILE_MAX, DEFAULT_COMMIT_MS, DEFAULT_DISK_THREADS,
+          DEFAULT_TURN_BYTES, DEFAULT_TURN_US, DEFAULT_IDLE_TIMEOUT,
+          DEFAULT_HEADER_TIMEOUT, DEFAULT_IO_TIMEOUT, DEFAULT_MAX_CONNECTIONS);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    eprintf("Usage: %s port\n", argv[0]);
+  int threads = 1;
+  bool pin_cpu = false;
+  Backend backend = Backend::Epoll;
+  size_t cached_files = DEFAULT_CACHED_FILES;
+  size_t cached_bytes = DEFAULT_CACHED_BYTES;
+  size_t cached_file_max = DEFAULT_CACHED_FILE_MAX;
+  const char *store_dir = NULL;
+  Durability durability = Durability::NoSync;
+  int commit_ms = DEFAULT_COMMIT_MS;
+  int disk_threads = DEFAULT_DISK_THREADS;
+  size_t turn_bytes = DEFAULT_TURN_BYTES;
+  int turn_us = DEFAULT_TURN_US;
+  // of each connection, each client address and everything
+  Rates conn_rates = {0, 0};
+  Rates client_rates = {0, 0};
+  Rates global_rates = {0, 0};
+  int timeouts[TIMEOUT_COUNT] = {0, DEFAULT_IDLE_TIMEOUT,
+                                 DEFAULT_HEADER_TIMEOUT, DEFAULT_IO_TIMEOUT};
+  int max_connections = DEFAULT_MAX_CONNECTIONS;
+  const char *tls_cert = NULL;
+  const char *tls_key = NULL;
+  const char *unix_path = NULL;
+  const char *metrics_path = NULL;
+  static struct option long_options[] = {
+      {"threads", required_argument, NULL, 't'},
+      {"pin-cpu", no_argument, NULL, 'p'},
+      {"backend", required_argument, NULL, 'b'},
+      {"cache-files", required_argument, NULL, 'c'},
+      {"cache-bytes", required_argument, NULL, 'm'},
+      {"cache-file-max", required_argument, NULL, 's'},
+      {"store", required_argument, NULL, 'd'},
+      {"durability", required_argument, NULL, 'y'},
+      {"commit-ms", required_argument, NULL, 'g'},
+      {"disk-threads", required_argument, NULL, 'D'},
+      {"turn-bytes", required_argument, NULL, 'B'},
+      {"turn-us", required_argument, NULL, 'U'},
+      {"limit-bytes", required_argument, NULL, 'L'},
+      {"limit-requests", required_argument, NULL, 'R'},
+      {"idle-timeout", required_argument, NULL, 'I'},
+      {"header-timeout", required_argument, NULL, 'H'},
+      {"io-timeout", required_argument, NULL, 'O'},
+      {"max-connections", required_argument, NULL, 'C'},
+      {"tls-cert", required_argument, NULL, 'T'},
+      {"tls-key", required_argument, NULL, 'K'},
+      {"unix", required_argument, NULL, 'u'},
+      {"metrics", required_argument, NULL, 'M'},
+      {"log-level", required_argument, NULL, 'l'},
+      {NULL, 0, NULL, 0},
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv,
+                            "t:pb:c:m:s:d:y:g:D:B:U:L:R:I:H:O:C:T:K:u:M:l:",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      threads = atoi(optarg);
+      if (threads <= 0) {
+        eprintf("invalid thread count: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'p':
+      pin_cpu = true;
+      break;
+    case 'b':
+      if (strcmp(optarg, "epoll") == 0) {
+        backend = Backend::Epoll;
+      } else if (strcmp(optarg, "io_uring") == 0) {
+        backend = Backend::IoUring;
+      } else {
+        eprintf("unknown backend: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'c':
+      cached_files = strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      cached_bytes = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      cached_file_max = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      store_dir = optarg;
+      break;
+    case 'y':
+      if (strcmp(optarg, "none") == 0) {
+        durability = Durability::NoSync;
+      } else if (strcmp(optarg, "fdatasync") == 0) {
+        durability = Durability::SyncFile;
+      } else if (strcmp(optarg, "group") == 0) {
+        durability = Durability::GroupCommit;
+      } else {
+        eprintf("unknown durability: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'g':
+      commit_ms = atoi(optarg);
+      if (commit_ms < 0) {
+        eprintf("invalid commit interval: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'B':
+      turn_bytes = strtoul(optarg, NULL, 10);
+      break;
+    case 'U':
+      turn_us = atoi(optarg);
+      if (turn_us < 0) {
+        eprintf("invalid turn time: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'L':
+      if (!parse_limits(optarg, &conn_rates.bytes, &client_rates.bytes,
+                        &global_rates.bytes)) {
+        eprintf("invalid limits: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'R':
+      if (!parse_limits(optarg, &conn_rates.requests, &client_rates.requests,
+                        &global_rates.requests)) {
+        eprintf("invalid limits: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'I':
+    case 'H':
+    case 'O': {
+      Timeout timeout = opt == 'I'   ? Timeout::IdleTimeout
+                        : opt == 'H' ? Timeout::HeaderTimeout
+                                     : Timeout::IoTimeout;
+      timeouts[timeout] = atoi(optarg);
+      if (timeouts[timeout] < 0) {
+        eprintf("invalid timeout: %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'D':
+      disk_threads = atoi(optarg);
+      if (disk_threads < 0) {
+        eprintf("invalid disk thread count: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'C':
+      max_connections = atoi(optarg);
+      if (max_connections < 0) {
+        eprintf("invalid connection limit: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'T':
+      tls_cert = optarg;
+      break;
+    case 'K':
+      tls_key = optarg;
+      break;
+    case 'u':
+      unix_path = optarg;
+      break;
+    case 'M':
+      metrics_path = optarg;
+      break;
+    case 'l':
+      if (!parse_log_level(optarg, &log_level)) {
+        eprintf("unknown log level: %s\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
     return 1;
   }
-
-  // fd states
-  std::map<int, SocketState> state;
+  char *port = argv[optind];
 
   // ignore SIGPIPE because we use epoll to handle it
   signal(SIGPIPE, SIG_IGN);
 
-  // setup epoll
-  int epoll_fd = epoll_create1(0);
-  if (epoll_fd < 0) {
-    perror("epoll_create1");
+  SSL_CTX *tls = NULL;
+  if (tls_key != NULL && tls_cert == NULL) {
+    eprintf("--tls-key needs --tls-cert\n");
     return 1;
+  } else if (tls_cert != NULL) {
+    tls = tls_server_context(tls_cert, tls_key != NULL ? tls_key : tls_cert);
+    if (tls == NULL) {
+      eprintf("unable to load tls certificate: %s\n", tls_cert);
+      return 1;
+    }
   }
 
-  // bind to port
-  char *port = argv[1];
-  int error;
-  struct addrinfo hints, *res;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  error = getaddrinfo(NULL, port, &hints, &res);
-  if (error != 0 || res == NULL) {
-    eprintf("getaddrinfo: %s\n", gai_strerror(error));
+  DiskPool disk;
+  if (!disk.start(disk_threads)) {
     return 1;
   }
-  for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
-    int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (fd < 0) {
-      perror("socket");
-      continue;
+  RateLimiter limiter;
+  limiter.init(client_rates, global_rates);
+  std::atomic<int> connections(0);
+  raise_fd_limit();
+  int unix_fd = -1;
+  if (unix_path != NULL) {
+    unix_fd = listen_unix(unix_path);
+    if (unix_fd < 0) {
+      return 1;
     }
+  }
 
-    // set v6only when needed
-    if (p->ai_family == AF_INET6) {
-      int on = 1;
-      if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0) {
-        close(fd);
-        perror("setsockopt");
-        continue;
+  // setup workers, each with its own epoll and listen sockets
+  std::vector<Worker> workers(threads);
+  for (int i = 0; i < threads; i++) {
+    Worker &w = workers[i];
+    w.id = i;
+    w.backend = backend;
+    w.epoll_fd = -1;
+    if (w.backend == Backend::IoUring && !w.ring.init(4096)) {
+      eprintf("io_uring unavailable, falling back to epoll\n");
+      w.backend = Backend::Epoll;
+    }
+    if (w.backend == Backend::Epoll) {
+      w.epoll_fd = epoll_create1(0);
+      if (w.epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
       }
     }
 
-    // set reuseaddr
-    if (!so_reuseaddr(fd)) {
-      // fail
-      close(fd);
-      continue;
+    // pipe for splicing uploads, as large as allowed
+    if (pipe(w.pipe_fds) < 0) {
+      perror("pipe");
+      return 1;
+    }
+    int pipe_size = fcntl(w.pipe_fds[1], F_SETPIPE_SZ, 1024 * 1024);
+    if (pipe_size < 0) {
+      pipe_size = fcntl(w.pipe_fds[1], F_GETPIPE_SZ);
     }
+    w.pipe_size = pipe_size > 0 ? pipe_size : 65536;
 
-    // bind
-    if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
-      close(fd);
-      perror("bind");
-      continue;
+    // watch cached files for changes
+    int notify_fd = w.files.init(cached_files, cached_bytes, cached_file_max);
+    if (notify_fd >= 0 &&
+        add_socket(w, notify_fd, SocketKind::Notify, EPOLLIN | EPOLLET) ==
+            NULL) {
+      return 1;
     }
 
-    // listen
-    if (listen(fd, SOMAXCONN) < 0) {
-      close(fd);
-      perror("listen");
-      continue;
+    // group commit timer
+    w.durability = durability;
+    w.commit_ms = commit_ms;
+    w.commit_timer_fd = -1;
+    w.commit_step = CommitStep::CommitIdle;
+    w.commit_jobs = 0;
+    w.temp_seq = 0;
+    w.turn_bytes = turn_bytes > 0 ? turn_bytes : SIZE_MAX;
+    w.turn_ns = turn_us * 1000ull;
+    w.ready.reserve(QUEUE_RESERVE);
+    w.running.reserve(QUEUE_RESERVE);
+
+    // timer wheel for the deadlines of connections
+    w.now = monotonic_ns();
+    for (int t = 0; t < TIMEOUT_COUNT; t++) {
+      w.timeouts[t] = timeouts[t] * 1000000000ull;
+    }
+    w.wheel.init(w.now, TICK_NS);
+    w.tick_timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w.tick_timer_fd < 0) {
+      perror("timerfd_create");
+      return 1;
     }
+    if (add_socket(w, w.tick_timer_fd, SocketKind::Ticker,
+                   EPOLLIN | EPOLLET) == NULL) {
+      return 1;
+    }
+    w.connections = &connections;
+    w.max_connections = max_connections;
+    w.tls = tls;
+    w.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    // set non blocking
-    if (!nonblocking(fd)) {
-      // error
-      close(fd);
-      continue;
+    // finished jobs of the disk pool, which without threads only has the
+    // ones run right away
+    w.disk = &disk;
+    int disk_fd = w.disk_done.init();
+    if (disk_fd < 0 || add_socket(w, disk_fd, SocketKind::Disk,
+                                  EPOLLIN | EPOLLET) == NULL) {
+      return 1;
     }
 
-    // add to epoll
-    struct epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
-      close(fd);
-      perror("epoll_ctl");
-      continue;
+    // pacing timer, only needed with limits
+    w.limiter = &limiter;
+    w.conn_rates = conn_rates;
+    w.limited = conn_rates.bytes > 0 || conn_rates.requests > 0 ||
+                limiter.limited();
+    w.pace_timer_fd = -1;
+    w.pace_armed = 0;
+    w.paced.reserve(QUEUE_RESERVE);
+    if (w.limited) {
+      w.pace_timer_fd =
+          timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (w.pace_timer_fd < 0) {
+        perror("timerfd_create");
+        return 1;
+      }
+      if (add_socket(w, w.pace_timer_fd, SocketKind::Pacer,
+                     EPOLLIN | EPOLLET) == NULL) {
+        return 1;
+      }
+    }
+    if (durability == Durability::GroupCommit) {
+      w.commit_timer_fd =
+          timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (w.commit_timer_fd < 0) {
+        perror("timerfd_create");
+        return 1;
+      }
+      if (add_socket(w, w.commit_timer_fd, SocketKind::Timer,
+                     EPOLLIN | EPOLLET) == NULL) {
+        return 1;
+      }
     }
 
-    // print info
-    char hbuf[NI_MAXHOST];
-    char sbuf[NI_MAXSERV];
-    error = getnameinfo(p->ai_addr, p->ai_addrlen, hbuf, sizeof(hbuf), sbuf,
-                        sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
-    if (error != 0) {
-      eprintf("getnameinfo: %s\n", gai_strerror(error));
+    if (store_dir != NULL && !w.store.init(store_dir)) {
+      eprintf("unable to use blob store: %s\n", store_dir);
       return 1;
     }
-    printf("listening to %s:%s\n", hbuf, sbuf);
-    SocketState ss;
-    ss.fd = fd;
-    ss.is_listen = true;
-    state[fd] = ss;
-  }
-  freeaddrinfo(res);
 
-  if (state.size() == 0) {
-    eprintf("unable to bind\n");
-    return 1;
+    // bind to port
+    if (listen_on(w, port, threads > 1) == 0) {
+      eprintf("unable to bind\n");
+      return 1;
+    }
+    // the unix socket is shared, whichever worker is woken first accepts
+    if (unix_fd >= 0 && add_socket(w, unix_fd, SocketKind::Listen,
+                                   EPOLLIN | EPOLLET) == NULL) {
+      return 1;
+    }
   }
 
-  int max_event_count = 4096;
-  struct epoll_event *events = (struct epoll_event *)malloc(
-      max_event_count * sizeof(struct epoll_event));
-  memset(events, 0, max_event_count * sizeof(struct epoll_event));
+  int metrics_fd = -1;
+  if (metrics_path != NULL) {
+    metrics_fd = listen_metrics(metrics_path);
+    if (metrics_fd < 0) {
+      return 1;
+    }
+  }
 
-  // event loop
-  while (true) {
-    int count = epoll_wait(epoll_fd, events, max_event_count, -1);
-    for (int i = 0; i < count; i++) {
-      if (events[i].events & EPOLLERR | events[i].events & EPOLLHUP) {
-        eprintf("fd %d got error\n", events[i].data.fd);
-        close(events[i].data.fd);
-        continue;
-      }
+  // only the main thread takes SIGUSR1, SIGINT and SIGTERM, workers
+  // inherit the mask
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 
-      if (state.find(events[i].data.fd) != state.cend()) {
-        SocketState &s = state[events[i].data.fd];
-        if (s.is_listen) {
-          // accept all incoming sockets
-          for (;;) {
-            struct sockaddr_storage in_addr;
-            memset(&in_addr, 0, sizeof(in_addr));
-            socklen_t in_len = sizeof(in_addr);
-            int fd =
-                accept(events[i].data.fd, (struct sockaddr *)&in_addr, &in_len);
-            if (fd < 0) {
-              if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // no more socket to accept
-                break;
-              } else {
-                perror("accept");
-                break;
-              }
-            }
-
-            // set non blocking
-            if (!nonblocking(fd)) {
-              // error
-              close(fd);
-              continue;
-            }
-            tcp_nodelay(fd);
-
-            // print info
-            char hbuf[NI_MAXHOST];
-            char sbuf[NI_MAXSERV];
-            error = getnameinfo((struct sockaddr *)&in_addr, in_len, hbuf,
-                                sizeof(hbuf), sbuf, sizeof(sbuf),
-                                NI_NUMERICHOST | NI_NUMERICSERV);
-            if (error != 0) {
-              eprintf("getnameinfo: %s\n", gai_strerror(error));
-              close(fd);
-              continue;
-            }
-            printf("get connection from %s:%s\n", hbuf, sbuf);
-
-            // add to epoll
-            struct epoll_event event;
-            event.data.fd = fd;
-            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
-              close(fd);
-              perror("epoll_ctl");
-              continue;
-            }
-
-            // add to state
-            SocketState ss;
-            ss.fd = fd;
-            ss.is_listen = false;
-            ss.state = State::WaitForCommand;
-            state[fd] = ss;
-          }
-        } else {
-          // client
-          // try to read/write as much as possible until EAGAIN/EWOUDLBLOCK
-          bool invalid = false;
-          while (!invalid) {
-            // printf("state at %d\n", s.state);
-            if (s.state == State::WaitForCommand) {
-              if (read_exact(s, 1) == 1) {
-                if (s.read_buffer[0] == 0x0) {
-                  s.current_command = Command::Download;
-                } else if (s.read_buffer[0] == 0x1) {
-                  s.current_command = Command::Upload;
-                } else {
-                  invalid = true;
-                  break;
-                }
-                s.state = State::WaitForName;
-              } else {
-                // can't read more
-                break;
-              }
-            }
-
-            if (s.state == State::WaitForName) {
-              int expected_len = 256 + 1;
-              read_exact(s, expected_len - s.read_buffer.size());
-              if (s.read_buffer.size() == expected_len) {
-                // got name
-                std::vector<char> temp;
-                temp.assign(&s.read_buffer[1], &s.read_buffer[expected_len]);
-                // append NUL if length of name is 256 bytes
-                temp.push_back(0);
-                s.file_name = temp.data();
-                if (s.current_command == Command::Upload) {
-                  // upload
-                  printf("user wants to upload: %s\n", s.file_name.c_str());
-                  int fd = open(s.file_name.c_str(),
-                                O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                  if (fd < 0) {
-                    eprintf("unable to open file: %s\n", s.file_name.c_str());
-
-                    // error handling
-                    s.file_fd = -1;
-                    s.state = State::WaitForBodyLen;
-                  } else {
-                    s.file_fd = fd;
-                    s.state = State::WaitForBodyLen;
-                  }
-                } else {
-                  // download
-                  printf("user wants to download: %s\n", s.file_name.c_str());
-                  int fd = open(s.file_name.c_str(), O_RDONLY);
-                  if (fd < 0) {
-                    eprintf("unable to open file: %s\n", s.file_name.c_str());
-
-                    // error handling
-                    s.write_buffer.clear();
-                    // error resp
-                    s.write_buffer.push_back(0x00);
-                    s.buffer_written = 0;
-                    s.state = State::SendResp;
-                  } else {
-                    struct stat st;
-                    fstat(fd, &st);
-
-                    // 4GiB handling
-                    if (st.st_size > 0xFFFFFFFF) {
-                      // error handling
-                      s.write_buffer.clear();
-                      // error resp
-                      s.write_buffer.push_back(0x00);
-                      s.buffer_written = 0;
-                      s.state = State::SendResp;
-                      close(fd);
-                    } else {
-                      s.file_fd = fd;
-                      s.state = State::SendResp;
-                      s.write_buffer.clear();
-                      // download resp
-                      s.write_buffer.push_back(0x02);
-                      // length in big endian
-                      s.write_buffer.push_back((st.st_size >> 24) & 0xFF);
-                      s.write_buffer.push_back((st.st_size >> 16) & 0xFF);
-                      s.write_buffer.push_back((st.st_size >> 8) & 0xFF);
-                      s.write_buffer.push_back((st.st_size >> 0) & 0xFF);
-                      s.buffer_written = 0;
-                    }
-                  }
-                }
-              } else {
-                // can't read more
-                break;
-              }
-            }
-
-            if (s.state == State::WaitForBodyLen) {
-              int expected_len = 4 + 256 + 1;
-              read_exact(s, expected_len - s.read_buffer.size());
-              if (s.read_buffer.size() == expected_len) {
-                // got body len
-                s.body_len = ntohl(*(uint32_t *)&s.read_buffer[256 + 1]);
-                printf("receiving file of size %d\n", s.body_len);
-                s.written_len = 0;
-                s.state = State::WaitForBody;
-              } else {
-                // can't read more
-                break;
-              }
-            }
-
-            if (s.state == State::WaitForBody) {
-              char buffer[128];
-              while (s.written_len < s.body_len && !invalid) {
-                int res = read(s.fd, buffer,
-                               std::min((uint32_t)sizeof(buffer),
-                                        s.body_len - s.written_len));
-                if (res == EAGAIN || res == EWOULDBLOCK) {
-                  break;
-                } else if (res < 0) {
-                  perror("read");
-                  invalid = true;
-                  break;
-                }
-                s.written_len += res;
-
-                // write to file when applicable
-                if (s.file_fd >= 0) {
-                  uint32_t write_len = 0;
-                  while (write_len < res) {
-                    int res2 = write(s.file_fd, buffer, res - write_len);
-                    if (res2 < 0) {
-                      perror("write");
-                      invalid = true;
-                      break;
-                    }
-                    write_len += res2;
-                  }
-                }
-              }
-              if (s.body_len == s.written_len) {
-                if (s.file_fd == -1) {
-                  // upload failed
-                  s.write_buffer.clear();
-                  // error resp
-                  s.write_buffer.push_back(0x00);
-                  s.buffer_written = 0;
-                  s.state = State::SendResp;
-                } else {
-                  // close file
-                  close(s.file_fd);
-                  // done, send resp
-                  s.state = State::SendResp;
-                  s.buffer_written = 0;
-                  s.write_buffer.clear();
-                  // upload resp
-                  s.write_buffer.push_back(0x01);
-                }
-              }
-            }
-
-            if (s.state == State::SendResp) {
-              // send write_buffer to remote
-              while (s.buffer_written < s.write_buffer.size()) {
-                int written = write(s.fd, &s.write_buffer[s.buffer_written],
-                                    s.write_buffer.size() - s.buffer_written);
-                if (written < 0) {
-                  if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;
-                  }
-                  perror("write");
-                  break;
-                  // TODO: error handling
-                }
-                s.buffer_written += written;
-              }
-
-              if (s.buffer_written == s.write_buffer.size()) {
-                s.read_buffer.clear();
-                if (s.write_buffer.size() != 1) {
-                  // send file
-                  s.state = State::SendFile;
-                } else {
-                  // finish
-                  s.state = State::WaitForCommand;
-                }
-              }
-            }
-
-            if (s.state == State::SendFile) {
-              for (;;) {
-                int res = sendfile(s.fd, s.file_fd, NULL, 0xFFFFFFFF);
-                if (res == 0) {
-                  // EOF
-                  printf("complete sending file to client\n");
-                  close(s.file_fd);
-                  s.state = State::WaitForCommand;
-                  s.read_buffer.clear();
-                  break;
-                } else if (res < 0) {
-                  if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;
-                  }
-                  // error handling
-                  break;
-                }
-              }
-            }
-          }
+  // from now on lines go through the rings of the threads
+  log_start();
 
-          // got invalid data
-          if (invalid) {
-            printf("client sent invalid data, closing\n");
-            state.erase(events[i].data.fd);
-            close(events[i].data.fd);
-          }
-        }
-      }
+  std::vector<std::thread> handles;
+  for (int i = 0; i < threads; i++) {
+    handles.emplace_back(run_worker, &workers[i], pin_cpu);
+  }
+  if (metrics_fd >= 0) {
+    handles.emplace_back(serve_metrics, metrics_fd, &workers);
+  }
 
-      if (events[i].events & EPOLLRDHUP) {
-        // remote closed connection
-        printf("remote closed connection\n");
-        state.erase(events[i].data.fd);
-        close(events[i].data.fd);
-      }
+  // workers run forever, report cache counters when asked to
+  int sig;
+  while (sigwait(&sigs, &sig) == 0) {
+    if (sig == SIGUSR1) {
+      print_stats(workers);
+      continue;
     }
+    // write out what is still in the rings, then die of the signal as if it
+    // had not been caught
+    log_flush();
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+    raise(sig);
+  }
+  for (auto &handle : handles) {
+    handle.join();
   }
 
   return 0;
-}
\ No newline at end of file
+}
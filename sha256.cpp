@@ -0,0 +1,191 @@
+#include "sha256.h"
+#include <algorithm>
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+// process count blocks of 64 bytes
+static void blocks_portable(uint32_t state[8], const uint8_t *data,
+                            size_t count) {
+  for (; count > 0; count--, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 |
+             (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + K[i] + w[i];
+      uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#if defined(__x86_64__)
+// the same with the SHA extensions: the state is kept as ABEF and CDGH, and
+// every sha256rnds2 does two rounds
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+blocks_shani(uint32_t state[8], const uint8_t *data, size_t count) {
+  const __m128i MASK =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&state[0]), 0xB1);
+  __m128i state1 =
+      _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; count > 0; count--, data += 64) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i msg[4];
+    for (int i = 0; i < 4; i++) {
+      msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(data + 16 * i)), MASK);
+    }
+    // 4 rounds at a time, computing the message schedule 4 words ahead.
+    // unrolled, so that msg stays in registers
+#pragma GCC unroll 16
+    for (int i = 0; i < 16; i++) {
+      __m128i &cur = msg[i % 4];
+      __m128i &prev = msg[(i + 3) % 4];
+      __m128i &next = msg[(i + 1) % 4];
+      __m128i m =
+          _mm_add_epi32(cur, _mm_loadu_si128((const __m128i *)&K[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+      if (i >= 3 && i <= 14) {
+        next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4));
+        next = _mm_sha256msg2_epu32(next, cur);
+      }
+      m = _mm_shuffle_epi32(m, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+      if (i >= 1 && i <= 12) {
+        prev = _mm_sha256msg1_epu32(prev, cur);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+  _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static void blocks(uint32_t state[8], const uint8_t *data, size_t count) {
+#if defined(__x86_64__)
+  static const bool shani = []() {
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+           (ebx & bit_SHA) && __builtin_cpu_supports("sse4.1");
+  }();
+  if (shani) {
+    blocks_shani(state, data, count);
+    return;
+  }
+#endif
+  blocks_portable(state, data, count);
+}
+
+Sha256::Sha256() : length(0), buffered(0) {
+  static const uint32_t INIT[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+  memcpy(state, INIT, sizeof(state));
+}
+
+void Sha256::update(const void *data, size_t len) {
+  const uint8_t *next = (const uint8_t *)data;
+  length += len;
+  if (buffered > 0) {
+    size_t fill = std::min(len, sizeof(buffer) - buffered);
+    memcpy(&buffer[buffered], next, fill);
+    buffered += fill;
+    next += fill;
+    len -= fill;
+    if (buffered < sizeof(buffer)) {
+      return;
+    }
+    blocks(state, buffer, 1);
+    buffered = 0;
+  }
+  blocks(state, next, len / 64);
+  next += len / 64 * 64;
+  len %= 64;
+  memcpy(buffer, next, len);
+  buffered = len;
+}
+
+void Sha256::final(uint8_t digest[SHA256_LEN]) {
+  // a one bit, zeros, then the length in bits
+  uint64_t bits = length * 8;
+  uint8_t pad[72] = {0x80};
+  size_t pad_len = (buffered < 56 ? 56 : 120) - buffered;
+  for (int i = 0; i < 8; i++) {
+    pad[pad_len + i] = bits >> (56 - 8 * i);
+  }
+  update(pad, pad_len + 8);
+  for (int i = 0; i < 8; i++) {
+    digest[4 * i] = state[i] >> 24;
+    digest[4 * i + 1] = state[i] >> 16;
+    digest[4 * i + 2] = state[i] >> 8;
+    digest[4 * i + 3] = state[i];
+  }
+}
+
+void sha256_hex(const uint8_t digest[SHA256_LEN],
+                char hex[2 * SHA256_LEN + 1]) {
+  static const char DIGITS[] = "0123456789abcdef";
+  for (int i = 0; i < SHA256_LEN; i++) {
+    hex[2 * i] = DIGITS[digest[i] >> 4];
+    hex[2 * i + 1] = DIGITS[digest[i] & 0xF];
+  }
+  hex[2 * SHA256_LEN] = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+const int SHA256_LEN = 32;
+
+// incremental SHA-256, using the SHA extensions when the cpu has them
+class Sha256 {
+public:
+  Sha256();
+
+  void update(const void *data, size_t len);
+  // write the digest of everything passed to update()
+  void final(uint8_t digest[SHA256_LEN]);
+
+private:
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t buffer[64];
+  size_t buffered;
+};
+
+// format a digest as 64 lowercase hex digits and a NUL
+void sha256_hex(const uint8_t digest[SHA256_LEN], char hex[2 * SHA256_LEN + 1]);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdint.h>
+#include <vector>
+
+// slots with stable addresses, recycled through a free list
+//
+// a slot is named by a key: | generation (24 bits) | index (32 bits) |, the
+// generation changes every time the slot is reused, so a key of a freed slot
+// never finds the new occupant. the top 8 bits of a key are always zero and
+// can be used by callers to tag it.
+template <typename T> class Slab {
+public:
+  static const uint32_t GENERATION_MASK = 0xFFFFFF;
+
+  Slab() {}
+  ~Slab() {
+    for (Slot *chunk : chunks) {
+      delete[] chunk;
+    }
+  }
+
+  // allocate a slot, returns its key
+  uint64_t alloc() {
+    if (free_list.empty()) {
+      // grow by a whole chunk so that existing slots never move
+      uint32_t base = chunks.size() * CHUNK_SIZE;
+      chunks.push_back(new Slot[CHUNK_SIZE]);
+      for (uint32_t i = CHUNK_SIZE; i > 0; i--) {
+        free_list.push_back(base + i - 1);
+      }
+    }
+    uint32_t index = free_list.back();
+    free_list.pop_back();
+    Slot &slot = get(index);
+    slot.used = true;
+    used++;
+    return ((uint64_t)slot.generation << 32) | index;
+  }
+
+  // release the slot of key, invalidating the key
+  void free(uint64_t key) {
+    uint32_t index = (uint32_t)key;
+    Slot &slot = get(index);
+    slot.used = false;
+    slot.generation = (slot.generation + 1) & GENERATION_MASK;
+    slot.value = T();
+    free_list.push_back(index);
+    used--;
+  }
+
+  // give the slot of key a new key, after which key finds nothing, while the
+  // value stays where it is. returns the new key
+  uint64_t rekey(uint64_t key) {
+    Slot &slot = get((uint32_t)key);
+    slot.generation = (slot.generation + 1) & GENERATION_MASK;
+    return ((uint64_t)slot.generation << 32) | (uint32_t)key;
+  }
+
+  // find the value of key, NULL if the slot has been freed or reused
+  T *lookup(uint64_t key) {
+    uint32_t index = (uint32_t)key;
+    if (index >= chunks.size() * CHUNK_SIZE) {
+      return NULL;
+    }
+    Slot &slot = get(index);
+    if (!slot.used || slot.generation != ((key >> 32) & GENERATION_MASK)) {
+      return NULL;
+    }
+    return &slot.value;
+  }
+
+  size_t size() const { return used; }
+
+private:
+  static const uint32_t CHUNK_SIZE = 1024;
+
+  struct Slot {
+    T value = T();
+    uint32_t generation = 0;
+    bool used = false;
+  };
+
+  Slot &get(uint32_t index) {
+    return chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+  }
+
+  std::vector<Slot *> chunks;
+  std::vector<uint32_t> free_list;
+  size_t used = 0;
+};
+
+#endif
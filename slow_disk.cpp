@@ -0,0 +1,74 @@
+// LD_PRELOAD shim that makes the disk look slow, to see what a stalled open
+// or write does to the server: opening a path that contains SLOW_DISK_MATCH
+// (defaults to "slow"), and every write to a regular file, first sleeps for
+// SLOW_DISK_US microseconds (defaults to 100000)
+//
+//   LD_PRELOAD=./libslow_disk.so ./server 8080
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static useconds_t delay_us() {
+  const char *us = getenv("SLOW_DISK_US");
+  return us != NULL ? atoi(us) : 100000;
+}
+
+static void delay_path(const char *path) {
+  const char *match = getenv("SLOW_DISK_MATCH");
+  if (strstr(path, match != NULL ? match : "slow") != NULL) {
+    usleep(delay_us());
+  }
+}
+
+static void delay_fd(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    usleep(delay_us());
+  }
+}
+
+template <typename F> static F real(const char *name) {
+  return (F)dlsym(RTLD_NEXT, name);
+}
+
+extern "C" {
+
+int open(const char *path, int flags, ...) {
+  static auto next = real<int (*)(const char *, int, ...)>("open");
+  mode_t mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+  delay_path(path);
+  return next(path, flags, mode);
+}
+
+ssize_t write(int fd, const void *buffer, size_t len) {
+  static auto next = real<ssize_t (*)(int, const void *, size_t)>("write");
+  delay_fd(fd);
+  return next(fd, buffer, len);
+}
+
+ssize_t pwrite(int fd, const void *buffer, size_t len, off_t off) {
+  static auto next =
+      real<ssize_t (*)(int, const void *, size_t, off_t)>("pwrite");
+  delay_fd(fd);
+  return next(fd, buffer, len, off);
+}
+
+ssize_t splice(int in_fd, loff_t *in_off, int out_fd, loff_t *out_off,
+               size_t len, unsigned int flags) {
+  static auto next =
+      real<ssize_t (*)(int, loff_t *, int, loff_t *, size_t, unsigned int)>(
+          "splice");
+  delay_fd(out_fd);
+  return next(in_fd, in_off, out_fd, out_off, len, flags);
+}
+}
@@ -0,0 +1,68 @@
+#include "timer_wheel.h"
+#include <algorithm>
+
+TimerWheel::TimerWheel() : tick_len(1), current(0), count(0) {}
+
+void TimerWheel::init(uint64_t now, uint64_t tick_ns) {
+  tick_len = tick_ns;
+  current = now / tick_ns;
+}
+
+uint64_t TimerWheel::add(uint64_t key, uint64_t at) {
+  // rounded up, and never in a tick that has expired already
+  uint64_t tick = (at + tick_len - 1) / tick_len;
+  if (tick <= current) {
+    tick = current + 1;
+  }
+  place(Timer{key, tick});
+  count++;
+  return tick;
+}
+
+void TimerWheel::place(const Timer &timer) {
+  uint64_t delta = timer.tick - current;
+  for (int level = 0; level < LEVELS; level++) {
+    int shift = SLOT_BITS * level;
+    if (delta < (1ull << (shift + SLOT_BITS)) || level == LEVELS - 1) {
+      // too far for the last level: expires at its end, and gets placed
+      // again from there
+      uint64_t tick = timer.tick;
+      if (delta >= (1ull << (shift + SLOT_BITS))) {
+        tick = current + (1ull << (shift + SLOT_BITS)) - 1;
+      }
+      slots[level][(tick >> shift) & (SLOTS - 1)].push_back(timer);
+      return;
+    }
+  }
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer> &expired) {
+  uint64_t target = now / tick_len;
+  while (current < target && count > 0) {
+    current++;
+    // when the ticks of a slot of level l begin, its timers move down, so
+    // that they are at the first level when due
+    for (int level = 1; level < LEVELS; level++) {
+      int shift = SLOT_BITS * level;
+      if ((current & ((1ull << shift) - 1)) != 0) {
+        break;
+      }
+      // a timer may go back to the same slot
+      std::vector<Timer> &slot = slots[level][(current >> shift) & (SLOTS - 1)];
+      moving.assign(slot.begin(), slot.end());
+      slot.clear();
+      for (const Timer &timer : moving) {
+        place(timer);
+      }
+    }
+    // everything in a slot of the first level is due at its tick
+    std::vector<Timer> &slot = slots[0][current & (SLOTS - 1)];
+    expired.insert(expired.end(), slot.begin(), slot.end());
+    count -= slot.size();
+    slot.clear();
+  }
+  if (count == 0) {
+    // nothing to tick through
+    current = std::max(current, target);
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// hierarchical timing wheel: LEVELS wheels of SLOTS slots each, a slot of
+// level l spans SLOTS^l ticks. adding a timer is O(1); every tick expires
+// one slot of the first level and, once every SLOTS^l ticks, moves the
+// timers of one slot of level l down to where they now belong. timers are
+// never removed: whoever owns a key checks on expiry whether it still
+// wants it. times are in nanoseconds
+class TimerWheel {
+public:
+  struct Timer {
+    uint64_t key;
+    uint64_t tick;
+  };
+
+  TimerWheel();
+
+  void init(uint64_t now, uint64_t tick_ns);
+
+  // expire key at the first tick at or after at, which is returned. timers
+  // beyond the last level expire at its end
+  uint64_t add(uint64_t key, uint64_t at);
+  // tick up to now, appending the timers that expired to expired
+  void advance(uint64_t now, std::vector<Timer> &expired);
+
+  size_t size() const { return count; }
+  uint64_t tick_ns() const { return tick_len; }
+
+private:
+  static const int SLOT_BITS = 6;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int LEVELS = 4;
+
+  void place(const Timer &timer);
+
+  uint64_t tick_len;
+  // every tick up to this one has expired
+  uint64_t current;
+  size_t count;
+  // slots keep their storage when emptied, and so does the scratch vector
+  // the timers of a slot are moved through, so ticking doesn't allocate
+  // once the wheel has held as many timers as it will
+  std::vector<Timer> slots[LEVELS][SLOTS];
+  std::vector<Timer> moving;
+};
+
+#endif
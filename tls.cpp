@@ -0,0 +1,157 @@
+#include "tls.h"
+#include <errno.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <string.h>
+
+// options of both sides: records handed to the kernel when it takes them,
+// and a peer closing the socket without close_notify reads as the end of the
+// stream, as clients of the protocol just close it
+static void set_common_options(SSL_CTX *ctx) {
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+  // writes return after each record, and are retried from wherever the data
+  // is by then. idle connections don't keep the record buffers
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+}
+
+SSL_CTX *tls_server_context(const char *cert_file, const char *key_file) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+  set_common_options(ctx);
+  // a session ticket would be written after the handshake, where the kernel
+  // may have taken over the records already
+  SSL_CTX_set_num_tickets(ctx, 0);
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+SSL_CTX *tls_client_context(const char *ca_file) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (ctx == NULL) {
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+  set_common_options(ctx);
+  if (ca_file != NULL) {
+    if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+      ERR_print_errors_fp(stderr);
+      SSL_CTX_free(ctx);
+      return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  }
+  return ctx;
+}
+
+SSL *tls_new(SSL_CTX *ctx, int fd, bool server) {
+  SSL *ssl = SSL_new(ctx);
+  if (ssl == NULL) {
+    return NULL;
+  }
+  if (SSL_set_fd(ssl, fd) != 1) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  if (server) {
+    SSL_set_accept_state(ssl);
+  } else {
+    SSL_set_connect_state(ssl);
+  }
+  return ssl;
+}
+
+// turn the result of an SSL call into a result of read() or write()
+static int fail(SSL *ssl, int res) {
+  switch (SSL_get_error(ssl, res)) {
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0) {
+      errno = ECONNRESET;
+    }
+    return -1;
+  default:
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+int tls_handshake(SSL *ssl) {
+  ERR_clear_error();
+  int res = SSL_do_handshake(ssl);
+  if (res == 1) {
+    return 1;
+  }
+  res = fail(ssl, res);
+  if (res == 0) {
+    // closed in the middle of it
+    errno = ECONNRESET;
+  }
+  return -1;
+}
+
+bool tls_kernel_send(SSL *ssl) {
+#ifdef BIO_get_ktls_send
+  return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+  return false;
+#endif
+}
+
+bool tls_kernel_recv(SSL *ssl) {
+#ifdef BIO_get_ktls_recv
+  return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+  return false;
+#endif
+}
+
+ssize_t tls_read(SSL *ssl, void *buffer, size_t len) {
+  ERR_clear_error();
+  size_t read_len;
+  int res = SSL_read_ex(ssl, buffer, len, &read_len);
+  return res == 1 ? (ssize_t)read_len : fail(ssl, res);
+}
+
+ssize_t tls_write(SSL *ssl, const void *buffer, size_t len) {
+  ERR_clear_error();
+  size_t written;
+  int res = SSL_write_ex(ssl, buffer, len, &written);
+  if (res == 1) {
+    return written;
+  }
+  res = fail(ssl, res);
+  if (res == 0) {
+    // close_notify while writing, the peer won't read any more
+    errno = EPIPE;
+    res = -1;
+  }
+  return res;
+}
+
+const char *tls_error() {
+  static thread_local char buffer[256];
+  unsigned long error = ERR_get_error();
+  if (error == 0) {
+    return strerror(errno);
+  }
+  ERR_error_string_n(error, buffer, sizeof(buffer));
+  ERR_clear_error();
+  return buffer;
+}
@@ -0,0 +1,43 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// TLS over sockets: OpenSSL does the handshake and then hands the record
+// layer to the kernel (kTLS) when it can. a direction the kernel took is read
+// or written like a plain socket, sendfile and splice included, the other
+// goes through SSL_read/SSL_write in user space. errors are printed to stderr
+// while setting up, and left in the OpenSSL error queue for tls_error()
+// afterwards
+
+// context for accepting connections with the certificate chain and private
+// key in the PEM files, NULL on error
+SSL_CTX *tls_server_context(const char *cert_file, const char *key_file);
+// context for connecting, trusting ca_file, or any certificate when it is
+// NULL. NULL on error
+SSL_CTX *tls_client_context(const char *ca_file);
+
+// TLS of the connected socket fd, NULL on error
+SSL *tls_new(SSL_CTX *ctx, int fd, bool server);
+// go on with the handshake: 1 when done, -1 on error or, like read(), with
+// errno set to EAGAIN when the socket is not ready
+int tls_handshake(SSL *ssl);
+// after the handshake: whether the kernel encrypts what is written to the
+// socket, and decrypts what is read from it
+bool tls_kernel_send(SSL *ssl);
+bool tls_kernel_recv(SSL *ssl);
+
+// like read() and write() in user space, 0 from tls_read() is the end of the
+// stream. after tls_write() fails with EAGAIN the record is encrypted
+// already, so the next call has to pass the same data again, at least as
+// much of it as before up to TLS_MAX_RECORD bytes
+ssize_t tls_read(SSL *ssl, void *buffer, size_t len);
+ssize_t tls_write(SSL *ssl, const void *buffer, size_t len);
+const size_t TLS_MAX_RECORD = 16 * 1024;
+
+// describe and clear the errors of the calls on this thread
+const char *tls_error();
+
+#endif
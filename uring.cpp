@@ -0,0 +1,229 @@
+#include "uring.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+Uring::Uring()
+    : ring_fd(-1), sqes(NULL), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED) {}
+
+Uring::~Uring() {
+  if (sqes != NULL) {
+    munmap(sqes, sqes_len);
+  }
+  if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+    munmap(cq_ptr, cq_len);
+  }
+  if (sq_ptr != MAP_FAILED) {
+    munmap(sq_ptr, sq_len);
+  }
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+}
+
+bool Uring::init(unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring_fd < 0) {
+    log_perror("io_uring_setup");
+    return false;
+  }
+
+  // map submission and completion queues
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_len > sq_len) {
+      sq_len = cq_len;
+    }
+    cq_len = sq_len;
+  }
+  sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    log_perror("mmap");
+    return false;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  } else {
+    cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+      log_perror("mmap");
+      return false;
+    }
+  }
+  sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  void *ptr = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) {
+    log_perror("mmap");
+    return false;
+  }
+  sqes = (struct io_uring_sqe *)ptr;
+
+  char *sq = (char *)sq_ptr;
+  sq_head = (unsigned *)(sq + p.sq_off.head);
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  sqe_tail = *sq_tail;
+  // sqes are always used in order, so the index array is the identity
+  unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries; i++) {
+    sq_array[i] = i;
+  }
+
+  char *cq = (char *)cq_ptr;
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+struct io_uring_sqe *Uring::get_sqe(unsigned room) {
+  if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + room >
+      sq_entries) {
+    // queue is full, hand it to the kernel first
+    submit(0);
+  }
+  struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe_tail++;
+  return sqe;
+}
+
+int Uring::submit(unsigned wait_nr) {
+  unsigned tail = *sq_tail;
+  unsigned to_submit = sqe_tail - tail;
+  if (to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    int res = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags,
+                      NULL, 0);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EBUSY) {
+        // completion queue is full, let the caller reap first
+        return 0;
+      }
+      log_perror("io_uring_enter");
+    }
+    return res;
+  }
+}
+
+struct io_uring_cqe *Uring::peek_cqe() {
+  unsigned head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &cqes[head & cq_mask];
+}
+
+void Uring::cqe_seen() {
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void Uring::prep_poll_multishot(int fd, uint32_t events, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_poll_remove(uint64_t target, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_openat(const char *path, int flags, mode_t mode,
+                        uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)path;
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_close(int fd, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_recv(int fd, void *buffer, size_t len, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)buffer;
+  sqe->len = len;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_sendmsg(int fd, const struct msghdr *msg, int flags,
+                         uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_write(int fd, const void *buffer, size_t len, off_t off,
+                       uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)buffer;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_splice(int fd_in, off_t off_in, int fd_out, size_t len,
+                        bool linked, uint64_t user_data) {
+  // with the entry linked to it
+  struct io_uring_sqe *sqe = get_sqe(linked ? 2 : 1);
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->fd = fd_out;
+  sqe->off = (uint64_t)-1;
+  sqe->splice_fd_in = fd_in;
+  sqe->splice_off_in = (uint64_t)off_in;
+  sqe->len = len;
+  if (linked) {
+    sqe->flags |= IOSQE_IO_LINK;
+  }
+  sqe->user_data = user_data;
+}
+
+void Uring::prep_cancel_fd(int fd, uint64_t user_data) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = user_data;
+}
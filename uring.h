@@ -0,0 +1,72 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct msghdr;
+
+// minimal io_uring wrapper on top of the raw syscalls
+class Uring {
+public:
+  Uring();
+  ~Uring();
+
+  bool init(unsigned entries);
+
+  // get a free submission entry, flushing the queue to the kernel unless
+  // room entries are free, so that linked ones go in the same submission
+  struct io_uring_sqe *get_sqe(unsigned room = 1);
+  // submit pending entries and wait for at least wait_nr completions
+  int submit(unsigned wait_nr);
+  // get the next completion, NULL if there is none
+  struct io_uring_cqe *peek_cqe();
+  // mark the completion returned by peek_cqe() as consumed
+  void cqe_seen();
+
+  void prep_poll_multishot(int fd, uint32_t events, uint64_t user_data);
+  void prep_poll_remove(uint64_t target, uint64_t user_data);
+  void prep_openat(const char *path, int flags, mode_t mode,
+                   uint64_t user_data);
+  void prep_close(int fd, uint64_t user_data);
+  void prep_recv(int fd, void *buffer, size_t len, uint64_t user_data);
+  void prep_sendmsg(int fd, const struct msghdr *msg, int flags,
+                    uint64_t user_data);
+  void prep_write(int fd, const void *buffer, size_t len, off_t off,
+                  uint64_t user_data);
+  // move len bytes from fd_in at off_in, -1 for a pipe or socket, to fd_out.
+  // a linked one is followed by the next entry, which runs only after all
+  // len bytes were moved and fails with -ECANCELED otherwise
+  void prep_splice(int fd_in, off_t off_in, int fd_out, size_t len,
+                   bool linked, uint64_t user_data);
+  // cancel every operation in flight on fd
+  void prep_cancel_fd(int fd, uint64_t user_data);
+
+private:
+  int ring_fd;
+
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  // entries prepared but not yet published to the kernel
+  unsigned sqe_tail;
+
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+};
+
+#endif